@@ -0,0 +1,187 @@
+// Admission Control for Memory Intensive Requests
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _ADMISSIONCONTROL_H
+#define _ADMISSIONCONTROL_H
+
+
+#include <ctime>
+#include <cstddef>
+#include "Mutex.h"
+
+
+
+/// Limits the number and memory cost of region requests processed at the same time
+/** Region requests, such as CVT exports, allocate buffers for the whole region before
+    any output is produced, so a few large requests can exhaust our memory. Each such
+    request must first reserve its estimated memory cost from a global budget, along with
+    one of a limited number of slots. Requests that do not fit wait in a bounded queue
+    until enough is released or their deadline passes. Requests that cannot be queued or
+    whose deadline passes are shed and should be answered with 503 Service Unavailable.
+    A request is always admitted if nothing else is running, however large it is.
+ */
+class AdmissionControl {
+
+ private:
+
+  /// Memory budget in bytes and maximum number of concurrent requests. 0 means no limit
+  size_t budget;
+  unsigned int concurrency;
+
+  /// Maximum number of waiting requests and time in seconds they may wait
+  unsigned int queue;
+  unsigned int timeout;
+
+  /// Memory reserved and number of requests running or waiting
+  size_t used;
+  unsigned int active;
+  unsigned int waiting;
+
+  /// Number of requests admitted immediately, admitted after waiting and shed
+  unsigned long admitted;
+  unsigned long delayed;
+  unsigned long shed;
+
+  /// Lock protecting our counters and condition signalled when a request finishes
+  Mutex lock;
+  Condition released;
+
+  /// Whether a request of a given cost can be admitted now
+  bool fits( size_t cost ) const {
+    if( active == 0 ) return true;
+    if( concurrency > 0 && active >= concurrency ) return false;
+    if( budget > 0 && used + cost > budget ) return false;
+    return true;
+  };
+
+  /// Disallow copying
+  AdmissionControl( const AdmissionControl& );
+  AdmissionControl& operator = ( const AdmissionControl& );
+
+
+ public:
+
+  /// Constructor
+  /** @param b memory budget in MB or 0 for no limit
+      @param c maximum number of concurrent requests or 0 for no limit
+      @param q maximum number of waiting requests
+      @param t time in seconds a request may wait
+   */
+  AdmissionControl( float b, unsigned int c, unsigned int q, unsigned int t ) :
+    budget( (size_t)( b * 1048576.0 ) ), concurrency( c ), queue( q ), timeout( t ),
+    used( 0 ), active( 0 ), waiting( 0 ), admitted( 0 ), delayed( 0 ), shed( 0 ) {};
+
+  /// Whether any limit has been set
+  bool enabled() const { return ( budget > 0 || concurrency > 0 ); };
+
+  /// Reserve the resources for a request, waiting for them if necessary
+  /** @param cost estimated memory cost in bytes
+      @return false if the request should be shed
+   */
+  bool acquire( size_t cost ) {
+    ScopedLock l( lock );
+
+    if( !fits( cost ) ){
+      if( waiting >= queue ){
+	shed++;
+	return false;
+      }
+      struct timespec deadline;
+      deadline.tv_sec = time( NULL ) + timeout;
+      deadline.tv_nsec = 0;
+      waiting++;
+      while( !fits( cost ) ){
+	if( !released.wait( lock, deadline ) && !fits( cost ) ){
+	  waiting--;
+	  shed++;
+	  return false;
+	}
+      }
+      waiting--;
+      delayed++;
+    }
+    else admitted++;
+
+    used += cost;
+    active++;
+    return true;
+  };
+
+  /// Release the resources reserved by a request
+  /** @param cost the cost given to acquire() */
+  void release( size_t cost ) {
+    ScopedLock l( lock );
+    used -= cost;
+    active--;
+    released.broadcast();
+  };
+
+  /// Number of seconds after which a shed request may be retried
+  unsigned int getRetryAfter() const { return ( timeout > 0 ) ? timeout : 1; };
+
+  /// Return our limits and counters
+  size_t getBudget() const { return budget; };
+  unsigned int getConcurrency() const { return concurrency; };
+  size_t getUsed() { ScopedLock l( lock ); return used; };
+  unsigned int getActive() { ScopedLock l( lock ); return active; };
+  unsigned int getWaiting() { ScopedLock l( lock ); return waiting; };
+  unsigned long getAdmitted() { ScopedLock l( lock ); return admitted; };
+  unsigned long getDelayed() { ScopedLock l( lock ); return delayed; };
+  unsigned long getShed() { ScopedLock l( lock ); return shed; };
+
+};
+
+
+
+/// Holds an admission for the lifetime of the object
+/** Throws an int 503 HTTP status if the request is shed */
+class Admission {
+
+ private:
+
+  AdmissionControl* control;
+  size_t cost;
+
+  /// Disallow copying
+  Admission( const Admission& );
+  Admission& operator = ( const Admission& );
+
+
+ public:
+
+  /// Constructor
+  /** @param c our admission control or NULL if disabled
+      @param n estimated memory cost in bytes
+   */
+  Admission( AdmissionControl* c, size_t n ) : control( c ), cost( n ) {
+    if( control && control->enabled() && !control->acquire( cost ) ) throw 503;
+  };
+
+  /// Destructor
+  ~Admission() {
+    if( control && control->enabled() ) control->release( cost );
+  };
+
+};
+
+
+#endif
@@ -130,6 +130,24 @@ void CVT::send( Session* session ){
   }
 
 
+  // Estimate the memory needed for our region and the resized output. Regions are held as floats
+  // while processing images of more than 8 bits or when we have been asked to apply filters
+  unsigned int channels = (*session->image)->channels;
+  size_t sample_size = (*session->image)->bpc / 8;
+  if( sample_size < 1 ) sample_size = 1;
+  if( (*session->image)->bpc > 8 || session->view->floatProcessing() ) sample_size += 4;
+  size_t cost = (size_t) view_width * view_height * channels * sample_size +
+    (size_t) resampled_width * resampled_height * channels;
+
+  // Reserve this from our admission control before producing any output, which may mean
+  // waiting for other requests to finish or being turned away with a 503
+  Admission admission( session->admission, cost );
+
+  if( session->loglevel >= 4 ){
+    *(session->logfile) << "CVT :: Admitted request with estimated cost of " << cost << " bytes" << endl;
+  }
+
+
 #ifndef DEBUG
 
   // Define our separator depending on the OS
@@ -165,10 +183,12 @@ void CVT::send( Session* session ){
 
   // Get our requested region from our TileManager
   TileManager tilemanager( session->tileCache, *session->image, session->watermark, session->jpeg, session->logfile, session->loglevel );
+  tilemanager.setThreadPool( session->threadPool, session->imagePool );
   RawTile complete_image = tilemanager.getRegion( requested_res,
 						  session->view->xangle, session->view->yangle,
 						  session->view->getLayers(),
-						  view_left, view_top, view_width, view_height );
+						  view_left, view_top, view_width, view_height,
+						  session->out );
 
 
 
@@ -396,12 +416,19 @@ void CVT::send( Session* session ){
   // Allocate enough memory for this plus an extra 64k for instances where compressed
   // data is greater than uncompressed
   unsigned int strip_height = 128;
-  unsigned int channels = complete_image.channels;
+  channels = complete_image.channels;
   unsigned char* output = new unsigned char[resampled_width*channels*strip_height+65636];
   int strips = (resampled_height/strip_height) + (resampled_height%strip_height == 0 ? 0 : 1);
 
   for( int n=0; n<strips; n++ ){
 
+    // Stop if our client has gone away
+    if( session->out->cancelled() ){
+      delete[] output;
+      if( session->loglevel >= 2 ) *(session->logfile) << "CVT :: Client has gone away: abandoning image" << endl;
+      throw 499;
+    }
+
     // Get the starting index for this strip of data
     unsigned char* input = &((unsigned char*)complete_image.data)[n*strip_height*resampled_width*channels];
 
@@ -81,20 +81,233 @@ namespace __gnu_cxx {
 
 #include <iostream>
 #include <list>
+#include <set>
+#include <vector>
 #include <string>
+#include <ctime>
+#include <stdint.h>
 #include "RawTile.h"
+#include "Mutex.h"
+#include "Memory.h"
+#include "SharedCache.h"
+#include "DiskCache.h"
 
 
 
-/// Cache to store raw tile data
+/// Compact binary key identifying a cached tile
+/** Rather than formatting a string for every lookup, image paths are interned by the
+ *  Cache and a tile is identified by a small fixed-size structure. Two hashes are
+ *  precomputed: one of the tile itself, which selects the cache segment so that all
+ *  representations of a tile are held together, and one of the whole key including
+ *  its compression type and quality, which is used by the segment index.
+ */
+struct CacheKey {
+
+  uint32_t image;          ///< Interned image path
+  uint32_t tile;           ///< Tile number
+  int32_t hSequence;       ///< Horizontal sequence number
+  int32_t vSequence;       ///< Vertical sequence number
+  uint16_t resolution;     ///< Resolution number
+  uint8_t compression;     ///< CompressionType
+  uint8_t quality;         ///< Compression quality
+  uint64_t base;           ///< Hash of the image, resolution, tile and sequence numbers
+  uint64_t hash;           ///< Hash of the whole key
+
+
+  /// Mix a value into a 64 bit hash
+  static uint64_t mix( uint64_t h, uint64_t v ) {
+    h ^= v + 0x9e3779b97f4a7c15ULL + ( h << 6 ) + ( h >> 2 );
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+  }
 
-class Cache {
+  /// Return the key of another representation of the same tile
+  /** @param c compression type
+   *  @param q compression quality
+   */
+  CacheKey as( CompressionType c, int q ) const {
+    CacheKey k = *this;
+    k.compression = (uint8_t) c;
+    k.quality = (uint8_t) q;
+    k.hash = mix( base, ( (uint64_t) c << 8 ) | k.quality );
+    return k;
+  }
+
+  bool operator == ( const CacheKey& k ) const {
+    return ( hash == k.hash && image == k.image && tile == k.tile && resolution == k.resolution &&
+	     hSequence == k.hSequence && vSequence == k.vSequence &&
+	     compression == k.compression && quality == k.quality );
+  }
 
+  bool operator < ( const CacheKey& k ) const {
+    if( hash != k.hash ) return hash < k.hash;
+    if( image != k.image ) return image < k.image;
+    if( tile != k.tile ) return tile < k.tile;
+    if( resolution != k.resolution ) return resolution < k.resolution;
+    if( hSequence != k.hSequence ) return hSequence < k.hSequence;
+    if( vSequence != k.vSequence ) return vSequence < k.vSequence;
+    if( compression != k.compression ) return compression < k.compression;
+    return quality < k.quality;
+  }
+
+  /// Hash functor for our index, which simply returns the precomputed hash
+  struct Hasher {
+    size_t operator() ( const CacheKey& k ) const { return (size_t) k.hash; }
+  };
+
+};
+
+
+
+
+/// Tile cache eviction policies
+/** CLOCK approximates LRU. TINYLFU adds a small admission window in front of the CLOCK
+ *  list and only admits tiles leaving the window if they have recently been requested
+ *  more often than the tiles they would displace, so that a sequential scan of a large
+ *  image cannot flush the tiles our regular viewers rely on.
+ */
+enum CachePolicy { CLOCK, TINYLFU };
+
+
+
+/// Count-min sketch estimating how often tiles have recently been requested
+/** Each request increments one saturating 4 bit counter in each of four rows and the
+ *  frequency of a tile is estimated as the smallest of its counters. All counters are
+ *  halved once the number of increments reaches ten times the width of the sketch, so
+ *  that the estimates follow changes in popularity. Counters are updated without a lock,
+ *  as lookups only hold a shared lock on their segment: concurrent increments of the same
+ *  counter may occasionally be lost, which our estimates can tolerate.
+ */
+class FrequencySketch {
 
  private:
 
-  /// Basic object storage size
-  int tileSize;
+  static const unsigned int rows = 4;
+
+  /// Our counters, one row after another
+  std::vector<unsigned char> table;
+
+  /// Width of each row, which is a power of two
+  unsigned long width;
+
+  /// Number of increments since our counters were last halved and the number at which to halve them
+  volatile long additions;
+  long sampleSize;
+
+  /// Counter used for a hash in a given row
+  volatile unsigned char& _counter( uint64_t hash, unsigned int row ) {
+    return table[ row*width + ( CacheKey::mix( hash, row ) & ( width - 1 ) ) ];
+  }
+
+
+ public:
+
+  /// Constructor
+  /** @param entries expected number of tiles */
+  FrequencySketch( unsigned long entries ) {
+    width = 256;
+    while( width < entries && width < ( 1UL << 22 ) ) width <<= 1;
+    table.assign( rows * width, 0 );
+    additions = 0;
+    sampleSize = 10 * width;
+  };
+
+  /// Widen our rows to hold at least twice a number of tiles, keeping our estimates
+  /** Must not be called concurrently with any other member
+      @param entries number of tiles
+   */
+  void reserve( unsigned long entries ) {
+    unsigned long w = width;
+    while( w < 2 * entries && w < ( 1UL << 22 ) ) w <<= 1;
+    if( w == width ) return;
+    // A hash's counter in a wider row is found by masking more bits of the same value,
+    // so each new counter starts from the old counter it replaces
+    std::vector<unsigned char> wider( rows * w );
+    for( unsigned int i = 0; i < rows; i++ ){
+      for( unsigned long j = 0; j < w; j++ ) wider[ i*w + j ] = table[ i*width + ( j & ( width - 1 ) ) ];
+    }
+    table.swap( wider );
+    width = w;
+    sampleSize = 10 * width;
+  };
+
+  /// Record a request
+  /** @param hash hash of the requested key */
+  void increment( uint64_t hash ) {
+    bool added = false;
+    for( unsigned int i = 0; i < rows; i++ ){
+      volatile unsigned char& c = this->_counter( hash, i );
+      unsigned char v = c;
+      if( v < 15 ){
+	c = v + 1;
+	added = true;
+      }
+    }
+    if( !added ) return;
+    // Only the increment that reaches our sample size halves our counters
+#ifdef _MSC_VER
+    long n = _InterlockedIncrement( &additions );
+#else
+    long n = __sync_add_and_fetch( &additions, 1 );
+#endif
+    if( n == sampleSize ){
+      for( std::vector<unsigned char>::iterator i = table.begin(); i != table.end(); ++i ){
+	*(volatile unsigned char*) &(*i) >>= 1;
+      }
+#ifdef _MSC_VER
+      _InterlockedExchangeAdd( &additions, -sampleSize / 2 );
+#else
+      __sync_sub_and_fetch( &additions, sampleSize / 2 );
+#endif
+    }
+  };
+
+  /// Estimate how often a key has recently been requested
+  /** @param hash hash of the key */
+  unsigned int frequency( uint64_t hash ) {
+    unsigned int f = 15;
+    for( unsigned int i = 0; i < rows; i++ ){
+      unsigned int c = this->_counter( hash, i );
+      if( c < f ) f = c;
+    }
+    return f;
+  };
+
+};
+
+
+
+
+/// A single independent segment of our tile cache
+/** Each segment has its own index, tile list, byte budget and reader-writer lock.
+ *  Lookups only take a shared lock: rather than moving a tile to the head of the list
+ *  on every hit, we simply set its reference flag. Eviction then uses the CLOCK
+ *  (second chance) algorithm, giving referenced tiles another pass through the list
+ *  before they can be removed. With the TINYLFU policy, new tiles first enter a small
+ *  window list and must then win a frequency comparison against the CLOCK victim to
+ *  enter the main list.
+ */
+
+class CacheSegment {
+
+
+ private:
+
+  /// Cache entry: our key, the tile itself, a reference flag set on each hit, whether
+  /// the entry is in our admission window and the memory it uses
+  struct Entry {
+    CacheKey key;
+    RawTile tile;
+    volatile int referenced;
+    bool windowed;
+    unsigned long size;
+    Entry( const CacheKey& k, const RawTile& t, bool w ) : key( k ), tile( t ), referenced( 0 ), windowed( w ), size( 0 ) {};
+  };
+
+  /// Memory used by each entry in addition to its tile data and file name
+  unsigned long entrySize;
 
   /// Max memory size in bytes
   unsigned long maxSize;
@@ -102,47 +315,61 @@ class Cache {
   /// Current memory running total
   unsigned long currentSize;
 
+  /// Eviction policy
+  CachePolicy policy;
+
+  /// Size of our admission window
+  unsigned long windowSize;
+
+  /// Minimum number of tiles of average size that our admission window can hold
+  static const unsigned long windowTiles = 8;
+
+  /// Request frequencies for our TINYLFU policy
+  FrequencySketch* sketch;
+
   /// Main cache storage typedef
 #ifdef HAVE_EXT_POOL_ALLOCATOR
-  typedef std::list < std::pair<const std::string,RawTile>,
-    __gnu_cxx::__pool_alloc< std::pair<const std::string,RawTile> > > TileList;
+  typedef std::list < Entry, __gnu_cxx::__pool_alloc< Entry > > TileList;
 #else
-  typedef std::list < std::pair<const std::string,RawTile> > TileList;
+  typedef std::list < Entry > TileList;
 #endif
 
   /// Main cache list iterator typedef
-  typedef std::list < std::pair<const std::string,RawTile> >::iterator List_Iter;
+  typedef TileList::iterator List_Iter;
 
   /// Index typedef
 #ifdef HAVE_EXT_POOL_ALLOCATOR
-  typedef HASHMAP < std::string, List_Iter,
-    __gnu_cxx::hash< const std::string >,
-    std::equal_to< const std::string >,
-    __gnu_cxx::__pool_alloc< std::pair<const std::string, List_Iter> >
+  typedef HASHMAP < CacheKey, List_Iter,
+    CacheKey::Hasher,
+    std::equal_to< CacheKey >,
+    __gnu_cxx::__pool_alloc< std::pair<const CacheKey, List_Iter> >
     > TileMap;
+#elif defined(HAVE_UNORDERED_MAP) || defined(HAVE_TR1_UNORDERED_MAP) || defined(HAVE_EXT_HASH_MAP)
+  typedef HASHMAP < CacheKey, List_Iter, CacheKey::Hasher > TileMap;
 #else
-  typedef HASHMAP < std::string,List_Iter > TileMap;
+  typedef HASHMAP < CacheKey, List_Iter > TileMap;
 #endif
 
 
   /// Main cache storage object
   TileList tileList;
 
+  /// Admission window for our TINYLFU policy
+  TileList window;
+
   /// Main Cache storage index object
   TileMap tileMap;
 
+  /// Lock protecting our lists and index
+  RWLock lock;
+
 
-  /// Internal touch function
-  /** Touches a key in the Cache and makes it the most recently used
-   *  @param key to be touched
-   *  @return a Map_Iter pointing to the key that was touched.
+  /// Memory used by an entry
+  /** Count the heap blocks actually allocated for the tile's data and file name
+   *  rather than their requested sizes
    */
-  TileMap::iterator _touch( const std::string &key ) {
-    TileMap::iterator miter = tileMap.find( key );
-    if( miter == tileMap.end() ) return miter;
-    // Move the found node to the head of the list.
-    tileList.splice( tileList.begin(), tileList, miter->second );
-    return miter;
+  unsigned long _size( const RawTile& r ) const {
+    return heapSize( r.data, r.dataLength ) + heapSize( r.filename ) + entrySize;
   }
 
 
@@ -153,122 +380,653 @@ class Cache {
    */
   void _remove( const TileMap::iterator &miter ) {
     // Reduce our current size counter
-    currentSize -= ( (miter->second->second).dataLength +
-		     ( (miter->second->second).filename.capacity() + (miter->second->first).capacity() )*sizeof(char) +
-		     tileSize );
-    tileList.erase( miter->second );
+    unsigned long size = miter->second->size;
+    currentSize -= size;
+    if( miter->second->windowed ){
+      windowSize -= size;
+      window.erase( miter->second );
+    }
+    else tileList.erase( miter->second );
     tileMap.erase( miter );
   }
 
 
-  /// Interal remove function
-  /** @param key to remove */
-  void _remove( const std::string &key ) {
-    TileMap::iterator miter = tileMap.find( key );
-    this->_remove( miter );
+  /// Find the next tile to evict from our main list using the CLOCK algorithm
+  /** Tiles that have been referenced since they were last examined are moved back
+   *  to the head of the list with their flag cleared instead
+   */
+  List_Iter _victim() {
+    while( true ){
+      List_Iter liter = tileList.end();
+      --liter;
+      if( !liter->referenced ) return liter;
+      liter->referenced = 0;
+      tileList.splice( tileList.begin(), tileList, liter );
+    }
+  }
+
+
+  /// Size of our admission window
+  /** One percent of our budget, but always enough for several tiles of the average
+   *  size we hold, so that new tiles can be requested again before they must compete
+   *  for a place, but never more than a quarter of our budget
+   */
+  unsigned long _windowMax() const {
+    unsigned long max = maxSize / 100;
+    unsigned long n = tileMap.size();
+    if( n > 0 && max < windowTiles * ( currentSize / n ) ) max = windowTiles * ( currentSize / n );
+    return ( max < maxSize / 4 ) ? max : maxSize / 4;
+  }
+
+
+  /// Move tiles that overflow our admission window into our main list if they are
+  /// requested more often than the tiles they would displace, or otherwise remove them
+  void _admit() {
+    unsigned long windowMax = this->_windowMax();
+    while( windowSize > windowMax && !window.empty() ){
+      List_Iter candidate = window.end();
+      --candidate;
+      unsigned long size = candidate->size;
+      unsigned int frequency = sketch->frequency( candidate->key.hash );
+      bool admitted = true;
+      while( currentSize - windowSize + size > maxSize - windowMax && !tileList.empty() ){
+	List_Iter victim = this->_victim();
+	if( frequency <= sketch->frequency( victim->key.hash ) ){
+	  admitted = false;
+	  break;
+	}
+	this->_remove( tileMap.find( victim->key ) );
+      }
+      if( admitted ){
+	candidate->windowed = false;
+	windowSize -= size;
+	tileList.splice( tileList.begin(), window, candidate );
+      }
+      else this->_remove( tileMap.find( candidate->key ) );
+    }
+  }
+
+
+  /// Remove tiles until we are within our budget
+  void _evict() {
+    if( policy == TINYLFU ) this->_admit();
+    this->_shrink( maxSize );
   }
 
 
+  /// Remove tiles, starting with those in our main list, until we are within a given size
+  /** @param size size in bytes */
+  void _shrink( unsigned long size ) {
+    while( currentSize > size && !( tileList.empty() && window.empty() ) ){
+      if( !tileList.empty() ) this->_remove( tileMap.find( this->_victim()->key ) );
+      else{
+	List_Iter liter = window.end();
+	--liter;
+	this->_remove( tileMap.find( liter->key ) );
+      }
+    }
+  }
+
+
+  /// Disallow copying
+  CacheSegment( const CacheSegment& );
+  CacheSegment& operator = ( const CacheSegment& );
+
+
 
  public:
 
   /// Constructor
-  /** @param max Maximum cache size in MB */
-  Cache( float max ) {
-    maxSize = (unsigned long)(max*1024000) ; currentSize = 0;
-    // 64 chars added at the end represents an average string length
-    tileSize = sizeof( RawTile ) + sizeof( std::pair<const std::string,RawTile> ) +
-      sizeof( std::pair<const std::string, List_Iter> ) + sizeof(char)*64 + sizeof(List_Iter);
+  /** @param max Maximum size in bytes
+   *  @param p eviction policy
+   */
+  CacheSegment( unsigned long max, CachePolicy p = CLOCK ) {
+    maxSize = max; currentSize = 0;
+    policy = p;
+    windowSize = 0;
+    // Start with enough counters for small compressed tiles and widen them should we hold more
+    sketch = ( p == TINYLFU ) ? new FrequencySketch( max / 4096 ) : NULL;
+    // Our list node, our index node and its share of the index's buckets and the tile's TileBuffer
+    entrySize = heapSize( sizeof(Entry) + 2*sizeof(void*) ) +
+      heapSize( sizeof(std::pair<const CacheKey, List_Iter>) + 2*sizeof(void*) ) + sizeof(void*) +
+      heapSize( sizeof(TileBuffer) );
   };
 
 
   /// Destructor
-  ~Cache() {
-    tileList.clear();
-    tileMap.clear();
-  }
+  ~CacheSegment() {
+    if( sketch ) delete sketch;
+  };
 
 
   /// Insert a tile
-  /** @param r Tile to be inserted */
-  void insert( const RawTile& r ) {
-
-    if( maxSize == 0 ) return;
-
-    std::string key = this->getIndex( r.filename, r.resolution, r.tileNum,
-				      r.hSequence, r.vSequence, r.compressionType, r.quality );
+  /** @param key cache index of this tile
+   *  @param r Tile to be inserted
+   */
+  void insert( const CacheKey& key, const RawTile& r ) {
 
-    // Touch the key, if it exists
-    TileMap::iterator miter = this->_touch( key );
+    ScopedWriteLock l( lock );
 
     // Check whether this tile exists in our cache
+    TileMap::iterator miter = tileMap.find( key );
     if( miter != tileMap.end() ){
       // Check the timestamp and delete if necessary
-      if( miter->second->second.timestamp < r.timestamp ){
+      if( miter->second->tile.timestamp < r.timestamp ){
 	this->_remove( miter );
       }
-      // If this index already exists and it is up to date, do nothing
-      else return;
+      // If this index already exists and it is up to date, simply mark it as used
+      else{
+	miter->second->referenced = 1;
+	return;
+      }
     }
 
-    // Store the key if it doesn't already exist in our cache
-    // Ok, do the actual insert at the head of the list
-    tileList.push_front( std::make_pair(key,r) );
+    // Ok, do the actual insert at the head of the list, or of our window, and store this in our map.
+    // Our copy of the tile is made immutable so that hits can share rather than copy it
+    TileList& list = ( policy == TINYLFU ) ? window : tileList;
+    list.push_front( Entry( key, r, policy == TINYLFU ) );
+    list.front().tile.share();
+    tileMap[ key ] = list.begin();
+
+    // Update our total current size variable
+    unsigned long size = this->_size( list.front().tile );
+    list.front().size = size;
+    currentSize += size;
+    if( policy == TINYLFU ){
+      windowSize += size;
+      sketch->reserve( tileMap.size() );
+    }
 
-    // And store this in our map
-    List_Iter liter = tileList.begin();
-    tileMap[ key ] = liter;
+    // Check to see if we need to remove elements due to exceeding max_size
+    this->_evict();
+  }
 
-    // Update our total current size variable. Use the string::capacity function
-    // rather than length() as std::string can allocate slightly more than necessary
-    // The +1 is for the terminating null byte
-    currentSize += (r.dataLength + (r.filename.capacity()+key.capacity())*sizeof(char) + tileSize);
 
-    // Check to see if we need to remove an element due to exceeding max_size
-    while( currentSize > maxSize ) {
-      // Remove the last element
-      liter = tileList.end();
-      --liter;
-      this->_remove( liter->first );
+  /// Get the first available of several representations of a tile
+  /** @param keys cache indices of the tile in order of preference
+   *  @param n number of keys
+   *  @param tile RawTile which is given a reference to the cached tile's data
+   *  @return true if the tile was found
+   */
+  bool getTile( const CacheKey* keys, unsigned int n, RawTile& tile ) {
+
+    ScopedReadLock l( lock );
+
+    for( unsigned int i = 0; i < n; i++ ){
+      TileMap::iterator miter = tileMap.find( keys[i] );
+      if( miter == tileMap.end() ) continue;
+
+      // Several readers may set this flag concurrently, but they all write the same value
+      miter->second->referenced = 1;
+      if( sketch ) sketch->increment( keys[i].hash );
+      tile = miter->second->tile;
+      return true;
+    }
+
+    // Misses count as requests for the tile that will be inserted
+    if( sketch && n > 0 ) sketch->increment( keys[0].hash );
+    return false;
+  }
+
+
+  /// Copy out all tiles of a given compression type
+  /** @param c compression type
+   *  @param hot tiles referenced since they were last considered for eviction, most recent first
+   *  @param cold all other tiles, most recent first
+   */
+  void getTiles( CompressionType c, std::vector<RawTile>& hot, std::vector<RawTile>& cold ) {
+    ScopedReadLock l( lock );
+    TileList* lists[2] = { &window, &tileList };
+    for( unsigned int n = 0; n < 2; n++ ){
+      for( List_Iter i = lists[n]->begin(); i != lists[n]->end(); ++i ){
+	if( i->tile.compressionType != c ) continue;
+	if( i->referenced ) hot.push_back( i->tile );
+	else cold.push_back( i->tile );
+      }
+    }
+  }
+
+
+  /// Return the number of tiles in this segment
+  unsigned int getNumElements() {
+    ScopedReadLock l( lock );
+    return tileList.size() + window.size();
+  }
+
+
+  /// Add the interned image path of each of our tiles to a set
+  /** @param images set of image identifiers */
+  void getImages( std::set<unsigned int>& images ) {
+    ScopedReadLock l( lock );
+    for( TileMap::const_iterator i = tileMap.begin(); i != tileMap.end(); ++i ) images.insert( i->first.image );
+  }
+
+
+  /// Return the number of bytes stored in this segment
+  unsigned long getMemorySize() {
+    ScopedReadLock l( lock );
+    return currentSize;
+  }
+
+
+  /// Evict tiles to free memory
+  /** @param bytes number of bytes to free
+   *  @return number of bytes freed
+   */
+  unsigned long trim( unsigned long bytes ) {
+    ScopedWriteLock l( lock );
+    unsigned long size = currentSize;
+    this->_shrink( ( currentSize > bytes ) ? currentSize - bytes : 0 );
+    return size - currentSize;
+  }
+
+};
+
+
+
+
+/// Cache to store raw tile data
+/** The cache is split into a number of independent segments, each with its own lock
+ *  and an equal share of the total memory budget. Tiles are assigned to a segment by
+ *  a hash of their index, so that worker threads sharing the cache rarely contend
+ *  for the same lock. Optionally, JPEG encoded tiles can instead be stored in a
+ *  SharedCache, which is shared between all server processes on a host. JPEG tiles
+ *  can also be written to a DiskCache, which is consulted before a tile missing
+ *  from memory has to be decoded again.
+ */
+
+class Cache {
+
+
+ private:
+
+  /// Max memory size in bytes
+  unsigned long maxSize;
+
+  /// Our cache segments
+  std::vector<CacheSegment*> segments;
+
+  /// Optional shared memory cache for JPEG tiles
+  SharedCache* shared;
+
+  /// Optional on-disk second level cache for JPEG tiles
+  DiskCache* disk;
+
+  /// Level at which UNCOMPRESSED tiles are losslessly compressed or 0 for none
+  int compression;
+
+  /// An interned image path: its identifier and when it was last interned
+  struct Interned {
+    unsigned int id;
+    volatile time_t used;
+  };
+
+  /// Interned image paths: an identifier for each path and the path for each identifier
+  /** Identifiers are never reused. Once the number of paths outgrows our limit, those of
+   *  images with no tiles left in our segments are removed
+   */
+  HASHMAP < std::string, Interned > imageIds;
+  HASHMAP < unsigned int, std::string > imagePaths;
+
+  /// Next identifier, number of interned paths at which to remove unused paths and the
+  /// memory used by our interned paths in bytes
+  unsigned int nextId;
+  unsigned long internLimit;
+  unsigned long internSize;
+
+  /// Minimum number of interned paths at which unused paths are removed and the number of
+  /// seconds for which a path is kept after it was last interned, so that the keys held
+  /// by requests in progress remain valid
+  static const unsigned long internMinimum = 1024;
+  static const time_t internGrace = 60;
+
+  /// Lock protecting our interned image paths
+  RWLock internLock;
+
+  /// Keys of tiles currently being produced by one of our threads
+  std::set<CacheKey> inFlight;
+
+  /// Lock protecting our set of in-flight tiles and condition signalled when one completes
+  Mutex flightLock;
+  Condition flightDone;
+
+
+  /// Select the segment responsible for a given key
+  /** All representations of a tile share the same segment
+   *  @param key cache index
+   */
+  CacheSegment* _segment( const CacheKey& key ) const {
+    return segments[ key.base % segments.size() ];
+  }
+
+
+  /// Memory used by an interned path, which is held by both of our maps
+  /** @param f image path */
+  static unsigned long _internSize( const std::string& f ) {
+    return 2 * heapSize( f ) + 4 * sizeof(void*) +
+      heapSize( sizeof(std::pair<const std::string, Interned>) + sizeof(void*) ) +
+      heapSize( sizeof(std::pair<const unsigned int, std::string>) + sizeof(void*) );
+  }
+
+
+  /// Return the identifier of an image path, interning it if necessary
+  /** @param f image path */
+  unsigned int _intern( const std::string& f ) {
+    time_t now = time( NULL );
+    {
+      ScopedReadLock l( internLock );
+      HASHMAP < std::string, Interned >::iterator i = imageIds.find( f );
+      if( i != imageIds.end() ){
+	// Several readers may set this concurrently, but they all write much the same value
+	if( i->second.used != now ) i->second.used = now;
+	return i->second.id;
+      }
+    }
+    ScopedWriteLock l( internLock );
+    HASHMAP < std::string, Interned >::iterator i = imageIds.find( f );
+    if( i != imageIds.end() ){
+      i->second.used = now;
+      return i->second.id;
     }
+    if( imageIds.size() >= internLimit ) this->_compact( now );
+    Interned interned;
+    interned.id = nextId++;
+    interned.used = now;
+    imageIds[ f ] = interned;
+    imagePaths[ interned.id ] = f;
+    internSize += _internSize( f );
+    return interned.id;
+  }
+
+
+  /// Remove the interned paths of images which have no tiles left in our segments
+  /** Called with our intern lock held for writing. Our limit is then set to twice the
+   *  number of paths that remain, so that the cost of this is spread over many new paths
+   *  @param now current time
+   */
+  void _compact( time_t now ) {
+    std::set<unsigned int> live;
+    for( unsigned int i = 0; i < segments.size(); i++ ) segments[i]->getImages( live );
+    {
+      ScopedLock l( flightLock );
+      for( std::set<CacheKey>::const_iterator i = inFlight.begin(); i != inFlight.end(); ++i ) live.insert( i->image );
+    }
+    HASHMAP < std::string, Interned >::iterator i = imageIds.begin();
+    while( i != imageIds.end() ){
+      if( now - i->second.used < internGrace || live.find( i->second.id ) != live.end() ) ++i;
+      else{
+	internSize -= _internSize( i->first );
+	imagePaths.erase( i->second.id );
+	imageIds.erase( i++ );
+      }
+    }
+    internLimit = 2 * imageIds.size();
+    if( internLimit < internMinimum ) internLimit = internMinimum;
+  }
+
+
+  /// Return the image path of a key
+  std::string _path( const CacheKey& key ) {
+    ScopedReadLock l( internLock );
+    HASHMAP < unsigned int, std::string >::const_iterator i = imagePaths.find( key.image );
+    // Paths are only removed long after any request could have made a key from them
+    return ( i != imagePaths.end() ) ? i->second : std::string();
+  }
+
 
+  /// Create a string index for our shared memory and disk caches
+  /** Interned identifiers are local to each process and do not survive a restart, so
+   *  tiles held outside our own memory must instead be identified by their image path
+   *  @param key cache index
+   */
+  std::string _pathIndex( const CacheKey& key ) {
+    char tmp[1024];
+    snprintf( tmp, 1024, "%s:%d:%d:%d:%d:%d:%d", this->_path( key ).c_str(), key.resolution, key.tile,
+	      key.hSequence, key.vSequence, key.compression, key.quality );
+    return std::string( tmp );
+  }
+
+
+  /// Fill in the fields making up our key, which are not stored by our shared and disk caches
+  void _identify( const CacheKey& key, RawTile& tile ) {
+    tile.filename = this->_path( key );
+    tile.resolution = key.resolution;
+    tile.tileNum = key.tile;
+    tile.hSequence = key.hSequence;
+    tile.vSequence = key.vSequence;
+  }
+
+
+  /// Disallow copying
+  Cache( const Cache& );
+  Cache& operator = ( const Cache& );
+
+
+
+ public:
+
+  /// Constructor
+  /** @param max Maximum cache size in MB
+   *  @param n Number of independent segments to divide the cache into
+   *  @param p Eviction policy
+   */
+  Cache( float max, unsigned int n = 1, CachePolicy p = CLOCK ) {
+    maxSize = (unsigned long)(max*1048576);
+    shared = NULL;
+    disk = NULL;
+    compression = 0;
+    nextId = 0;
+    internLimit = internMinimum;
+    internSize = 0;
+    if( n < 1 ) n = 1;
+    for( unsigned int i = 0; i < n; i++ ) segments.push_back( new CacheSegment( maxSize / n, p ) );
+  };
+
+
+  /// Destructor
+  ~Cache() {
+    for( unsigned int i = 0; i < segments.size(); i++ ) delete segments[i];
+    segments.clear();
+  }
+
+
+  /// Use a shared memory cache for our JPEG tiles
+  /** @param s SharedCache, which remains owned by the caller */
+  void setSharedCache( SharedCache* s ) { shared = s; };
+
+
+  /// Use an on-disk cache for our JPEG tiles
+  /** @param d DiskCache, which remains owned by the caller */
+  void setDiskCache( DiskCache* d ) { disk = d; };
+
+
+  /// Return our on-disk cache or NULL
+  DiskCache* getDiskCache() const { return disk; };
+
+
+  /// Set the level at which UNCOMPRESSED tiles should be held DEFLATE compressed
+  /** The tiles are compressed by TileManager, which also transparently decompresses them
+   *  @param level zlib compression level or 0 for none
+   */
+  void setCompression( int level ) { compression = level; };
+
+
+  /// Return our compression level for UNCOMPRESSED tiles
+  int getCompression() const { return compression; };
+
+
+  /// Insert a tile
+  /** @param r Tile to be inserted */
+  void insert( const RawTile& r ) {
+
+    bool useShared = ( shared && r.compressionType == JPEG );
+    bool useDisk = ( disk && r.compressionType == JPEG );
+    if( maxSize == 0 && !useShared && !useDisk ) return;
+
+    CacheKey key = this->getIndex( r.filename, r.resolution, r.tileNum,
+				   r.hSequence, r.vSequence, r.compressionType, r.quality );
+
+    if( useShared ) shared->insert( this->_pathIndex( key ), r );
+    else if( maxSize > 0 ) this->_segment( key )->insert( key, r );
+
+    if( useDisk ) disk->insert( this->_pathIndex( key ), r );
+  }
+
+
+  /// Copy out all tiles of a given compression type held in our own segments
+  /** @param c compression type
+   *  @param tiles vector to which the tiles are added, with the most recently
+   *         referenced tiles first
+   */
+  void getTiles( CompressionType c, std::vector<RawTile>& tiles ) {
+    std::vector<RawTile> cold;
+    for( unsigned int i = 0; i < segments.size(); i++ ) segments[i]->getTiles( c, tiles, cold );
+    tiles.insert( tiles.end(), cold.begin(), cold.end() );
   }
 
 
   /// Return the number of tiles in the cache
-  unsigned int getNumElements() { return tileList.size(); }
+  unsigned int getNumElements() {
+    unsigned int n = 0;
+    for( unsigned int i = 0; i < segments.size(); i++ ) n += segments[i]->getNumElements();
+    if( shared ) n += shared->getNumElements();
+    return n;
+  }
 
 
-  /// Return the number of MB stored
-  float getMemorySize() { return (float) ( currentSize / 1024000.0 ); }
+  /// Return the number of MB stored, including our interned image paths
+  float getMemorySize() {
+    unsigned long size = this->getLocalMemorySize();
+    if( shared ) size += shared->getMemorySize();
+    return (float) ( size / 1048576.0 );
+  }
 
 
-  /// Get a tile from the cache
-  /** 
-   *  @param f filename
-   *  @param r resolution number
-   *  @param t tile number
-   *  @param h horizontal sequence number
-   *  @param v vertical sequence number
-   *  @param c compression type
-   *  @param q compression quality
-   *  @return pointer to data or NULL on error
+  /// Return the number of bytes held by this process alone, which excludes our shared
+  /// memory cache
+  unsigned long getLocalMemorySize() {
+    unsigned long size = 0;
+    for( unsigned int i = 0; i < segments.size(); i++ ) size += segments[i]->getMemorySize();
+    ScopedReadLock l( internLock );
+    return size + internSize;
+  }
+
+
+  /// Evict tiles from our own segments to free memory
+  /** Tiles held in our shared memory or disk caches are not affected
+   *  @param bytes number of bytes to free, spread evenly across our segments
+   *  @return number of bytes freed
+   */
+  unsigned long trim( unsigned long bytes ) {
+    unsigned long freed = 0;
+    unsigned long share = bytes / segments.size() + 1;
+    for( unsigned int i = 0; i < segments.size(); i++ ) freed += segments[i]->trim( share );
+    return freed;
+  }
+
+
+  /// Get the best available representation of a tile from the cache
+  /** Look first for a tile with the requested compression and then for one which
+   *  can be converted to it: a JPEG request may be satisfied by a DEFLATE or an
+   *  UNCOMPRESSED tile, a DEFLATE request by an UNCOMPRESSED tile and an UNCOMPRESSED
+   *  request by a losslessly compressed DEFLATE tile, which TileManager decompresses
+   *  for its caller. As all these
+   *  representations are held in the same segment, they are found in a single probe.
+   *  Cached tile data is immutable and reference counted, so the tile is handed out
+   *  without copying its data and remains valid even if another thread evicts it.
+   *  Use RawTile::detach() before modifying the data in place. A JPEG tile missing
+   *  from memory is finally looked for in our disk cache.
+   *  @param key cache index of the requested tile as returned by getIndex()
+   *  @param tile RawTile into which the cached tile is placed
+   *  @return true if a tile was found
    */
-  RawTile* getTile( std::string f, int r, int t, int h, int v, CompressionType c, int q ) {
+  bool getTile( const CacheKey& key, RawTile& tile ) {
+
+    CacheKey keys[3];
+    unsigned int n = 0;
+
+    switch( key.compression ){
+      case JPEG:
+	if( shared && shared->getTile( this->_pathIndex( key ), tile ) ){
+	  this->_identify( key, tile );
+	  return true;
+	}
+	if( !shared ) keys[n++] = key;
+	keys[n++] = key.as( DEFLATE, 0 );
+	keys[n++] = key.as( UNCOMPRESSED, 0 );
+	break;
+      case DEFLATE:
+	keys[n++] = key;
+	keys[n++] = key.as( UNCOMPRESSED, 0 );
+	break;
+      case UNCOMPRESSED:
+	keys[n++] = key;
+	keys[n++] = key.as( DEFLATE, 0 );
+	break;
+      default:
+	break;
+    }
 
-    if( maxSize == 0 ) return NULL;
+    if( maxSize > 0 && n > 0 && this->_segment( key )->getTile( keys, n, tile ) ) return true;
 
-    std::string key = this->getIndex( f, r, t, h, v, c, q );
+    // Fall back to our disk cache and promote any tile found there back into memory
+    if( disk && key.compression == JPEG && disk->getTile( this->_pathIndex( key ), tile ) ){
+      this->_identify( key, tile );
+      tile.share();
+      if( shared ) shared->insert( this->_pathIndex( key ), tile );
+      else if( maxSize > 0 ) this->_segment( key )->insert( key, tile );
+      return true;
+    }
 
-    TileMap::iterator miter = tileMap.find( key );
-    if( miter == tileMap.end() ) return NULL;
-    this->_touch( key );
+    return false;
+  }
+
+
+  /// Claim the right to produce a tile that is missing from the cache
+  /** This allows concurrent requests for the same missing tile to be coalesced. If another
+   *  thread, or another process in the case of shared memory JPEG tiles, is already producing
+   *  the tile, wait for it to finish and return false, after which the caller should look in
+   *  the cache again and, should the tile not have been admitted, produce it itself without
+   *  claiming it again. Otherwise return true: the caller should produce and insert the tile
+   *  and must then call release().
+   *  @param key cache index of the tile as returned by getIndex()
+   *  @return true if the caller should produce this tile
+   */
+  bool acquire( const CacheKey& key ) {
+
+    if( shared && key.compression == JPEG ) return shared->acquire( this->_pathIndex( key ) );
 
-    return &(miter->second->second);
+    // There is nothing to wait for if we cannot store the result
+    if( maxSize == 0 ) return true;
+
+    ScopedLock lock( flightLock );
+    if( inFlight.find( key ) == inFlight.end() ){
+      inFlight.insert( key );
+      return true;
+    }
+    while( inFlight.find( key ) != inFlight.end() ) flightDone.wait( flightLock );
+    return false;
   }
 
 
-  /// Create a hash index
+  /// Release a claim made with acquire() and wake up any requests waiting for this tile
+  /** @param key cache index of the tile */
+  void release( const CacheKey& key ) {
+
+    if( shared && key.compression == JPEG ){
+      shared->release( this->_pathIndex( key ) );
+      return;
+    }
+
+    if( maxSize == 0 ) return;
+
+    ScopedLock lock( flightLock );
+    inFlight.erase( key );
+    flightDone.broadcast();
+  }
+
+
+  /// Create a cache index
   /** 
    *  @param f filename
    *  @param r resolution number
@@ -277,12 +1035,18 @@ class Cache {
    *  @param v vertical sequence number
    *  @param c compression type
    *  @param q compression quality
-   *  @return string
+   *  @return CacheKey
    */
-  std::string getIndex( std::string f, int r, int t, int h, int v, CompressionType c, int q ) {
-    char tmp[1024];
-    snprintf( tmp, 1024, "%s:%d:%d:%d:%d:%d:%d", f.c_str(), r, t, h, v, c, q );
-    return std::string( tmp );
+  CacheKey getIndex( const std::string& f, int r, int t, int h, int v, CompressionType c, int q ) {
+    CacheKey key;
+    key.image = this->_intern( f );
+    key.tile = (uint32_t) t;
+    key.hSequence = h;
+    key.vSequence = v;
+    key.resolution = (uint16_t) r;
+    uint64_t base = CacheKey::mix( key.image, ( (uint64_t) key.tile << 16 ) | key.resolution );
+    key.base = CacheKey::mix( base, ( (uint64_t) (uint32_t) h << 32 ) | (uint32_t) v );
+    return key.as( c, q );
   }
 
 
@@ -0,0 +1,451 @@
+// Tile and Image Metadata Cache Snapshot Member Functions
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "CacheSnapshot.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <map>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+
+using namespace std;
+
+
+
+/* Our file starts with a magic string followed by a format version. Values are stored in
+   native byte order, so the version also identifies snapshots written on a host of the
+   other endianness. This is followed by a count and the list of images, then a count and
+   the list of tiles
+*/
+static const char SNAPSHOT_MAGIC[8] = { 'I', 'I', 'P', 'S', 'N', 'A', 'P', '\0' };
+static const uint32_t SNAPSHOT_VERSION = 2;
+
+
+
+/// Write binary values to a snapshot file
+class SnapshotWriter {
+
+ private:
+
+  ofstream& out;
+
+ public:
+
+  SnapshotWriter( ofstream& o ) : out( o ) {};
+
+  template <class T> void put( T value ){
+    out.write( (const char*) &value, sizeof(T) );
+  };
+
+  void putData( const void* data, uint32_t length ){
+    out.write( (const char*) data, length );
+  };
+
+  void putString( const string& s ){
+    put<uint32_t>( s.length() );
+    putData( s.data(), s.length() );
+  };
+
+};
+
+
+
+/// Read binary values from a mapped snapshot with bounds checking
+class SnapshotReader {
+
+ private:
+
+  const char* p;
+  const char* end;
+
+  void check( size_t n ){
+    if( (size_t)( end - p ) < n ) throw string( "CacheSnapshot :: Snapshot file is truncated" );
+  };
+
+ public:
+
+  SnapshotReader( const char* data, size_t length ) : p( data ), end( data + length ) {};
+
+  template <class T> T get(){
+    T value;
+    check( sizeof(T) );
+    memcpy( &value, p, sizeof(T) );
+    p += sizeof(T);
+    return value;
+  };
+
+  const char* getData( uint32_t length ){
+    check( length );
+    const char* data = p;
+    p += length;
+    return data;
+  };
+
+  string getString(){
+    uint32_t length = get<uint32_t>();
+    return string( getData( length ), length );
+  };
+
+};
+
+
+
+CacheSnapshot::CacheSnapshot( const string& p, ImageCache* ic, Cache* tc, int l, ofstream* f )
+{
+  path = p;
+  imageCache = ic;
+  tileCache = tc;
+  loglevel = l;
+  logfile = f;
+  interval = 0;
+}
+
+
+
+void CacheSnapshot::save()
+{
+  ScopedLock l( lock );
+
+  // Take references to our cache contents, so that we hold no locks while writing
+  vector < pair<string,ImageRef> > images;
+  imageCache->getImages( images );
+
+  // Only JPEG tiles are worth keeping: raw tiles are large and cheap to re-read
+  vector<RawTile> tiles;
+  tileCache->getTiles( JPEG, tiles );
+
+  // Use a temporary name unique to this process, as several worker processes may share a snapshot
+  char pid[32];
+  snprintf( pid, 32, ".%d", (int) getpid() );
+  string tmp = path + pid;
+
+  ofstream out( tmp.c_str(), ios::out | ios::binary | ios::trunc );
+  if( !out ) throw string( "CacheSnapshot :: Unable to create snapshot file '" + tmp + "'" );
+
+  SnapshotWriter w( out );
+  w.putData( SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) );
+  w.put<uint32_t>( SNAPSHOT_VERSION );
+
+  // Images, most recently used first, with their members in the same order as listed in IIPImage::swap()
+  w.put<uint32_t>( images.size() );
+  for( vector < pair<string,ImageRef> >::const_iterator i = images.begin(); i != images.end(); ++i ){
+    const IIPImage& image = i->second->image;
+    w.putString( i->first );
+    w.putString( image.imagePath );
+    w.put<uint8_t>( image.isFile );
+    w.putString( image.suffix );
+    w.put<uint32_t>( image.virtual_levels );
+    w.put<int32_t>( image.format );
+    w.putString( image.fileSystemPrefix );
+    w.putString( image.fileNamePattern );
+    w.put<uint32_t>( image.horizontalAnglesList.size() );
+    for( list<int>::const_iterator a = image.horizontalAnglesList.begin(); a != image.horizontalAnglesList.end(); ++a ){
+      w.put<int32_t>( *a );
+    }
+    w.put<uint32_t>( image.verticalAnglesList.size() );
+    for( list<int>::const_iterator a = image.verticalAnglesList.begin(); a != image.verticalAnglesList.end(); ++a ){
+      w.put<int32_t>( *a );
+    }
+    w.put<uint32_t>( image.lut.size() );
+    for( unsigned int n = 0; n < image.lut.size(); n++ ) w.put<int32_t>( image.lut[n] );
+    w.put<uint32_t>( image.image_widths.size() );
+    for( unsigned int n = 0; n < image.image_widths.size(); n++ ){
+      w.put<uint32_t>( image.image_widths[n] );
+      w.put<uint32_t>( image.image_heights[n] );
+    }
+    w.put<uint32_t>( image.directory_offsets.size() );
+    for( unsigned int n = 0; n < image.directory_offsets.size(); n++ ) w.put<uint64_t>( image.directory_offsets[n] );
+    w.put<uint32_t>( image.tile_width );
+    w.put<uint32_t>( image.tile_height );
+    w.put<uint32_t>( image.numResolutions );
+    w.put<uint32_t>( image.bpc );
+    w.put<uint32_t>( image.channels );
+    w.put<int32_t>( image.sampleType );
+    w.put<uint32_t>( image.quality_layers );
+    w.put<int32_t>( image.colourspace );
+    w.put<uint8_t>( image.isSet );
+    w.put<int32_t>( image.currentX );
+    w.put<int32_t>( image.currentY );
+    w.put<uint32_t>( image.metadata.size() );
+    for( map<const string,string>::const_iterator m = image.metadata.begin(); m != image.metadata.end(); ++m ){
+      w.putString( m->first );
+      w.putString( m->second );
+    }
+    w.put<int64_t>( image.timestamp );
+    w.put<uint32_t>( image.min.size() );
+    for( unsigned int n = 0; n < image.min.size(); n++ ) w.put<float>( image.min[n] );
+    w.put<uint32_t>( image.max.size() );
+    for( unsigned int n = 0; n < image.max.size(); n++ ) w.put<float>( image.max[n] );
+  }
+
+  // Tiles, most recently used first
+  w.put<uint32_t>( tiles.size() );
+  for( vector<RawTile>::const_iterator t = tiles.begin(); t != tiles.end(); ++t ){
+    w.putString( t->filename );
+    w.put<int64_t>( t->timestamp );
+    w.put<int32_t>( t->tileNum );
+    w.put<int32_t>( t->resolution );
+    w.put<int32_t>( t->hSequence );
+    w.put<int32_t>( t->vSequence );
+    w.put<int32_t>( t->quality );
+    w.put<uint32_t>( t->width );
+    w.put<uint32_t>( t->height );
+    w.put<int32_t>( t->channels );
+    w.put<int32_t>( t->bpc );
+    w.put<int32_t>( t->sampleType );
+    w.put<uint8_t>( t->padded );
+    w.put<uint32_t>( t->dataLength );
+    w.putData( t->data, t->dataLength );
+  }
+
+  out.close();
+  if( !out ){
+    unlink( tmp.c_str() );
+    throw string( "CacheSnapshot :: Unable to write snapshot file '" + tmp + "'" );
+  }
+
+  if( rename( tmp.c_str(), path.c_str() ) != 0 ){
+    unlink( tmp.c_str() );
+    throw string( "CacheSnapshot :: Unable to rename snapshot file to '" + path + "': " + strerror( errno ) );
+  }
+
+  if( loglevel >= 2 ){
+    *logfile << "CacheSnapshot :: Saved " << images.size() << " images and "
+	     << tiles.size() << " tiles to '" << path << "'" << endl;
+  }
+}
+
+
+
+void CacheSnapshot::load()
+{
+  int fd = open( path.c_str(), O_RDONLY );
+  if( fd == -1 ){
+    if( errno == ENOENT ) return;
+    throw string( "CacheSnapshot :: Unable to open snapshot file '" + path + "': " + strerror( errno ) );
+  }
+
+  struct stat sb;
+  if( fstat( fd, &sb ) == -1 || sb.st_size == 0 ){
+    close( fd );
+    throw string( "CacheSnapshot :: Empty snapshot file '" + path + "'" );
+  }
+
+  void* mapped = mmap( NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if( mapped == MAP_FAILED ){
+    throw string( "CacheSnapshot :: Unable to map snapshot file '" + path + "': " + strerror( errno ) );
+  }
+
+  unsigned int images = 0, tiles = 0, stale = 0;
+
+  try{
+
+    SnapshotReader r( (const char*) mapped, sb.st_size );
+    if( memcmp( r.getData( sizeof(SNAPSHOT_MAGIC) ), SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) ) != 0 ||
+	r.get<uint32_t>() != SNAPSHOT_VERSION ){
+      throw string( "CacheSnapshot :: '" + path + "' is not a compatible snapshot file" );
+    }
+
+    // Modification times of the image files we have checked
+    map<string,time_t> timestamps;
+
+    // Images whose file is unchanged, indexed by image path for our tiles
+    map<string,IIPImage> valid;
+    vector < pair<string,IIPImage> > entries;
+
+    uint32_t n = r.get<uint32_t>();
+    for( uint32_t i = 0; i < n; i++ ){
+
+      IIPImage image;
+      string key = r.getString();
+      image.imagePath = r.getString();
+      image.isFile = r.get<uint8_t>();
+      image.suffix = r.getString();
+      image.virtual_levels = r.get<uint32_t>();
+      image.format = (ImageFormat) r.get<int32_t>();
+      image.fileSystemPrefix = r.getString();
+      image.fileNamePattern = r.getString();
+      uint32_t size = r.get<uint32_t>();
+      for( uint32_t a = 0; a < size; a++ ) image.horizontalAnglesList.push_back( r.get<int32_t>() );
+      size = r.get<uint32_t>();
+      for( uint32_t a = 0; a < size; a++ ) image.verticalAnglesList.push_back( r.get<int32_t>() );
+      size = r.get<uint32_t>();
+      for( uint32_t a = 0; a < size; a++ ) image.lut.push_back( r.get<int32_t>() );
+      size = r.get<uint32_t>();
+      for( uint32_t a = 0; a < size; a++ ){
+	image.image_widths.push_back( r.get<uint32_t>() );
+	image.image_heights.push_back( r.get<uint32_t>() );
+      }
+      size = r.get<uint32_t>();
+      for( uint32_t a = 0; a < size; a++ ) image.directory_offsets.push_back( r.get<uint64_t>() );
+      image.tile_width = r.get<uint32_t>();
+      image.tile_height = r.get<uint32_t>();
+      image.numResolutions = r.get<uint32_t>();
+      image.bpc = r.get<uint32_t>();
+      image.channels = r.get<uint32_t>();
+      image.sampleType = (SampleType) r.get<int32_t>();
+      image.quality_layers = r.get<uint32_t>();
+      image.colourspace = (ColourSpaces) r.get<int32_t>();
+      image.isSet = r.get<uint8_t>();
+      image.currentX = r.get<int32_t>();
+      image.currentY = r.get<int32_t>();
+      size = r.get<uint32_t>();
+      for( uint32_t a = 0; a < size; a++ ){
+	string name = r.getString();
+	image.metadata[name] = r.getString();
+      }
+      image.timestamp = (time_t) r.get<int64_t>();
+      size = r.get<uint32_t>();
+      for( uint32_t a = 0; a < size; a++ ) image.min.push_back( r.get<float>() );
+      size = r.get<uint32_t>();
+      for( uint32_t a = 0; a < size; a++ ) image.max.push_back( r.get<float>() );
+
+      // Only re-admit images whose file has not been modified since they were cached
+      string file = image.getFileName( image.currentX, image.currentY );
+      if( timestamps.find( file ) == timestamps.end() ){
+	struct stat fs;
+	timestamps[file] = ( stat( file.c_str(), &fs ) == 0 ) ? fs.st_mtime : 0;
+      }
+      if( timestamps[file] != image.timestamp ){
+	stale++;
+	continue;
+      }
+
+      valid[image.imagePath] = image;
+      entries.push_back( make_pair( key, image ) );
+    }
+
+    // Insert our images in reverse order, so that the most recently used end up at the head of our cache
+    for( vector < pair<string,IIPImage> >::reverse_iterator e = entries.rbegin(); e != entries.rend(); ++e ){
+      imageCache->insert( e->first, e->second );
+      images++;
+    }
+
+    // Find our tiles, which are stored with the most recently used first
+    vector<const char*> offsets;
+    n = r.get<uint32_t>();
+    for( uint32_t i = 0; i < n; i++ ){
+      offsets.push_back( r.getData( 0 ) );
+      r.getString();
+      r.getData( sizeof(int64_t) + 8*sizeof(int32_t) + 2*sizeof(uint32_t) + sizeof(uint8_t) );
+      r.getData( r.get<uint32_t>() );
+    }
+
+    // Insert them in reverse order, so that the most recently used tiles end up at the head of our cache
+    for( vector<const char*>::reverse_iterator o = offsets.rbegin(); o != offsets.rend(); ++o ){
+
+      SnapshotReader t( *o, (const char*) mapped + sb.st_size - *o );
+      RawTile tile;
+      tile.filename = t.getString();
+      tile.timestamp = (time_t) t.get<int64_t>();
+      tile.tileNum = t.get<int32_t>();
+      tile.resolution = t.get<int32_t>();
+      tile.hSequence = t.get<int32_t>();
+      tile.vSequence = t.get<int32_t>();
+      tile.quality = t.get<int32_t>();
+      tile.width = t.get<uint32_t>();
+      tile.height = t.get<uint32_t>();
+      tile.channels = t.get<int32_t>();
+      tile.bpc = t.get<int32_t>();
+      tile.sampleType = (SampleType) t.get<int32_t>();
+      tile.padded = t.get<uint8_t>();
+      tile.dataLength = t.get<uint32_t>();
+      tile.compressionType = JPEG;
+
+      // Tiles must belong to one of our valid images and their own file must be unchanged
+      map<string,IIPImage>::iterator image = valid.find( tile.filename );
+      if( image == valid.end() ){
+	stale++;
+	continue;
+      }
+      string file = image->second.getFileName( tile.hSequence, tile.vSequence );
+      if( timestamps.find( file ) == timestamps.end() ){
+	struct stat fs;
+	timestamps[file] = ( stat( file.c_str(), &fs ) == 0 ) ? fs.st_mtime : 0;
+      }
+      if( timestamps[file] != tile.timestamp ){
+	stale++;
+	continue;
+      }
+
+      // Point directly at our mapped data: the cache takes its own copy
+      tile.data = (void*) t.getData( tile.dataLength );
+      tile.memoryManaged = 0;
+      tileCache->insert( tile );
+      tiles++;
+    }
+
+  }
+  catch( const string& ){
+    munmap( mapped, sb.st_size );
+    throw;
+  }
+
+  munmap( mapped, sb.st_size );
+
+  if( loglevel >= 1 ){
+    *logfile << "Loaded " << images << " images and " << tiles << " tiles from cache snapshot '"
+	     << path << "'";
+    if( stale ) *logfile << ", skipping " << stale << " modified or missing entries";
+    *logfile << endl << endl;
+  }
+}
+
+
+
+#ifdef HAVE_PTHREAD
+void* CacheSnapshot::run( void* s )
+{
+  CacheSnapshot* snapshot = (CacheSnapshot*) s;
+  while( true ){
+    sleep( snapshot->interval );
+    try{
+      snapshot->save();
+    }
+    catch( const string& error ){
+      if( snapshot->loglevel >= 1 ) *(snapshot->logfile) << error << endl;
+    }
+  }
+  return NULL;
+}
+#endif
+
+
+
+void CacheSnapshot::start( unsigned int seconds )
+{
+#ifdef HAVE_PTHREAD
+  interval = seconds;
+  pthread_t id;
+  if( pthread_create( &id, NULL, run, this ) == 0 ) pthread_detach( id );
+  else if( loglevel >= 1 ) *logfile << "CacheSnapshot :: Unable to start periodic snapshot thread" << endl;
+#else
+  if( loglevel >= 1 ) *logfile << "CacheSnapshot :: Periodic snapshots require thread support" << endl;
+#endif
+}
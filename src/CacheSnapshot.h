@@ -0,0 +1,97 @@
+// Tile and Image Metadata Cache Snapshots
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _CACHESNAPSHOT_H
+#define _CACHESNAPSHOT_H
+
+
+#include <string>
+#include <fstream>
+#include "Task.h"
+#include "Mutex.h"
+
+
+
+/// Saves our image metadata and JPEG tile caches to disk and reloads them on startup
+/** This allows a restarted server to begin with warm caches rather than having to
+    re-open every image and re-encode every tile. Snapshots are written to a temporary
+    file, which is then renamed, so that a snapshot is never seen half written. On
+    loading, the snapshot is mapped into memory and entries are only re-admitted if
+    the modification time of their image file is unchanged. Images and tiles are saved
+    with the most recently used first and re-inserted in reverse order, so that the
+    least recently used entries are again the first to be evicted.
+ */
+class CacheSnapshot {
+
+ private:
+
+  /// Snapshot file path
+  std::string path;
+
+  /// Caches to save and restore
+  ImageCache* imageCache;
+  Cache* tileCache;
+
+  /// Our log
+  int loglevel;
+  std::ofstream* logfile;
+
+  /// Interval in seconds between periodic snapshots
+  unsigned int interval;
+
+  /// Lock to prevent simultaneous saves from our periodic thread and on shutdown
+  Mutex lock;
+
+#ifdef HAVE_PTHREAD
+  /// Periodic snapshot thread
+  static void* run( void* snapshot );
+#endif
+
+
+ public:
+
+  /// Constructor
+  /** @param path snapshot file path
+      @param imageCache image metadata cache
+      @param tileCache tile cache
+      @param loglevel logging level
+      @param logfile log stream
+   */
+  CacheSnapshot( const std::string& path, ImageCache* imageCache, Cache* tileCache,
+		 int loglevel, std::ofstream* logfile );
+
+  /// Re-admit the entries from an existing snapshot into our caches
+  /** Missing snapshots are silently ignored. Throws a string on error */
+  void load();
+
+  /// Save our caches to disk
+  /** Throws a string on error */
+  void save();
+
+  /// Save our caches periodically from a background thread
+  /** @param seconds interval in seconds between snapshots */
+  void start( unsigned int seconds );
+
+};
+
+
+#endif
@@ -0,0 +1,189 @@
+// Lossless Tile Compression using zlib Member Functions
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "DeflateCompressor.h"
+
+#include <cstring>
+#include <stdint.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+
+using namespace std;
+
+
+
+/// Header preceding the compressed data
+struct DeflateHeader {
+  uint32_t length;          // Original data length
+  uint32_t compressed;      // Compressed data length
+  uint32_t predictor;       // Whether our horizontal predictor was applied
+};
+
+
+
+#ifdef HAVE_ZLIB
+
+
+bool DeflateCompressor::available()
+{
+  return true;
+}
+
+
+
+unsigned int DeflateCompressor::Compress( const RawTile& in, RawTile& out )
+{
+  if( in.compressionType != UNCOMPRESSED || !in.data || in.dataLength <= 0 ){
+    throw string( "DeflateCompressor :: Only uncompressed tiles can be compressed" );
+  }
+
+  unsigned int length = in.dataLength;
+  unsigned int channels = ( in.channels > 0 ) ? in.channels : 1;
+  bool predict = ( in.sampleType == FIXEDPOINT && ( in.bpc == 8 || in.bpc == 16 ) );
+
+  // Apply our predictor to a copy of the data
+  const unsigned char* source = (const unsigned char*) in.data;
+  unsigned char* filtered = NULL;
+
+  if( predict ){
+    filtered = new unsigned char[length];
+    if( in.bpc == 8 ){
+      const unsigned char* s = source;
+      unsigned char* f = filtered;
+      for( unsigned int i = 0; i < channels && i < length; i++ ) f[i] = s[i];
+      for( unsigned int i = channels; i < length; i++ ) f[i] = s[i] - s[i-channels];
+    }
+    else{
+      unsigned int n = length / 2;
+      const uint16_t* s = (const uint16_t*) source;
+      uint16_t* f = (uint16_t*) filtered;
+      for( unsigned int i = 0; i < channels && i < n; i++ ) f[i] = s[i];
+      for( unsigned int i = channels; i < n; i++ ) f[i] = s[i] - s[i-channels];
+      if( length % 2 ) filtered[length-1] = source[length-1];
+    }
+    source = filtered;
+  }
+
+  uLongf compressed = compressBound( length );
+  unsigned char* scratch = new unsigned char[compressed];
+  int status = compress2( scratch, &compressed, source, length, level );
+  delete[] filtered;
+
+  if( status != Z_OK ){
+    delete[] scratch;
+    throw string( "DeflateCompressor :: Compression failed: " ) + zError( status );
+  }
+
+  // Copy into a buffer of the exact size, rounded up so that it can be allocated and
+  // copied as an array of samples of our tile's type
+  DeflateHeader header;
+  header.length = length;
+  header.compressed = compressed;
+  header.predictor = predict;
+
+  unsigned int size = ( sizeof(DeflateHeader) + compressed + 3 ) & ~3u;
+  unsigned char* buffer = (unsigned char*) allocateTileData( in.bpc, in.sampleType, size );
+  memcpy( buffer, &header, sizeof(DeflateHeader) );
+  memcpy( buffer + sizeof(DeflateHeader), scratch, compressed );
+  memset( buffer + sizeof(DeflateHeader) + compressed, 0, size - sizeof(DeflateHeader) - compressed );
+  delete[] scratch;
+
+  out = RawTile( in.tileNum, in.resolution, in.hSequence, in.vSequence,
+		 in.width, in.height, in.channels, in.bpc );
+  out.filename = in.filename;
+  out.timestamp = in.timestamp;
+  out.sampleType = in.sampleType;
+  out.padded = in.padded;
+  out.compressionType = DEFLATE;
+  out.quality = 0;
+  out.setData( buffer, size );
+
+  return size;
+}
+
+
+
+void DeflateCompressor::Decompress( RawTile& t )
+{
+  if( t.compressionType != DEFLATE ) return;
+
+  DeflateHeader header;
+  const unsigned char* source = (const unsigned char*) t.data;
+  if( !source || t.dataLength < (int) sizeof(DeflateHeader) ){
+    throw string( "DeflateCompressor :: Corrupt compressed tile" );
+  }
+  memcpy( &header, source, sizeof(DeflateHeader) );
+  if( header.compressed > t.dataLength - sizeof(DeflateHeader) ){
+    throw string( "DeflateCompressor :: Corrupt compressed tile" );
+  }
+
+  unsigned char* buffer = (unsigned char*) allocateTileData( t.bpc, t.sampleType, header.length );
+  uLongf length = header.length;
+  int status = uncompress( buffer, &length, source + sizeof(DeflateHeader), header.compressed );
+  if( status != Z_OK || length != header.length ){
+    freeTileData( buffer, t.bpc, t.sampleType );
+    throw string( "DeflateCompressor :: Decompression failed: " ) + zError( status );
+  }
+
+  // Reverse our predictor
+  if( header.predictor ){
+    unsigned int channels = ( t.channels > 0 ) ? t.channels : 1;
+    if( t.bpc == 8 ){
+      for( unsigned int i = channels; i < length; i++ ) buffer[i] += buffer[i-channels];
+    }
+    else{
+      unsigned int n = length / 2;
+      uint16_t* b = (uint16_t*) buffer;
+      for( unsigned int i = channels; i < n; i++ ) b[i] += b[i-channels];
+    }
+  }
+
+  t.setData( buffer, header.length );
+  t.compressionType = UNCOMPRESSED;
+  t.quality = 0;
+}
+
+
+
+#else
+
+
+bool DeflateCompressor::available()
+{
+  return false;
+}
+
+unsigned int DeflateCompressor::Compress( const RawTile& in, RawTile& out )
+{
+  throw string( "DeflateCompressor :: DEFLATE compression not available" );
+}
+
+void DeflateCompressor::Decompress( RawTile& t )
+{
+  if( t.compressionType == DEFLATE ) throw string( "DeflateCompressor :: DEFLATE compression not available" );
+}
+
+
+#endif
@@ -0,0 +1,77 @@
+// Lossless Tile Compression using zlib
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _DEFLATECOMPRESSOR_H
+#define _DEFLATECOMPRESSOR_H
+
+
+#include <string>
+#include "RawTile.h"
+
+
+
+/// Lossless DEFLATE compression of raw tiles
+/** Used to hold UNCOMPRESSED tiles in our tile cache in a compact form. 8 and 16 bit
+    integer data is first replaced by the difference between each sample and the previous
+    sample of the same channel, as with the TIFF horizontal predictor, which makes smooth
+    or noisy scientific imagery far more compressible. The compressed data is preceded by
+    a small header giving the original and compressed lengths, so that padded edge tiles
+    are restored exactly. Requires zlib.
+ */
+class DeflateCompressor {
+
+ private:
+
+  /// zlib compression level
+  int level;
+
+
+ public:
+
+  /// Constructor
+  /** @param l zlib compression level (1-9): 1 is by far the fastest */
+  DeflateCompressor( int l = 1 ) {
+    if( l < 1 ) level = 1;
+    else if( l > 9 ) level = 9;
+    else level = l;
+  };
+
+  /// Whether DEFLATE compression is available in this build
+  static bool available();
+
+  /// Compress an UNCOMPRESSED tile
+  /** Throws a string on error
+      @param in tile to be compressed, which is left untouched
+      @param out tile which receives the compressed data and the attributes of the original
+      @return compressed size in bytes
+   */
+  unsigned int Compress( const RawTile& in, RawTile& out );
+
+  /// Restore a DEFLATE compressed tile to its original UNCOMPRESSED form
+  /** Throws a string if the data is corrupt
+      @param t tile, whose compressed data is replaced by the decompressed data */
+  void Decompress( RawTile& t );
+
+};
+
+
+#endif
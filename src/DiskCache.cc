@@ -0,0 +1,455 @@
+// On-disk Tile Cache Member Functions
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "DiskCache.h"
+#include "Cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#endif
+
+
+using namespace std;
+
+
+// Magic number marking the start of each record
+#define DISK_MAGIC 0x49495054
+
+// Maximum number of slot directories and key length
+#define DISK_SLOTS 256
+#define DISK_MAX_KEY 4096
+
+
+
+/// Record header, followed by the key and then the tile data. Values are in native byte order
+struct Record {
+  uint32_t magic;
+  uint32_t keyLength;
+  uint32_t dataLength;
+  uint32_t width;
+  uint32_t height;
+  uint8_t channels;
+  uint8_t bpc;
+  uint8_t sampleType;
+  uint8_t compressionType;
+  int64_t timestamp;
+  uint8_t quality;
+  uint8_t padded;
+  uint8_t reserved[6];
+};
+
+
+/// Location of a tile: its log file, the offset of its data and its header
+struct Location {
+  unsigned int file;
+  unsigned long offset;
+  Record record;
+};
+
+
+class DiskCache::Index : public HASHMAP < string, Location > {};
+
+
+
+#ifndef WIN32
+
+
+DiskCache::DiskCache( const string& path, float max, int l, ofstream* log ) :
+  index( new Index ), lockfd( -1 ), currentSize( 0 ), queued( 0 ),
+  hits( 0 ), misses( 0 ), writes( 0 ), dropped( 0 ), loglevel( l ), logfile( log ), stopping( false )
+{
+  maxSize = (unsigned long)( max * 1048576.0 );
+
+  // Use log files of a sixteenth of our budget, within limits, so that eviction only ever
+  // discards a small part of the cache
+  fileSize = maxSize / 16;
+  if( fileSize < 1048576 ) fileSize = 1048576;
+  if( fileSize > 268435456 ) fileSize = 268435456;
+  maxQueued = fileSize;
+
+  // Claim the first slot directory not locked by another process
+  mkdir( path.c_str(), 0755 );
+  for( unsigned int slot = 0; slot < DISK_SLOTS && lockfd < 0; slot++ ){
+    char tmp[16];
+    snprintf( tmp, 16, "/%u", slot );
+    string dir = path + tmp;
+    if( mkdir( dir.c_str(), 0755 ) != 0 && errno != EEXIST ) break;
+    int fd = open( (dir + "/lock").c_str(), O_RDWR | O_CREAT, 0644 );
+    if( fd < 0 ) break;
+    if( flock( fd, LOCK_EX | LOCK_NB ) == 0 ){
+      lockfd = fd;
+      directory = dir;
+    }
+    else close( fd );
+  }
+  if( lockfd < 0 ){
+    delete index;
+    throw string( "DiskCache :: Unable to use disk cache directory '" + path + "': " + strerror( errno ) );
+  }
+
+  // Rebuild our index from any existing log files, oldest first
+  vector<unsigned int> ids;
+  DIR* d = opendir( directory.c_str() );
+  if( d ){
+    struct dirent* entry;
+    while( (entry = readdir( d )) ){
+      unsigned int id;
+      char suffix[8];
+      if( sscanf( entry->d_name, "%u.%7s", &id, suffix ) == 2 && strcmp( suffix, "log" ) == 0 ) ids.push_back( id );
+    }
+    closedir( d );
+  }
+  sort( ids.begin(), ids.end() );
+
+  for( unsigned int i = 0; i < ids.size(); i++ ){
+    char tmp[32];
+    snprintf( tmp, 32, "/%08u.log", ids[i] );
+    LogFile file;
+    file.id = ids[i];
+    file.fd = open( (directory + tmp).c_str(), O_RDWR );
+    file.size = 0;
+    if( file.fd < 0 ) continue;
+    // Files must be numbered consecutively to be located by their id
+    if( !files.empty() && file.id != files.back().id + 1 ){
+      close( file.fd );
+      unlink( (directory + tmp).c_str() );
+      continue;
+    }
+    this->_scan( file );
+    files.push_back( file );
+    currentSize += file.size;
+  }
+  unsigned int tiles = index->size();
+
+  this->_open();
+  this->_evict();
+
+  if( loglevel >= 1 && tiles > 0 ){
+    *logfile << "DiskCache :: Loaded " << tiles << " tiles from '" << directory << "'" << endl;
+  }
+
+#ifdef HAVE_PTHREAD
+  if( pthread_create( &writer, NULL, run, this ) != 0 ) writer = pthread_self();
+#endif
+}
+
+
+
+DiskCache::~DiskCache()
+{
+#ifdef HAVE_PTHREAD
+  queueLock.lock();
+  stopping = true;
+  queueReady.signal();
+  queueLock.unlock();
+  if( !pthread_equal( writer, pthread_self() ) ) pthread_join( writer, NULL );
+#endif
+
+  for( unsigned int i = 0; i < files.size(); i++ ) close( files[i].fd );
+  if( lockfd >= 0 ) close( lockfd );
+  delete index;
+}
+
+
+
+void DiskCache::_scan( LogFile& file )
+{
+  struct stat sb;
+  if( fstat( file.fd, &sb ) != 0 ) return;
+  unsigned long length = sb.st_size;
+  unsigned long offset = 0;
+  char key[DISK_MAX_KEY];
+
+  // Stop at the first incomplete or invalid record, which may have been left by a crash
+  while( offset + sizeof(Record) <= length ){
+    Record r;
+    if( pread( file.fd, &r, sizeof(Record), offset ) != (ssize_t) sizeof(Record) ) break;
+    if( r.magic != DISK_MAGIC || r.keyLength == 0 || r.keyLength > DISK_MAX_KEY ) break;
+    unsigned long end = offset + sizeof(Record) + r.keyLength + r.dataLength;
+    if( end > length ) break;
+    if( pread( file.fd, key, r.keyLength, offset + sizeof(Record) ) != (ssize_t) r.keyLength ) break;
+
+    Location& location = (*index)[ string( key, r.keyLength ) ];
+    location.file = file.id;
+    location.offset = offset + sizeof(Record) + r.keyLength;
+    location.record = r;
+    offset = end;
+  }
+
+  file.size = offset;
+}
+
+
+
+void DiskCache::_open()
+{
+  LogFile file;
+  file.id = files.empty() ? 0 : files.back().id + 1;
+  file.size = 0;
+  char tmp[32];
+  snprintf( tmp, 32, "/%08u.log", file.id );
+  file.fd = open( (directory + tmp).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644 );
+  if( file.fd < 0 ){
+    if( loglevel >= 1 ) *logfile << "DiskCache :: Unable to create log file '" << directory << tmp
+				 << "': " << strerror( errno ) << endl;
+    return;
+  }
+  files.push_back( file );
+}
+
+
+
+void DiskCache::_evict()
+{
+  while( currentSize > maxSize && files.size() > 1 ){
+    LogFile file = files.front();
+    for( Index::iterator i = index->begin(); i != index->end(); ){
+      if( i->second.file == file.id ) index->erase( i++ );
+      else ++i;
+    }
+    close( file.fd );
+    char tmp[32];
+    snprintf( tmp, 32, "/%08u.log", file.id );
+    unlink( (directory + tmp).c_str() );
+    currentSize -= file.size;
+    files.pop_front();
+    if( loglevel >= 3 ) *logfile << "DiskCache :: Evicted log file " << file.id << endl;
+  }
+}
+
+
+
+void DiskCache::_write( const string& key, const RawTile& tile )
+{
+  if( files.empty() || key.length() > DISK_MAX_KEY ) return;
+
+  // Only our writer modifies our file list, so our current file is safe to use without a lock
+  LogFile& file = files.back();
+
+  Record r;
+  memset( &r, 0, sizeof(Record) );
+  r.magic = DISK_MAGIC;
+  r.keyLength = key.length();
+  r.dataLength = tile.dataLength;
+  r.width = tile.width;
+  r.height = tile.height;
+  r.channels = tile.channels;
+  r.bpc = tile.bpc;
+  r.sampleType = tile.sampleType;
+  r.compressionType = tile.compressionType;
+  r.timestamp = tile.timestamp;
+  r.quality = tile.quality;
+  r.padded = tile.padded;
+
+  struct iovec iov[3];
+  iov[0].iov_base = &r;
+  iov[0].iov_len = sizeof(Record);
+  iov[1].iov_base = const_cast<char*>( key.data() );
+  iov[1].iov_len = key.length();
+  iov[2].iov_base = tile.data;
+  iov[2].iov_len = tile.dataLength;
+
+  ssize_t total = sizeof(Record) + key.length() + tile.dataLength;
+  ssize_t written = writev( file.fd, iov, 3 );
+  if( written != total ){
+    int error = errno;
+    // Cut off any partial record so that the file can still be scanned. If we cannot, we
+    // leave the file as it is, ending with the partial record, and continue in a new file,
+    // as a scan stops at the first bad record and would lose anything we appended after it
+    if( written > 0 && ftruncate( file.fd, file.size ) != 0 ){
+      ScopedWriteLock l( lock );
+      file.size += written;
+      currentSize += written;
+      this->_open();
+      this->_evict();
+    }
+    if( loglevel >= 1 ) *logfile << "DiskCache :: Unable to write tile: " << strerror( error ) << endl;
+    return;
+  }
+
+  {
+    ScopedWriteLock l( lock );
+    Location& location = (*index)[ key ];
+    location.file = file.id;
+    location.offset = file.size + sizeof(Record) + key.length();
+    location.record = r;
+    file.size += total;
+    currentSize += total;
+    if( file.size >= fileSize ) this->_open();
+    this->_evict();
+  }
+
+  ScopedLock l( queueLock );
+  writes++;
+}
+
+
+
+#ifdef HAVE_PTHREAD
+
+void* DiskCache::run( void* c )
+{
+  DiskCache* cache = static_cast<DiskCache*>( c );
+
+  while( true ){
+
+    cache->queueLock.lock();
+    while( cache->queue.empty() && !cache->stopping ) cache->queueReady.wait( cache->queueLock );
+    if( cache->queue.empty() ){
+      cache->queueLock.unlock();
+      break;
+    }
+    pair<string,RawTile> item = cache->queue.front();
+    cache->queue.pop_front();
+    cache->queued -= item.second.dataLength;
+    cache->queueLock.unlock();
+
+    // The same tile may have been queued more than once
+    bool stored = false;
+    {
+      ScopedReadLock l( cache->lock );
+      Index::const_iterator i = cache->index->find( item.first );
+      stored = ( i != cache->index->end() && i->second.record.timestamp >= item.second.timestamp );
+    }
+    if( !stored ) cache->_write( item.first, item.second );
+  }
+
+  return NULL;
+}
+
+#endif
+
+
+
+void DiskCache::insert( const string& key, const RawTile& tile )
+{
+  {
+    ScopedReadLock l( lock );
+    Index::const_iterator i = index->find( key );
+    if( i != index->end() && i->second.record.timestamp >= tile.timestamp ) return;
+  }
+
+#ifdef HAVE_PTHREAD
+  // Tiles held in shared buffers are queued without copying their data
+  ScopedLock l( queueLock );
+  if( queued + tile.dataLength > maxQueued ){
+    dropped++;
+    return;
+  }
+  queue.push_back( make_pair( key, tile ) );
+  queued += tile.dataLength;
+  queueReady.signal();
+#else
+  this->_write( key, tile );
+#endif
+}
+
+
+
+bool DiskCache::getTile( const string& key, RawTile& tile )
+{
+  ScopedReadLock l( lock );
+
+  Index::const_iterator i = index->find( key );
+  if( i == index->end() ){
+    ScopedLock q( queueLock );
+    misses++;
+    return false;
+  }
+
+  const Location& location = i->second;
+  const Record& r = location.record;
+  const LogFile& file = files[ location.file - files.front().id ];
+
+  tile = RawTile();
+  tile.width = r.width;
+  tile.height = r.height;
+  tile.channels = r.channels;
+  tile.bpc = r.bpc;
+  tile.sampleType = (SampleType) r.sampleType;
+  tile.compressionType = (CompressionType) r.compressionType;
+  tile.quality = r.quality;
+  tile.padded = r.padded;
+  tile.timestamp = r.timestamp;
+  tile.dataLength = r.dataLength;
+  tile.data = allocateTileData( tile.bpc, tile.sampleType, tile.dataLength );
+
+  if( pread( file.fd, tile.data, r.dataLength, location.offset ) != (ssize_t) r.dataLength ){
+    tile = RawTile();
+    return false;
+  }
+
+  ScopedLock q( queueLock );
+  hits++;
+  return true;
+}
+
+
+
+unsigned int DiskCache::getNumElements()
+{
+  ScopedReadLock l( lock );
+  return index->size();
+}
+
+
+
+unsigned long DiskCache::getSize()
+{
+  ScopedReadLock l( lock );
+  return currentSize;
+}
+
+
+
+#else
+
+
+// Our log files rely on POSIX file and directory functions
+
+DiskCache::DiskCache( const string& path, float max, int l, ofstream* log ) :
+  index( NULL ), lockfd( -1 ), maxSize( 0 ), fileSize( 0 ), currentSize( 0 ), queued( 0 ), maxQueued( 0 ),
+  hits( 0 ), misses( 0 ), writes( 0 ), dropped( 0 ), loglevel( l ), logfile( log ), stopping( false )
+{
+  throw string( "DiskCache :: Disk cache not supported on this platform" );
+}
+
+DiskCache::~DiskCache(){}
+void DiskCache::insert( const string& key, const RawTile& tile ){}
+bool DiskCache::getTile( const string& key, RawTile& tile ){ return false; }
+unsigned int DiskCache::getNumElements(){ return 0; }
+unsigned long DiskCache::getSize(){ return 0; }
+
+
+#endif
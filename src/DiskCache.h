@@ -0,0 +1,168 @@
+// On-disk Tile Cache
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _DISKCACHE_H
+#define _DISKCACHE_H
+
+
+#include <string>
+#include <deque>
+#include <fstream>
+#include "RawTile.h"
+#include "Mutex.h"
+
+
+
+/// Second level cache of encoded tiles on local disk
+/** Tiles are appended to a series of log files, which are never modified once written,
+    and located through an in-memory index. Writes are queued and carried out by a
+    background thread, so that inserting a tile never waits for the disk. Tiles are read
+    back with a single pread(). Once the total size of our log files exceeds our budget,
+    the oldest file is deleted along with its index entries. On startup, any existing log
+    files are scanned to rebuild the index, so the cache survives a restart.
+
+    Each server process uses its own numbered slot directory within the cache directory,
+    which it locks for as long as it runs, so that worker processes never share files.
+ */
+class DiskCache {
+
+ private:
+
+  /// Index of our tiles
+  class Index;
+  Index* index;
+
+  /// Our log files, oldest first
+  struct LogFile {
+    unsigned int id;
+    int fd;
+    unsigned long size;
+  };
+  std::deque<LogFile> files;
+
+  /// Our slot directory and its lock file descriptor
+  std::string directory;
+  int lockfd;
+
+  /// Maximum total size of our log files and of each individual file in bytes
+  unsigned long maxSize;
+  unsigned long fileSize;
+
+  /// Total size of our log files
+  unsigned long currentSize;
+
+  /// Tiles waiting to be written, the number of bytes they hold and the maximum
+  std::deque< std::pair<std::string,RawTile> > queue;
+  unsigned long queued;
+  unsigned long maxQueued;
+
+  /// Counters
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long writes;
+  unsigned long dropped;
+
+  /// Our log
+  int loglevel;
+  std::ofstream* logfile;
+
+  /// Whether our writer thread should finish
+  bool stopping;
+
+  /// Lock protecting our index and files: held shared while reading a tile
+  RWLock lock;
+
+  /// Lock protecting our write queue and counters and condition signalled when tiles are queued
+  Mutex queueLock;
+  Condition queueReady;
+
+  /// Scan an existing log file and add its tiles to our index
+  void _scan( LogFile& file );
+
+  /// Start a new log file
+  void _open();
+
+  /// Append a tile to our current log file
+  void _write( const std::string& key, const RawTile& tile );
+
+  /// Delete our oldest log files until we are within our budget
+  void _evict();
+
+#ifdef HAVE_PTHREAD
+  /// Background writer thread
+  pthread_t writer;
+  static void* run( void* cache );
+#endif
+
+  /// Disallow copying
+  DiskCache( const DiskCache& );
+  DiskCache& operator = ( const DiskCache& );
+
+
+ public:
+
+  /// Constructor
+  /** Throws a string if the cache directory cannot be used
+      @param path cache directory
+      @param max maximum size in MB
+      @param loglevel logging level
+      @param logfile log stream
+   */
+  DiskCache( const std::string& path, float max, int loglevel, std::ofstream* logfile );
+
+  /// Destructor - writes out any queued tiles and closes our files
+  ~DiskCache();
+
+  /// Queue a tile to be written
+  /** Tiles already stored are ignored unless the new tile is more recent. If too much
+      data is already waiting to be written, the tile is dropped
+      @param key cache index for this tile
+      @param tile tile to be stored
+   */
+  void insert( const std::string& key, const RawTile& tile );
+
+  /// Get a tile
+  /** @param key cache index of the tile
+      @param tile RawTile into which the tile is read
+      @return true if the tile was found
+   */
+  bool getTile( const std::string& key, RawTile& tile );
+
+  /// Return our slot directory
+  const std::string& getDirectory() const { return directory; };
+
+  /// Return the number of tiles stored
+  unsigned int getNumElements();
+
+  /// Return the number of bytes stored
+  unsigned long getSize();
+
+  /// Return our counters
+  unsigned long getHits() { ScopedLock l( queueLock ); return hits; };
+  unsigned long getMisses() { ScopedLock l( queueLock ); return misses; };
+  unsigned long getWrites() { ScopedLock l( queueLock ); return writes; };
+  unsigned long getDropped() { ScopedLock l( queueLock ); return dropped; };
+
+};
+
+
+#endif
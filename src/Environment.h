@@ -27,6 +27,14 @@
 #define VERBOSITY 1
 #define LOGFILE "/tmp/iipsrv.log"
 #define MAX_IMAGE_CACHE_SIZE 10.0
+#define CACHE_POLICY "clock"
+#define CACHE_COMPRESSION 0
+#define MEMORY_LIMIT 0
+#define MAX_IMAGE_METADATA_CACHE 1000
+#define MAX_OPEN_IMAGES 100
+#define FILE_WATCH false
+#define TIFF_IO "libtiff"
+#define REVALIDATE_TTL 0
 #define FILENAME_PATTERN "_pyr_"
 #define JPEG_QUALITY 75
 #define MAX_CVT 5000
@@ -42,9 +50,25 @@
 #define BASE_URL "";
 #define CACHE_CONTROL "max-age=86400"; // 24 hours
 #define ALLOW_UPSCALING true
+#define WORKER_THREADS 1
+#define DECODER_THREADS 0
+#define SHARED_CACHE_SIZE 0
+#define SHARED_CACHE_NAME "/iipsrv"
+#define WORKER_PROCESSES 0
+#define WORKER_AFFINITY false
+#define CACHE_SNAPSHOT ""
+#define DISK_CACHE ""
+#define DISK_CACHE_SIZE 1024
+#define CACHE_SNAPSHOT_INTERVAL 0
+#define ADMISSION_MEMORY 0
+#define ADMISSION_CONCURRENCY 0
+#define ADMISSION_QUEUE 16
+#define ADMISSION_TIMEOUT 10
+#define INTERACTIVE_WORKERS 0
 
 
 #include <string>
+#include <cctype>
 
 
 /// Class to obtain environment variables
@@ -82,6 +106,85 @@ class Environment {
   }
 
 
+  static int getCacheCompression(){
+    char* envpara = getenv( "CACHE_COMPRESSION" );
+    int level;
+    if( envpara ) level = atoi( envpara );
+    else level = CACHE_COMPRESSION;
+    if( level < 0 ) level = 0;
+    if( level > 9 ) level = 9;
+    return level;
+  }
+
+
+  static float getMemoryLimit(){
+    char* envpara = getenv( "MEMORY_LIMIT" );
+    float limit;
+    if( envpara ) limit = atof( envpara );
+    else limit = MEMORY_LIMIT;
+    if( limit < 0 ) limit = 0;
+    return limit;
+  }
+
+
+  static unsigned int getMaxImageMetadataCache(){
+    char* envpara = getenv( "MAX_IMAGE_METADATA_CACHE" );
+    int max;
+    if( envpara ) max = atoi( envpara );
+    else max = MAX_IMAGE_METADATA_CACHE;
+    if( max < 1 ) max = 1;
+    return max;
+  }
+
+
+  static unsigned int getMaxOpenImages(){
+    char* envpara = getenv( "MAX_OPEN_IMAGES" );
+    int max;
+    if( envpara ) max = atoi( envpara );
+    else max = MAX_OPEN_IMAGES;
+    if( max < 0 ) max = 0;
+    return max;
+  }
+
+
+  static bool getFileWatch(){
+    char* envpara = getenv( "FILE_WATCH" );
+    bool watch = FILE_WATCH;
+    if( envpara ) watch = atoi( envpara ) != 0;
+    return watch;
+  }
+
+
+  static unsigned int getRevalidateTTL(){
+    char* envpara = getenv( "REVALIDATE_TTL" );
+    int ttl;
+    if( envpara ) ttl = atoi( envpara );
+    else ttl = REVALIDATE_TTL;
+    if( ttl < 0 ) ttl = 0;
+    return ttl;
+  }
+
+
+  static std::string getTIFFIO(){
+    char* envpara = getenv( "TIFF_IO" );
+    std::string io;
+    if( envpara ) io = std::string( envpara );
+    else io = TIFF_IO;
+    for( unsigned int i = 0; i < io.length(); i++ ) io[i] = tolower( io[i] );
+    return io;
+  }
+
+
+  static std::string getCachePolicy(){
+    char* envpara = getenv( "CACHE_POLICY" );
+    std::string policy;
+    if( envpara ) policy = std::string( envpara );
+    else policy = CACHE_POLICY;
+    for( unsigned int i = 0; i < policy.length(); i++ ) policy[i] = tolower( policy[i] );
+    return policy;
+  }
+
+
   static std::string getFileNamePattern(){
     char* envpara = getenv( "FILENAME_PATTERN" );
     std::string filename_pattern;
@@ -249,6 +352,153 @@ class Environment {
     return allow_upscaling;
   }
 
+
+  static unsigned int getWorkerThreads(){
+    char* envpara = getenv( "WORKER_THREADS" );
+    int threads;
+    if( envpara ) threads = atoi( envpara );
+    else threads = WORKER_THREADS;
+    if( threads < 1 ) threads = 1;
+    return threads;
+  }
+
+
+  static unsigned int getDecoderThreads(){
+    char* envpara = getenv( "DECODER_THREADS" );
+    int threads;
+    if( envpara ) threads = atoi( envpara );
+    else threads = DECODER_THREADS;
+    if( threads < 0 ) threads = 0;
+    return threads;
+  }
+
+
+  static unsigned int getWorkerProcesses(){
+    char* envpara = getenv( "WORKER_PROCESSES" );
+    int processes;
+    if( envpara ) processes = atoi( envpara );
+    else processes = WORKER_PROCESSES;
+    if( processes < 0 ) processes = 0;
+    return processes;
+  }
+
+
+  static bool getWorkerAffinity(){
+    char* envpara = getenv( "WORKER_AFFINITY" );
+    bool affinity;
+    if( envpara ) affinity = atoi( envpara );
+    else affinity = WORKER_AFFINITY;
+    return affinity;
+  }
+
+
+  static float getSharedCacheSize(){
+    char* envpara = getenv( "SHARED_CACHE_SIZE" );
+    float size;
+    if( envpara ) size = atof( envpara );
+    else size = SHARED_CACHE_SIZE;
+    if( size < 0 ) size = 0;
+    return size;
+  }
+
+
+  static std::string getSharedCacheName(){
+    char* envpara = getenv( "SHARED_CACHE_NAME" );
+    std::string name;
+    if( envpara ) name = std::string( envpara );
+    else name = SHARED_CACHE_NAME;
+    return name;
+  }
+
+
+  static std::string getDiskCache(){
+    char* envpara = getenv( "DISK_CACHE" );
+    std::string path;
+    if( envpara ) path = std::string( envpara );
+    else path = DISK_CACHE;
+    return path;
+  }
+
+
+  static float getDiskCacheSize(){
+    char* envpara = getenv( "DISK_CACHE_SIZE" );
+    float size;
+    if( envpara ) size = atof( envpara );
+    else size = DISK_CACHE_SIZE;
+    if( size < 1 ) size = 1;
+    return size;
+  }
+
+
+  static std::string getCacheSnapshot(){
+    char* envpara = getenv( "CACHE_SNAPSHOT" );
+    std::string snapshot;
+    if( envpara ) snapshot = std::string( envpara );
+    else snapshot = CACHE_SNAPSHOT;
+    return snapshot;
+  }
+
+
+  static unsigned int getCacheSnapshotInterval(){
+    char* envpara = getenv( "CACHE_SNAPSHOT_INTERVAL" );
+    int interval;
+    if( envpara ) interval = atoi( envpara );
+    else interval = CACHE_SNAPSHOT_INTERVAL;
+    if( interval < 0 ) interval = 0;
+    return interval;
+  }
+
+
+  static unsigned int getInteractiveWorkers(){
+    char* envpara = getenv( "INTERACTIVE_WORKERS" );
+    int workers;
+    if( envpara ) workers = atoi( envpara );
+    else workers = INTERACTIVE_WORKERS;
+    if( workers < 0 ) workers = 0;
+    return workers;
+  }
+
+
+  static float getAdmissionMemory(){
+    char* envpara = getenv( "ADMISSION_MEMORY" );
+    float memory;
+    if( envpara ) memory = atof( envpara );
+    else memory = ADMISSION_MEMORY;
+    if( memory < 0 ) memory = 0;
+    return memory;
+  }
+
+
+  static unsigned int getAdmissionConcurrency(){
+    char* envpara = getenv( "ADMISSION_CONCURRENCY" );
+    int concurrency;
+    if( envpara ) concurrency = atoi( envpara );
+    else concurrency = ADMISSION_CONCURRENCY;
+    if( concurrency < 0 ) concurrency = 0;
+    return concurrency;
+  }
+
+
+  static unsigned int getAdmissionQueue(){
+    char* envpara = getenv( "ADMISSION_QUEUE" );
+    int queue;
+    if( envpara ) queue = atoi( envpara );
+    else queue = ADMISSION_QUEUE;
+    if( queue < 0 ) queue = 0;
+    return queue;
+  }
+
+
+  static unsigned int getAdmissionTimeout(){
+    char* envpara = getenv( "ADMISSION_TIMEOUT" );
+    int timeout;
+    if( envpara ) timeout = atoi( envpara );
+    else timeout = ADMISSION_TIMEOUT;
+    if( timeout < 0 ) timeout = 0;
+    return timeout;
+  }
+
+
 };
 
 
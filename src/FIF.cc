@@ -33,8 +33,6 @@
 #include "OpenJPEGImage.h"
 #endif
 
-#define MAXIMAGECACHE 1000  // Max number of items in image cache
-
 
 
 using namespace std;
@@ -82,33 +80,54 @@ void FIF::run( Session* session, const string& src ){
   // Put the image setup into a try block as object creation can throw an exception
   try{
 
-    // Check whether cache is empty
-    if( session->imageCache->empty() ){
-      if( session->loglevel >= 1 ) *(session->logfile) << "FIF :: Image cache initialization" << endl;
-      test = IIPImage( argument );
-      test.setFileNamePattern( filename_pattern );
-      test.setFileSystemPrefix( filesystem_prefix );
-      test.Initialise();
+    // Release any image opened by an earlier FIF command in this request
+    if( *session->image ){
+      if( session->imagePool ) session->imagePool->checkin( *session->image );
+      else delete *session->image;
+      *session->image = NULL;
+    }
+
+    // Look up our image in our metadata cache. Hits share the cached metadata, which
+    // is only copied into the image object used by this request
+    ImageRef cached = session->imageCache->get( argument );
+    unsigned long entries = session->imageCache->size();
+
+    // Open image handle from our pool
+    IIPImage* pooled = NULL;
+
+    // Cache Hit
+    if( cached.valid() ){
+      if( cached->missing() ){
+	if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Image cache hit for missing image" << endl;
+	throw file_error( cached->error );
+      }
+      timestamp = cached->image.timestamp;       // Record timestamp if we have a cached image
+      if( session->loglevel >= 2 ){
+	*(session->logfile) << "FIF :: Image cache hit. Number of elements: " << entries << endl;
+      }
+      // Reuse an idle open handle for this image if we have one, so that we neither copy
+      // the metadata nor reopen the file
+      if( session->imagePool ){
+	pooled = session->imagePool->checkout( argument, cached->image.currentX, cached->image.currentY, &cached->image );
+      }
+      if( !pooled ) test = cached->image;
     }
-    // If not, look up our object
+    // Cache Miss or empty cache
     else{
-      // Cache Hit
-      if( session->imageCache->find(argument) != session->imageCache->end() ){
-	test = (*session->imageCache)[ argument ];
-	timestamp = test.timestamp;       // Record timestamp if we have a cached image
-	if( session->loglevel >= 2 ){
-	  *(session->logfile) << "FIF :: Image cache hit. Number of elements: " << session->imageCache->size() << endl;
-	}
+      if( entries == 0 ){
+	if( session->loglevel >= 1 ) *(session->logfile) << "FIF :: Image cache initialization" << endl;
       }
-      // Cache Miss
-      else{
-	if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Image cache miss" << endl;
-	test = IIPImage( argument );
-	test.setFileNamePattern( filename_pattern );
-	test.setFileSystemPrefix( filesystem_prefix );
+      else if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Image cache miss" << endl;
+      test = IIPImage( argument );
+      test.setFileNamePattern( filename_pattern );
+      test.setFileSystemPrefix( filesystem_prefix );
+      try{
 	test.Initialise();
-	// Delete items if our list of images is too long.
-	if( session->imageCache->size() >= MAXIMAGECACHE ) session->imageCache->erase( session->imageCache->begin() );
+      }
+      catch( const file_error& error ){
+	// Remember that this image does not exist
+	session->imageCache->insertMissing( argument, error.what() );
+	throw;
       }
     }
 
@@ -120,7 +139,11 @@ void FIF::run( Session* session, const string& src ){
 
     ImageFormat format = test.getImageFormat();
 
-    if( format == TIF ){
+    if( pooled ){
+      if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Reusing open image handle" << endl;
+      *session->image = pooled;
+    }
+    else if( format == TIF ){
       if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: TIFF image detected" << endl;
       *session->image = new TPTImage( test );
     }
@@ -172,19 +195,30 @@ void FIF::run( Session* session, const string& src ){
     */
 
 
-    // Open image and update timestamp
-    (*session->image)->openImage();
+    // Open image and update timestamp. Forget any cached metadata if the image can no longer be opened
+    if( !pooled ){
+      if( session->imagePool ) session->imagePool->track( *session->image );
+      try{
+	(*session->image)->openImage();
+      }
+      catch( const file_error& error ){
+	if( cached.valid() ) session->imageCache->erase( argument );
+	throw;
+      }
+    }
 
     // Check timestamp consistency. If cached timestamp is older, update metadata
+    bool modified = false;
     if( timestamp>0 && (timestamp < (*session->image)->timestamp) ){
       if( session->loglevel >= 2 ){
 	*(session->logfile) << "FIF :: Image timestamp changed: reloading metadata" << endl;
       }
       (*session->image)->loadImageInfo( (*session->image)->currentX, (*session->image)->currentY );
+      modified = true;
     }
 
-    // Add this image to our cache, overwriting previous version if it exists
-    (*session->imageCache)[argument] = *(*session->image);
+    // Add new or modified images to our cache, which evicts its least recently used entry if full
+    if( !cached.valid() || modified ) session->imageCache->insert( argument, *(*session->image) );
 
     if( session->loglevel >= 3 ){
       *(session->logfile) << "FIF :: Created image" << endl;
@@ -200,9 +234,14 @@ void FIF::run( Session* session, const string& src ){
 			  << "FIF :: Image contains " << (*session->image)->channels
 			  << " channel" << (((*session->image)->channels>1)?"s":"") << " with "
 			  << (*session->image)->bpc << " bit" << (((*session->image)->bpc>1)?"s":"") << " per channel" << endl;
-      tm *t = gmtime( &(*session->image)->timestamp );
+      tm t;
+#ifdef WIN32
+      gmtime_s( &t, &(*session->image)->timestamp );
+#else
+      gmtime_r( &(*session->image)->timestamp, &t );
+#endif
       char strt[64];
-      strftime( strt, 64, "%a, %d %b %Y %H:%M:%S GMT", t );
+      strftime( strt, 64, "%a, %d %b %Y %H:%M:%S GMT", &t );
       *(session->logfile) << "FIF :: Image timestamp: " << strt << endl;
     }
 
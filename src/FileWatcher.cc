@@ -0,0 +1,268 @@
+// Image File Change Watcher Member Functions
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "FileWatcher.h"
+
+#ifdef HAVE_INOTIFY
+#include <cerrno>
+#include <cstring>
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+
+using namespace std;
+
+
+
+#ifdef HAVE_INOTIFY
+
+
+// Changes to the files within a directory and to the directory itself
+#define WATCH_EVENTS ( IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+		       IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR )
+
+
+/// Whether a file system is shared over the network, so that changes by other hosts go unreported
+static bool networkFileSystem( unsigned int type )
+{
+  switch( type ){
+    case 0x6969:       // NFS
+    case 0x517B:       // SMB
+    case 0xFF534D42:   // CIFS
+    case 0xFE534D42:   // SMB2
+    case 0x65735546:   // FUSE
+    case 0x00C36400:   // Ceph
+    case 0x5346414F:   // AFS
+    case 0x01021997:   // 9P
+    case 0x0BD00BD0:   // Lustre
+    case 0x01161970:   // GFS2
+    case 0x7461636F:   // OCFS2
+      return true;
+    default:
+      return false;
+  }
+}
+
+
+
+FileWatcher::FileWatcher( const string& p, const string& pat, ImageCache* ic, ImagePool* ip,
+			  int l, ofstream* log ) :
+  prefix( p ), pattern( pat ), imageCache( ic ), imagePool( ip ), loglevel( l ), logfile( log ),
+  exhausted( false ), events( 0 ), overflows( 0 ), stopping( false )
+{
+  fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+  if( fd < 0 ){
+    throw string( "FileWatcher :: Unable to initialise inotify: " ) + strerror( errno );
+  }
+  if( pthread_create( &thread, NULL, run, this ) != 0 ){
+    close( fd );
+    throw string( "FileWatcher :: Unable to start event thread" );
+  }
+}
+
+
+
+FileWatcher::~FileWatcher()
+{
+  stopping = true;
+  pthread_join( thread, NULL );
+  close( fd );
+}
+
+
+
+bool FileWatcher::watch( const string& file )
+{
+  // Name our directory as a prefix of our file name, so that our image paths can be rebuilt exactly
+  size_t n = file.find_last_of( '/' );
+  string dir = ( n == string::npos ) ? string() : file.substr( 0, n+1 );
+
+  ScopedLock l( lock );
+
+  map<string,int>::const_iterator i = directories.find( dir );
+  if( i != directories.end() ) return i->second >= 0;
+
+  const char* path = dir.empty() ? "." : dir.c_str();
+  struct statfs fs;
+  if( statfs( path, &fs ) != 0 ) return false;
+
+  int wd = -1;
+  if( !networkFileSystem( (unsigned int) fs.f_type ) ){
+    wd = inotify_add_watch( fd, path, WATCH_EVENTS );
+    if( wd < 0 ){
+      // Try again next time, as watches may since have been freed
+      if( errno == ENOSPC && !exhausted ){
+	exhausted = true;
+	if( loglevel >= 1 ){
+	  *logfile << "FileWatcher :: Out of inotify watches: raise fs.inotify.max_user_watches" << endl;
+	}
+      }
+      return false;
+    }
+    watches[wd].push_back( dir );
+  }
+  else if( loglevel >= 2 ){
+    *logfile << "FileWatcher :: Not watching network file system directory '" << path << "'" << endl;
+  }
+
+  directories[dir] = wd;
+  return wd >= 0;
+}
+
+
+
+unsigned int FileWatcher::getWatches()
+{
+  ScopedLock l( lock );
+  return watches.size();
+}
+
+
+
+void FileWatcher::_invalidate( const string& file )
+{
+  if( file.compare( 0, prefix.size(), prefix ) != 0 ) return;
+  string path = file.substr( prefix.size() );
+
+  imageCache->erase( path );
+  imagePool->invalidate( path );
+
+  // Files within an image sequence belong to the image named by the part preceding our pattern
+  if( !pattern.empty() ){
+    size_t n = path.rfind( pattern );
+    if( n != string::npos && n > 0 ){
+      string sequence = path.substr( 0, n );
+      imageCache->erase( sequence );
+      imagePool->invalidate( sequence );
+    }
+  }
+}
+
+
+
+void FileWatcher::_flush()
+{
+  imageCache->clear();
+  imagePool->flush();
+}
+
+
+
+void FileWatcher::_process( const char* buffer, long length )
+{
+  vector<string> files;
+  bool flush = false;
+
+  {
+    ScopedLock l( lock );
+
+    for( const char* p = buffer; p < buffer + length; ){
+
+      const struct inotify_event* e = (const struct inotify_event*) p;
+      p += sizeof(struct inotify_event) + e->len;
+      events++;
+
+      if( e->mask & IN_Q_OVERFLOW ){
+	overflows++;
+	flush = true;
+	continue;
+      }
+
+      map < int, vector<string> >::iterator w = watches.find( e->wd );
+      if( w == watches.end() ) continue;
+
+      // Our directory has itself gone or moved, so the paths of its files are no longer valid
+      if( e->mask & ( IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT ) ){
+	if( !( e->mask & IN_IGNORED ) ) inotify_rm_watch( fd, e->wd );
+	for( unsigned int i = 0; i < w->second.size(); i++ ) directories.erase( w->second[i] );
+	watches.erase( w );
+	flush = true;
+	continue;
+      }
+
+      if( e->len > 0 ){
+	for( unsigned int i = 0; i < w->second.size(); i++ ) files.push_back( w->second[i] + e->name );
+      }
+    }
+  }
+
+  if( flush ){
+    if( loglevel >= 1 ) *logfile << "FileWatcher :: Lost track of changes: invalidating all images" << endl;
+    this->_flush();
+    return;
+  }
+
+  for( unsigned int i = 0; i < files.size(); i++ ){
+    if( loglevel >= 3 ) *logfile << "FileWatcher :: " << files[i] << " changed" << endl;
+    this->_invalidate( files[i] );
+  }
+}
+
+
+
+void* FileWatcher::run( void* w )
+{
+  FileWatcher* watcher = static_cast<FileWatcher*>( w );
+
+  char buffer[16384] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+
+  // Wake up regularly to check whether we are shutting down
+  while( !watcher->stopping ){
+    struct pollfd p;
+    p.fd = watcher->fd;
+    p.events = POLLIN;
+    p.revents = 0;
+    if( poll( &p, 1, 500 ) <= 0 ) continue;
+    long length = read( watcher->fd, buffer, sizeof(buffer) );
+    if( length > 0 ) watcher->_process( buffer, length );
+  }
+
+  return NULL;
+}
+
+
+
+#else
+
+
+// inotify is specific to Linux
+
+FileWatcher::FileWatcher( const string& p, const string& pat, ImageCache* ic, ImagePool* ip,
+			  int l, ofstream* log ) :
+  prefix( p ), pattern( pat ), imageCache( ic ), imagePool( ip ), loglevel( l ), logfile( log ),
+  fd( -1 ), exhausted( false ), events( 0 ), overflows( 0 ), stopping( false )
+{
+  throw string( "FileWatcher :: File watching not supported on this platform" );
+}
+
+FileWatcher::~FileWatcher(){}
+bool FileWatcher::watch( const string& file ){ return false; }
+unsigned int FileWatcher::getWatches(){ return 0; }
+void FileWatcher::_invalidate( const string& file ){}
+void FileWatcher::_flush(){}
+void FileWatcher::_process( const char* buffer, long length ){}
+
+
+#endif
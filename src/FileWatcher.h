@@ -0,0 +1,143 @@
+// Image File Change Watcher
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _FILEWATCHER_H
+#define _FILEWATCHER_H
+
+
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include "ImageCache.h"
+#include "ImagePool.h"
+#include "Mutex.h"
+
+#ifdef HAVE_INOTIFY
+#include <pthread.h>
+#endif
+
+
+
+/// Watches the directories of our images for changes using inotify
+/** The directory of each image is watched as it is first opened, and any file which is
+    written, replaced, touched, created or deleted within it is removed from our image
+    metadata cache and pool of open image handles. Open handles whose directory is
+    watched can then be trusted without checking their file on every request. Tiles
+    need no separate treatment, as they are already replaced once their image is
+    reopened with a newer modification time.
+
+    Directories on network filesystems, where changes made by other hosts are not
+    reported, are not watched. If our event queue overflows or a watched directory is
+    itself moved or removed, everything is invalidated. Only available on Linux.
+ */
+class FileWatcher {
+
+ private:
+
+  /// Our file system prefix and sequence file name pattern, used to map files to our image paths
+  std::string prefix, pattern;
+
+  /// The caches we invalidate
+  ImageCache* imageCache;
+  ImagePool* imagePool;
+
+  /// Our log
+  int loglevel;
+  std::ofstream* logfile;
+
+  /// Our inotify descriptor
+  int fd;
+
+  /// Directories as named by our images and their watch descriptor, or -1 if they cannot be watched
+  std::map < std::string, int > directories;
+
+  /// Names of each watched directory
+  std::map < int, std::vector<std::string> > watches;
+
+  /// Whether we have reported running out of watches
+  bool exhausted;
+
+  /// Our counters
+  unsigned long events, overflows;
+
+  /// Lock protecting our state
+  Mutex lock;
+
+  /// Whether we are shutting down
+  volatile bool stopping;
+
+  /// Remove a changed file from our caches
+  void _invalidate( const std::string& file );
+
+  /// Remove everything from our caches
+  void _flush();
+
+  /// Handle a batch of events
+  void _process( const char* buffer, long length );
+
+#ifdef HAVE_INOTIFY
+  /// Background event thread
+  pthread_t thread;
+  static void* run( void* watcher );
+#endif
+
+  /// Disallow copying
+  FileWatcher( const FileWatcher& );
+  FileWatcher& operator = ( const FileWatcher& );
+
+
+ public:
+
+  /// Constructor
+  /** Throws a string if inotify is not available
+      @param prefix file system prefix added to our image paths
+      @param pattern file name pattern of image sequences
+      @param imageCache image metadata cache
+      @param imagePool pool of open image handles
+      @param loglevel logging level
+      @param logfile log stream
+   */
+  FileWatcher( const std::string& prefix, const std::string& pattern, ImageCache* imageCache,
+	       ImagePool* imagePool, int loglevel, std::ofstream* logfile );
+
+  /// Destructor - stops our event thread and removes our watches
+  ~FileWatcher();
+
+  /// Watch the directory of a file
+  /** @param file full path of an image file
+      @return whether changes to the file will be reported
+   */
+  bool watch( const std::string& file );
+
+  /// Return the number of watched directories
+  unsigned int getWatches();
+
+  /// Return our counters
+  unsigned long getEvents() { ScopedLock l( lock ); return events; };
+  unsigned long getOverflows() { ScopedLock l( lock ); return overflows; };
+
+};
+
+
+#endif
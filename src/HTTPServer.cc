@@ -0,0 +1,740 @@
+// Native HTTP/1.1 Server Class Member Functions
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "HTTPServer.h"
+
+#include <cctype>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <unistd.h>
+
+#ifdef HAVE_EPOLL
+#include <ctime>
+#include <stdint.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+
+using namespace std;
+
+
+
+/// Compare the start of a header line with a field name, ignoring case
+static bool isField( const string& line, const char* name )
+{
+  size_t len = strlen( name );
+  return ( line.length() > len ) && ( line[len] == ':' ) && ( strncasecmp( line.c_str(), name, len ) == 0 );
+}
+
+
+/// Send a response consisting of just a status line
+static void sendStatus( int fd, const string& status )
+{
+  string response = "HTTP/1.1 " + status + "\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
+  send( fd, response.data(), response.length(), MSG_NOSIGNAL );
+}
+
+
+/// Return the value of a header line with any surrounding whitespace removed
+static string fieldValue( const string& line )
+{
+  size_t start = line.find( ':' ) + 1;
+  while( start < line.length() && isspace( line[start] ) ) start++;
+  size_t end = line.length();
+  while( end > start && isspace( line[end-1] ) ) end--;
+  return line.substr( start, end-start );
+}
+
+
+
+char** HTTPRequest::getParams()
+{
+  envp.clear();
+  for( unsigned int i = 0; i < params.size(); i++ ) envp.push_back( const_cast<char*>( params[i].c_str() ) );
+  envp.push_back( NULL );
+  return &envp[0];
+}
+
+
+
+int HTTPRequest::parse( string& buffer, string& error )
+{
+  // Skip any blank lines preceding a request
+  size_t start = 0;
+  while( start < buffer.length() && ( buffer[start] == '\r' || buffer[start] == '\n' ) ) start++;
+  if( start > 0 ) buffer.erase( 0, start );
+
+  // Wait until we have a complete header block
+  size_t end = buffer.find( "\r\n\r\n" );
+  if( end == string::npos ){
+    if( buffer.length() > HTTP_MAX_HEADER ){
+      error = "431 Request Header Fields Too Large";
+      return -1;
+    }
+    return 0;
+  }
+
+  this->clear();
+
+  // Parse our request line
+  size_t eol = buffer.find( "\r\n" );
+  string line = buffer.substr( 0, eol );
+  size_t s1 = line.find( ' ' );
+  size_t s2 = ( s1 == string::npos ) ? string::npos : line.find( ' ', s1+1 );
+  if( s2 == string::npos ){
+    error = "400 Bad Request";
+    return -1;
+  }
+  method = line.substr( 0, s1 );
+  uri = line.substr( s1+1, s2-s1-1 );
+  protocol = line.substr( s2+1 );
+
+  if( protocol.compare( 0, 5, "HTTP/" ) != 0 ){
+    error = "400 Bad Request";
+    return -1;
+  }
+
+  // HTTP/1.1 connections are persistent by default, HTTP/1.0 ones only on request
+  keepAlive = ( protocol != "HTTP/1.0" );
+
+  // Parse our headers, making each one available as an HTTP_ parameter as with CGI
+  size_t contentLength = 0;
+  size_t pos = eol + 2;
+  while( pos < end ){
+    eol = buffer.find( "\r\n", pos );
+    line = buffer.substr( pos, eol-pos );
+    pos = eol + 2;
+
+    size_t colon = line.find( ':' );
+    if( colon == string::npos || colon == 0 ) continue;
+
+    string name = "HTTP_";
+    for( size_t i = 0; i < colon; i++ ){
+      char c = line[i];
+      name += ( c == '-' ) ? '_' : toupper( c );
+    }
+    string value = fieldValue( line );
+    this->setParam( name, value );
+
+    if( isField( line, "Connection" ) ){
+      if( strcasecmp( value.c_str(), "close" ) == 0 ) keepAlive = false;
+      else if( strcasecmp( value.c_str(), "keep-alive" ) == 0 ) keepAlive = true;
+    }
+    else if( isField( line, "Content-Length" ) ) contentLength = strtoul( value.c_str(), NULL, 10 );
+    else if( isField( line, "Transfer-Encoding" ) ){
+      error = "501 Not Implemented";
+      return -1;
+    }
+  }
+
+  // We ignore any request body, but must make sure we have received it
+  end += 4;
+  if( buffer.length() < end + contentLength ) return 0;
+  buffer.erase( 0, end + contentLength );
+
+  if( method != "GET" && method != "HEAD" ){
+    error = "405 Method Not Allowed";
+    return -1;
+  }
+
+  // Set our standard CGI parameters. Requests of the form /iiif/identifier/... are
+  // mapped onto the IIIF command in the same way as the usual web server rewrite rule
+  string query;
+  size_t q = uri.find( '?' );
+  if( q != string::npos ) query = uri.substr( q+1 );
+  else if( uri.compare( 0, 6, "/iiif/" ) == 0 ) query = "IIIF=" + uri.substr( 6 );
+
+  this->setParam( "QUERY_STRING", query );
+  this->setParam( "REQUEST_URI", uri );
+  this->setParam( "REQUEST_METHOD", method );
+  this->setParam( "SERVER_PROTOCOL", protocol );
+
+  return 1;
+}
+
+
+
+bool HTTPWriter::cancelled()
+{
+  if( abandoned ) return true;
+  if( socket < 0 ) return false;
+
+  // Without asking for any events, poll() only reports a reset or fully closed connection
+  struct pollfd p;
+  p.fd = socket;
+  p.events = 0;
+  p.revents = 0;
+  if( poll( &p, 1, 0 ) <= 0 ) return false;
+  return ( p.revents & (POLLHUP | POLLERR | POLLNVAL) ) != 0;
+}
+
+
+
+void HTTPWriter::prepare( const HTTPRequest& request )
+{
+  string status = "200 OK";
+  string headers;
+  bool length = false;
+  bool chunked = false;
+
+  // Find the end of our CGI header block
+  body = 0;
+  if( sz > 0 && buffer ){
+    string response( buffer, sz < HTTP_MAX_HEADER ? sz : HTTP_MAX_HEADER );
+    size_t last = response.find( "\r\n\r\n" );
+    if( last != string::npos ){
+      body = last + 4;
+      size_t pos = 0;
+      while( pos < last ){
+	size_t eol = response.find( "\r\n", pos );
+	string line = response.substr( pos, eol-pos );
+	pos = eol + 2;
+	if( isField( line, "Status" ) ) status = fieldValue( line );
+	else if( isField( line, "Connection" ) ) continue;
+	else{
+	  if( isField( line, "Content-Length" ) ) length = true;
+	  else if( isField( line, "Transfer-Encoding" ) ) chunked = true;
+	  headers += line + "\r\n";
+	}
+      }
+    }
+  }
+
+  // Responses with these status codes never have a body
+  int code = atoi( status.c_str() );
+  bool bodiless = ( code == 304 || code == 204 || ( code >= 100 && code < 200 ) );
+  end = ( request.method != "HEAD" && !bodiless ) ? sz : body;
+  spliceable = ( payload.data && request.method != "HEAD" && !bodiless && spliced >= body );
+
+  header = "HTTP/1.1 " + status + "\r\n" + headers;
+  if( !length && !chunked && !bodiless ){
+    char tmp[64];
+    size_t extra = ( payload.data && spliced >= body ) ? payload.dataLength : 0;
+    snprintf( tmp, 64, "Content-Length: %lu\r\n", (unsigned long)( sz - body + extra ) );
+    header += tmp;
+  }
+  header += request.keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+  header += "\r\n";
+
+  sent = 0;
+}
+
+
+
+int HTTPWriter::write( int fd )
+{
+  // Our response consists of our header and our buffered body, into which any tile
+  // sent directly from its shared data is spliced at the point at which it was written
+  size_t split = spliceable ? spliced : end;
+  struct iovec parts[4];
+  parts[0].iov_base = const_cast<char*>( header.data() );
+  parts[0].iov_len = header.length();
+  parts[1].iov_base = buffer + body;
+  parts[1].iov_len = split - body;
+  parts[2].iov_base = payload.data;
+  parts[2].iov_len = spliceable ? payload.dataLength : 0;
+  parts[3].iov_base = buffer + split;
+  parts[3].iov_len = end - split;
+
+  // Send everything not yet sent with a single call where possible
+  while( true ){
+
+    struct iovec iov[4];
+    int n = 0;
+    size_t skip = sent;
+    for( int i = 0; i < 4; i++ ){
+      if( skip >= parts[i].iov_len ){
+	skip -= parts[i].iov_len;
+	continue;
+      }
+      iov[n].iov_base = (char*) parts[i].iov_base + skip;
+      iov[n].iov_len = parts[i].iov_len - skip;
+      skip = 0;
+      n++;
+    }
+    if( n == 0 ) return 1;
+
+    struct msghdr msg;
+    memset( &msg, 0, sizeof(msg) );
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+
+    ssize_t len = sendmsg( fd, &msg, MSG_NOSIGNAL );
+    if( len < 0 ){
+      if( errno == EINTR ) continue;
+      if( errno == EAGAIN || errno == EWOULDBLOCK ) return 0;
+      return -1;
+    }
+    sent += len;
+  }
+}
+
+
+
+HTTPConnection::HTTPConnection( int s, int timeout )
+{
+  fd = s;
+  struct timeval tv;
+  tv.tv_sec = timeout;
+  tv.tv_usec = 0;
+  setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) );
+  setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv) );
+}
+
+
+
+HTTPConnection::~HTTPConnection()
+{
+  close( fd );
+}
+
+
+
+bool HTTPConnection::receive()
+{
+  char tmp[8192];
+  while( true ){
+    ssize_t n = recv( fd, tmp, sizeof(tmp), 0 );
+    if( n > 0 ){
+      buffer.append( tmp, n );
+      return true;
+    }
+    if( n < 0 && errno == EINTR ) continue;
+    // Connection closed, timed out or failed
+    return false;
+  }
+}
+
+
+
+bool HTTPConnection::next( HTTPRequest& request )
+{
+  string error;
+  while( true ){
+    int status = request.parse( buffer, error );
+    if( status == 1 ) return true;
+    if( status == -1 ){
+      this->sendError( error );
+      return false;
+    }
+    if( !this->receive() ) return false;
+  }
+}
+
+
+
+void HTTPConnection::sendError( const string& status )
+{
+  sendStatus( fd, status );
+}
+
+
+
+#ifdef HAVE_EPOLL
+
+
+/// State of a client connection handled by our event loop
+struct HTTPEventLoop::Connection {
+
+  /// Client socket
+  int fd;
+
+  /// Data received but not yet parsed and the request currently being parsed
+  string buffer;
+  HTTPRequest request;
+
+  /// Job being processed or sent, if any, and whether its response is ready to send
+  Job* job;
+  bool ready;
+
+  /// Whether the client has finished sending and whether we have closed the connection
+  bool eof;
+  bool closed;
+
+  /// Time of last activity
+  time_t active;
+
+};
+
+
+
+HTTPEventLoop::HTTPEventLoop( int socket, int t )
+{
+  listen_socket = socket;
+  timeout = t;
+  stopped = false;
+  stopping = 0;
+  listening = true;
+
+  epfd = epoll_create1( EPOLL_CLOEXEC );
+  if( epfd == -1 ) throw string( "HTTPEventLoop :: Unable to create epoll instance: " ) + strerror(errno);
+
+  wakeup = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  if( wakeup == -1 ){
+    ::close( epfd );
+    throw string( "HTTPEventLoop :: Unable to create eventfd: " ) + strerror(errno);
+  }
+
+  // Our listening socket is identified by a NULL pointer and our wakeup descriptor by its own address
+  int flags = fcntl( listen_socket, F_GETFL, 0 );
+  fcntl( listen_socket, F_SETFL, flags | O_NONBLOCK );
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = NULL;
+  int status = epoll_ctl( epfd, EPOLL_CTL_ADD, listen_socket, &ev );
+  if( status == 0 ){
+    ev.data.ptr = &wakeup;
+    status = epoll_ctl( epfd, EPOLL_CTL_ADD, wakeup, &ev );
+  }
+  if( status == -1 ){
+    ::close( wakeup );
+    ::close( epfd );
+    throw string( "HTTPEventLoop :: Unable to add descriptor to epoll: " ) + strerror(errno);
+  }
+}
+
+
+
+HTTPEventLoop::~HTTPEventLoop()
+{
+  // Gather all our jobs and connections, including closed connections whose jobs are still queued
+  std::set<Connection*> all( connections );
+  std::set<Job*> jobs;
+  std::set<Connection*>::iterator i;
+  for( i = connections.begin(); i != connections.end(); i++ ) if( (*i)->job ) jobs.insert( (*i)->job );
+  std::deque<Job*>::iterator j;
+  for( j = pending.begin(); j != pending.end(); j++ ) jobs.insert( *j );
+  for( j = done.begin(); j != done.end(); j++ ) jobs.insert( *j );
+
+  std::set<Job*>::iterator k;
+  for( k = jobs.begin(); k != jobs.end(); k++ ){
+    all.insert( (*k)->connection );
+    delete *k;
+  }
+  for( i = all.begin(); i != all.end(); i++ ){
+    if( !(*i)->closed ) ::close( (*i)->fd );
+    delete *i;
+  }
+  this->cleanup();
+
+  ::close( wakeup );
+  ::close( epfd );
+}
+
+
+
+void HTTPEventLoop::run()
+{
+  struct epoll_event events[256];
+  time_t last = time( NULL );
+
+  // Allow any signals to be delivered only while we are waiting
+  sigset_t signals;
+  sigemptyset( &signals );
+
+  while( !stopping || !connections.empty() ){
+
+    int n = epoll_pwait( epfd, events, 256, 1000, &signals );
+    if( n == -1 && errno != EINTR ) break;
+
+    // When asked to stop, stop accepting and close idle connections, after answering any
+    // request already sent to us. Connections with a request in progress are closed once
+    // their response has been sent
+    if( stopping && listening ){
+      epoll_ctl( epfd, EPOLL_CTL_DEL, listen_socket, NULL );
+      listening = false;
+      std::vector<Connection*> idle( connections.begin(), connections.end() );
+      for( unsigned int j = 0; j < idle.size(); j++ ){
+	if( !idle[j]->job ) this->read( idle[j] );
+	if( !idle[j]->job ) this->close( idle[j] );
+      }
+    }
+
+    bool completed = false;
+    for( int i = 0; i < n; i++ ){
+      void* ptr = events[i].data.ptr;
+      if( ptr == NULL ){
+	if( listening ) this->accept();
+      }
+      else if( ptr == &wakeup ) completed = true;
+      else{
+	Connection* c = static_cast<Connection*>( ptr );
+	if( c->closed ) continue;
+	// Only a reset or a connection closed in both directions means the client has given
+	// up on its request: a client may close its side once it has sent its requests
+	if( c->job && (events[i].events & (EPOLLHUP | EPOLLERR)) ) c->job->writer.abandoned = 1;
+	if( events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR) ) this->read( c );
+	if( !c->closed && c->ready && (events[i].events & EPOLLOUT) ) this->flush( c );
+      }
+    }
+
+    // Send any responses our workers have completed
+    if( completed ) this->collect();
+
+    // Check for idle connections once a second
+    time_t now = time( NULL );
+    if( now != last ){
+      this->expire();
+      last = now;
+    }
+
+    this->cleanup();
+  }
+
+  // Tell our workers to stop
+  ScopedLock l( lock );
+  stopped = true;
+  available.broadcast();
+}
+
+
+
+void HTTPEventLoop::accept()
+{
+  while( true ){
+
+    int fd = accept4( listen_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+    if( fd == -1 ){
+      if( errno == EINTR || errno == ECONNABORTED ) continue;
+      // No more waiting connections or we have run out of descriptors
+      return;
+    }
+
+    // Our responses are sent in a single write, so there is no need to wait for more data
+    int one = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+
+    Connection* c = new Connection;
+    c->fd = fd;
+    c->job = NULL;
+    c->ready = false;
+    c->eof = false;
+    c->closed = false;
+    c->active = time( NULL );
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if( epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &ev ) == -1 ){
+      ::close( fd );
+      delete c;
+      continue;
+    }
+
+    connections.insert( c );
+  }
+}
+
+
+
+void HTTPEventLoop::read( Connection* c )
+{
+  char tmp[8192];
+
+  // As we are edge-triggered, we must read until the socket would block. Stop reading
+  // if a client pipelines too much while a request is in progress: we read again once
+  // the response has been sent
+  while( !c->eof && c->buffer.length() < 4*HTTP_MAX_HEADER ){
+    ssize_t n = recv( c->fd, tmp, sizeof(tmp), 0 );
+    if( n > 0 ) c->buffer.append( tmp, n );
+    else if( n == 0 ) c->eof = true;
+    else if( errno == EINTR ) continue;
+    else if( errno == EAGAIN || errno == EWOULDBLOCK ) break;
+    else{
+      this->close( c );
+      return;
+    }
+  }
+
+  c->active = time( NULL );
+  this->dispatch( c );
+}
+
+
+
+void HTTPEventLoop::dispatch( Connection* c )
+{
+  // Only process one request at a time on each connection
+  if( c->closed || c->job ) return;
+
+  string error;
+  int status = c->request.parse( c->buffer, error );
+
+  if( status == 1 ){
+    Job* job = new Job;
+    job->connection = c;
+    job->request = c->request;
+    c->job = job;
+    c->ready = false;
+    ScopedLock l( lock );
+    pending.push_back( job );
+    available.signal();
+  }
+  else if( status == -1 ){
+    sendStatus( c->fd, error );
+    this->close( c );
+  }
+  // The client has closed its side of the connection and has no further complete requests
+  else if( c->eof ) this->close( c );
+}
+
+
+
+void HTTPEventLoop::flush( Connection* c )
+{
+  // As we are edge-triggered, we are only called again once the client has read some of
+  // our response, so our write deadline runs from our last attempt
+  c->active = time( NULL );
+
+  int status = c->job->writer.write( c->fd );
+
+  // Wait for the socket to become writable again
+  if( status == 0 ) return;
+
+  bool keepAlive = c->job->request.keepAlive;
+  delete c->job;
+  c->job = NULL;
+  c->ready = false;
+
+  if( status == -1 || !keepAlive || stopping ){
+    this->close( c );
+    return;
+  }
+
+  // Move on to any pipelined requests
+  c->active = time( NULL );
+  this->read( c );
+}
+
+
+
+void HTTPEventLoop::close( Connection* c )
+{
+  if( c->closed ) return;
+  ::close( c->fd );
+  c->fd = -1;
+  c->closed = true;
+  // A response being sent is no longer held by our workers, so is ours to delete
+  if( c->job && c->ready ){
+    delete c->job;
+    c->job = NULL;
+    c->ready = false;
+  }
+  if( c->job ) c->job->writer.abandoned = 1;
+  connections.erase( c );
+  if( !c->job ) finished.push_back( c );
+}
+
+
+
+void HTTPEventLoop::cleanup()
+{
+  for( unsigned int i = 0; i < finished.size(); i++ ) delete finished[i];
+  finished.clear();
+}
+
+
+
+void HTTPEventLoop::collect()
+{
+  uint64_t value;
+  while( ::read( wakeup, &value, sizeof(value) ) > 0 );
+
+  std::deque<Job*> jobs;
+  lock.lock();
+  jobs.swap( done );
+  lock.unlock();
+
+  while( !jobs.empty() ){
+    Job* job = jobs.front();
+    jobs.pop_front();
+    Connection* c = job->connection;
+    if( c->closed ){
+      // The connection was closed while its request was being processed
+      delete job;
+      c->job = NULL;
+      finished.push_back( c );
+    }
+    else{
+      c->ready = true;
+      this->flush( c );
+    }
+  }
+}
+
+
+
+void HTTPEventLoop::expire()
+{
+  time_t now = time( NULL );
+  std::vector<Connection*> idle;
+  std::set<Connection*>::iterator i;
+  for( i = connections.begin(); i != connections.end(); i++ ){
+    // Close both idle connections and those whose client has stopped reading its response
+    Connection* c = *i;
+    if( ( !c->job || c->ready ) && now - c->active >= timeout ) idle.push_back( c );
+  }
+  for( unsigned int j = 0; j < idle.size(); j++ ) this->close( idle[j] );
+}
+
+
+
+HTTPEventLoop::Job* HTTPEventLoop::next()
+{
+  ScopedLock l( lock );
+  while( pending.empty() && !stopped ) available.wait( lock );
+  if( stopped ) return NULL;
+  Job* job = pending.front();
+  pending.pop_front();
+  return job;
+}
+
+
+
+void HTTPEventLoop::complete( Job* job )
+{
+  // Format our response header here rather than in the event loop
+  if( stopping ) job->request.keepAlive = false;
+  job->writer.prepare( job->request );
+
+  lock.lock();
+  done.push_back( job );
+  lock.unlock();
+
+  // Wake up our event loop
+  uint64_t one = 1;
+  ::write( wakeup, &one, sizeof(one) );
+}
+
+
+#endif
@@ -0,0 +1,385 @@
+// Native HTTP/1.1 Server Classes
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _HTTPSERVER_H
+#define _HTTPSERVER_H
+
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include "Writer.h"
+
+#ifdef HAVE_EPOLL
+#include <set>
+#include <deque>
+#include "Mutex.h"
+#endif
+
+
+// Maximum size of a request header block and default persistent connection timeout in seconds
+#define HTTP_MAX_HEADER 16384
+#define HTTP_KEEPALIVE_TIMEOUT 5
+
+
+
+/// A single HTTP request
+/** Our request parameters are stored as a NULL terminated array of "NAME=value"
+    strings in the same way as FCGI, so that they can be read with FCGX_GetParam()
+ */
+class HTTPRequest {
+
+ private:
+
+  /// Parameter strings and the array of pointers into them
+  std::vector<std::string> params;
+  std::vector<char*> envp;
+
+
+ public:
+
+  /// Request method, target and protocol
+  std::string method;
+  std::string uri;
+  std::string protocol;
+
+  /// Whether the client wants to keep the connection open after this request
+  bool keepAlive;
+
+  /// Constructor
+  HTTPRequest() : keepAlive( false ) {};
+
+  /// Reset the request before re-use
+  void clear() {
+    params.clear();
+    envp.clear();
+    method.clear();
+    uri.clear();
+    protocol.clear();
+    keepAlive = false;
+  };
+
+  /// Add a parameter
+  /** @param name parameter name
+      @param value parameter value
+   */
+  void setParam( const std::string& name, const std::string& value ) {
+    params.push_back( name + "=" + value );
+  };
+
+  /// Return our parameters in FCGX_ParamArray format
+  char** getParams();
+
+  /// Parse a complete request from the start of a buffer
+  /** @param buffer received data. On success the request is removed from the buffer,
+             leaving any following pipelined requests
+      @param error set to an HTTP status if the request is malformed or unsupported
+      @return 1 if a request was parsed, 0 if more data is needed or -1 on error
+   */
+  int parse( std::string& buffer, std::string& error );
+
+};
+
+
+
+/// Writer which buffers a CGI style response and sends it as an HTTP/1.1 response
+/** Our tasks write their output with CGI style headers, including an optional Status
+    header. Once the request has been processed, we convert this into an HTTP status line,
+    add a Content-Length if none was given and send the complete response, either in a
+    single blocking write or in pieces on a non-blocking socket.
+ */
+class HTTPWriter : public Writer {
+
+ private:
+
+  static const unsigned int bufsize = 65536;
+
+  /// Allocated size of our buffer
+  size_t capacity;
+
+  /// Add the message to our buffer
+  void cpy2buf( const char* msg, size_t len ){
+    if( sz+len > capacity ){
+      capacity = 2*(sz+len);
+      buffer = (char*) realloc( buffer, capacity );
+    }
+    if( buffer ){
+      memcpy( &buffer[sz], msg, len );
+      sz += len;
+    }
+  };
+
+  /// HTTP response header, start and end of the body within our buffer and bytes sent so far
+  std::string header;
+  size_t body;
+  size_t end;
+  size_t sent;
+
+  /// Tile sent directly from its shared data, the point in our buffer at which it was
+  /// written and whether it is part of our response
+  RawTile payload;
+  size_t spliced;
+  bool spliceable;
+
+
+ public:
+
+  char* buffer;
+  size_t sz;
+
+  /// Client socket to check for disconnection or -1
+  int socket;
+
+  /// Set by our event loop if the client goes away while the request is being processed
+  volatile sig_atomic_t abandoned;
+
+  /// Constructor
+  HTTPWriter(){
+    capacity = bufsize;
+    buffer = (char*) malloc(capacity);
+    sz = body = end = sent = spliced = 0;
+    spliceable = false;
+    socket = -1;
+    abandoned = 0;
+  };
+
+  /// Destructor
+  ~HTTPWriter(){ if(buffer) free(buffer); };
+
+  int putStr( const char* msg, int len ){
+    cpy2buf( msg, len );
+    return len;
+  };
+  int putS( const char* msg ){
+    size_t len = strlen(msg);
+    cpy2buf( msg, len );
+    return len;
+  }
+  int printf( const char* msg ){
+    size_t len = strlen(msg);
+    cpy2buf( msg, len );
+    return len;
+  };
+  int flush(){
+    return 0;
+  };
+
+  /// Keep a reference to a tile with shared data rather than copying it into our buffer
+  /** Only a single tile per response is sent in this way */
+  int putTile( const RawTile& tile ){
+    if( !direct || !tile.buffer || payload.data ) return Writer::putTile( tile );
+    payload = tile;
+    spliced = sz;
+    return tile.dataLength;
+  };
+
+  /// As we only send once the request has been processed, the client has only gone away
+  /// if its connection has been reset or closed in both directions in the meantime. A
+  /// client may close its side once it has sent its requests and still read our responses
+  bool cancelled();
+
+  /// Convert the CGI headers at the start of our buffer into an HTTP response header
+  /** @param request the request we are responding to
+   */
+  void prepare( const HTTPRequest& request );
+
+  /// Write as much of our prepared response as the socket will accept
+  /** @param fd client socket
+      @return 1 once the whole response has been sent, 0 if the socket would block
+              or -1 if the client has gone away
+   */
+  int write( int fd );
+
+  /// Send our buffered response to the client
+  /** @param fd client socket
+      @param request the request we are responding to
+      @return true on success, false if the client has gone away
+   */
+  bool send( int fd, const HTTPRequest& request ){
+    this->prepare( request );
+    return ( this->write( fd ) == 1 );
+  };
+
+};
+
+
+
+/// A client connection, which may carry several persistent or pipelined requests
+class HTTPConnection {
+
+ private:
+
+  /// Client socket
+  int fd;
+
+  /// Data received but not yet parsed, which may contain further pipelined requests
+  std::string buffer;
+
+  /// Read more data from our client
+  bool receive();
+
+
+ public:
+
+  /// Constructor
+  /** @param s client socket, which will be closed on destruction
+      @param timeout idle timeout in seconds
+   */
+  HTTPConnection( int s, int timeout );
+
+  /// Destructor
+  ~HTTPConnection();
+
+  /// Get our socket
+  int getSocket() const { return fd; };
+
+  /// Read and parse the next request
+  /** Malformed or unsupported requests are answered with an error and the connection closed.
+      @param request request object to fill
+      @return false if the connection has been closed, timed out or is no longer usable
+   */
+  bool next( HTTPRequest& request );
+
+  /// Send a simple error response
+  /** @param status HTTP status code and reason phrase */
+  void sendError( const std::string& status );
+
+};
+
+
+
+#ifdef HAVE_EPOLL
+
+/// Event-driven HTTP front end
+/** A single thread runs an edge-triggered epoll loop over non-blocking sockets, which
+    accepts connections, reads and parses requests and writes responses back to clients.
+    Parsed requests are queued as jobs for a pool of worker threads, which process them
+    and hand back their buffered response. Workers therefore never wait on slow clients
+    and an idle persistent connection costs only a file descriptor. Requests pipelined
+    on a connection are processed one at a time so that responses are sent in order.
+ */
+class HTTPEventLoop {
+
+ public:
+
+  struct Connection;
+
+  /// A request waiting for or being processed by a worker
+  struct Job {
+    Connection* connection;
+    HTTPRequest request;
+    HTTPWriter writer;
+  };
+
+
+ private:
+
+  /// Listening socket, epoll instance, eventfd used to wake our loop and idle timeout
+  int listen_socket;
+  int epfd;
+  int wakeup;
+  int timeout;
+
+  /// All open connections and closed connections waiting to be deleted
+  std::set<Connection*> connections;
+  std::vector<Connection*> finished;
+
+  /// Jobs waiting for a worker and jobs completed by a worker
+  std::deque<Job*> pending;
+  std::deque<Job*> done;
+
+  /// Lock and condition protecting our job queues
+  Mutex lock;
+  Condition available;
+
+  /// Whether our loop has stopped
+  bool stopped;
+
+  /// Whether we have been asked to stop and whether we are still accepting connections
+  volatile sig_atomic_t stopping;
+  bool listening;
+
+  /// Accept all waiting connections
+  void accept();
+
+  /// Read available data from a connection and dispatch any complete request
+  void read( Connection* c );
+
+  /// Parse the next request on a connection and queue it for our workers
+  void dispatch( Connection* c );
+
+  /// Write as much of a completed response as the client will accept
+  void flush( Connection* c );
+
+  /// Close a connection, which is deleted once any job it has in progress is complete
+  void close( Connection* c );
+
+  /// Delete closed connections
+  void cleanup();
+
+  /// Collect the jobs completed by our workers
+  void collect();
+
+  /// Close idle connections and those whose response has not been read within our timeout
+  void expire();
+
+  /// Disallow copying
+  HTTPEventLoop( const HTTPEventLoop& );
+  HTTPEventLoop& operator = ( const HTTPEventLoop& );
+
+
+ public:
+
+  /// Constructor
+  /** @param socket listening socket, which is made non-blocking
+      @param timeout idle timeout for persistent connections and write timeout for
+      responses in seconds
+   */
+  HTTPEventLoop( int socket, int timeout );
+
+  /// Destructor
+  ~HTTPEventLoop();
+
+  /// Run our event loop until stopped or a fatal error occurs
+  /** Signals are only delivered to this thread while it is waiting for events */
+  void run();
+
+  /// Stop accepting connections and return from run() once all requests in progress
+  /// have been answered. This is safe to call from a signal handler
+  void stop(){ stopping = 1; };
+
+  /// Wait for the next job to process
+  /** @return job or NULL once the loop has stopped */
+  Job* next();
+
+  /// Hand back a job whose response is ready to send
+  /** @param job the job, which should not be used further by the caller */
+  void complete( Job* job );
+
+};
+
+#endif
+
+
+#endif
@@ -22,6 +22,8 @@
 #include <algorithm>
 #include <cmath>
 #include <cstdlib>
+#include <cstdio>
+#include <vector>
 #include <sstream>
 #include "Task.h"
 #include "Tokenizer.h"
@@ -579,3 +581,40 @@ void IIIF::run( Session* session, const string& src )
   }
 
 }
+
+
+
+bool IIIF::bulk( const string& src )
+{
+  URL url( src );
+  string argument = url.decode();
+
+  // Info requests are cheap and all others have at least identifier/region/size/rotation/quality
+  vector<string> parts;
+  Tokenizer izer( argument, "/" );
+  while( izer.hasMoreTokens() ) parts.push_back( izer.nextToken() );
+  if( parts.size() < 5 || parts.back().substr( 0, 4 ) == "info" ) return false;
+
+  string region = parts[parts.size()-4];
+  string size = parts[parts.size()-3];
+
+  // Full size output is only cheap if the region itself is small
+  if( size == "full" || size == "max" ){
+    unsigned int x, y, w, h;
+    if( sscanf( region.c_str(), "%u,%u,%u,%u", &x, &y, &w, &h ) == 4 ){
+      return ( w > INTERACTIVE_MAX_SIZE || h > INTERACTIVE_MAX_SIZE );
+    }
+    return true;
+  }
+
+  // We don't know the image size here, so treat scaled output as expensive
+  if( size.substr( 0, 4 ) == "pct:" ) return true;
+
+  // Otherwise check the requested w,h, w, or ,h size
+  if( size.substr( 0, 1 ) == "!" ) size.erase( 0, 1 );
+  size_t comma = size.find( "," );
+  if( comma == string::npos ) return true;
+  unsigned int w = atoi( size.substr( 0, comma ).c_str() );
+  unsigned int h = atoi( size.substr( comma + 1 ).c_str() );
+  return ( w > INTERACTIVE_MAX_SIZE || h > INTERACTIVE_MAX_SIZE );
+}
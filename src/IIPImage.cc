@@ -22,6 +22,7 @@
 
 
 #include "IIPImage.h"
+#include "Memory.h"
 
 #ifdef HAVE_GLOB_H
 #include <glob.h>
@@ -51,6 +52,7 @@ void IIPImage::swap( IIPImage& first, IIPImage& second ) // nothrow
   std::swap( first.suffix, second.suffix );
   std::swap( first.virtual_levels, second.virtual_levels );
   std::swap( first.format, second.format );
+  std::swap( first.directory_offsets, second.directory_offsets );
   std::swap( first.fileSystemPrefix, second.fileSystemPrefix );
   std::swap( first.fileNamePattern, second.fileNamePattern );
   std::swap( first.horizontalAnglesList, second.horizontalAnglesList );
@@ -77,6 +79,30 @@ void IIPImage::swap( IIPImage& first, IIPImage& second ) // nothrow
 
 
 
+unsigned long IIPImage::getMemorySize() const
+{
+  unsigned long size = heapSize( imagePath ) + heapSize( fileSystemPrefix ) + heapSize( fileNamePattern ) + heapSize( suffix );
+
+  // List nodes hold an int and two pointers
+  size += ( horizontalAnglesList.size() + verticalAnglesList.size() ) * heapSize( sizeof(int) + 2*sizeof(void*) );
+
+  if( lut.capacity() ) size += heapSize( lut.capacity() * sizeof(int) );
+  if( image_widths.capacity() ) size += heapSize( image_widths.capacity() * sizeof(unsigned int) );
+  if( image_heights.capacity() ) size += heapSize( image_heights.capacity() * sizeof(unsigned int) );
+  if( directory_offsets.capacity() ) size += heapSize( directory_offsets.capacity() * sizeof(uint64_t) );
+  if( min.capacity() ) size += heapSize( min.capacity() * sizeof(float) );
+  if( max.capacity() ) size += heapSize( max.capacity() * sizeof(float) );
+
+  // Map nodes hold a colour, three pointers and our pair of strings
+  for( map<const string,string>::const_iterator i = metadata.begin(); i != metadata.end(); ++i ){
+    size += heapSize( 4*sizeof(void*) + 2*sizeof(string) ) + heapSize( i->first ) + heapSize( i->second );
+  }
+
+  return size;
+}
+
+
+
 void IIPImage::testImageType() throw(file_error)
 {
   // Check whether it is a regular file
@@ -194,11 +220,16 @@ void IIPImage::updateTimestamp( const string& path ) throw(file_error)
 
 const std::string IIPImage::getTimestamp()
 {
-  tm *t;
+  // Use the re-entrant version of gmtime as we may be called from several threads
+  tm t;
   const time_t tm1 = timestamp;
-  t = gmtime( &tm1 );
+#ifdef WIN32
+  gmtime_s( &t, &tm1 );
+#else
+  gmtime_r( &tm1, &t );
+#endif
   char strt[64];
-  strftime( strt, 64, "%a, %d %b %Y %H:%M:%S GMT", t );
+  strftime( strt, 64, "%a, %d %b %Y %H:%M:%S GMT", &t );
 
   return string(strt);
 }
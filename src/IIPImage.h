@@ -35,6 +35,7 @@
 #include <vector>
 #include <map>
 #include <stdexcept>
+#include <stdint.h>
 
 #include "RawTile.h"
 
@@ -60,6 +61,9 @@ enum ImageFormat { TIF, JPEG2000, UNSUPPORTED };
 
 class IIPImage {
 
+  /// Allow our cache snapshots to save and restore our metadata
+  friend class CacheSnapshot;
+
  private:
 
   /// Image path supplied
@@ -104,6 +108,10 @@ class IIPImage {
   /// Return the image format e.g. tif
   ImageFormat format;
 
+  /// File offsets of the directory holding each resolution, largest first, for formats with directories
+  /** Held with our metadata, so that a newly opened image can move straight to any resolution */
+  std::vector <uint64_t> directory_offsets;
+
 
  public:
 
@@ -202,6 +210,7 @@ class IIPImage {
     lut( image.lut ),
     virtual_levels( image.virtual_levels ),
     format( image.format ),
+    directory_offsets( image.directory_offsets ),
     image_widths( image.image_widths ),
     image_heights( image.image_heights ),
     tile_width( image.tile_width ),
@@ -262,6 +271,15 @@ class IIPImage {
   /// Check whether this object has been initialised
   bool set() { return isSet; };
 
+  /// Return the heap memory used by this object, for example when held in our image cache
+  unsigned long getMemorySize() const;
+
+  /// Undo any changes made by a request to our metadata, such as the sample range set by MINMAX
+  /** Used when an open image is reused by another request
+      @param image the image's unmodified metadata
+   */
+  void restore( const IIPImage& image ) { min = image.min; max = image.max; };
+
   /// Set a file system prefix for added security
   void setFileSystemPrefix( const std::string& prefix ) { fileSystemPrefix = prefix; };
 
@@ -327,6 +345,13 @@ class IIPImage {
   /// Return codec description: Overloaded by child class.
   virtual const std::string getDescription() { return std::string( "IIPImage Base Class" ); };
 
+  /// Return a new image object of our own type with a copy of our metadata
+  /** The copy is not opened. Allows an image to be decoded by several threads at once,
+      each with its own copy: Overloaded by child class.
+      @return new image object or NULL if not supported
+   */
+  virtual IIPImage* duplicate() const { return NULL; };
+
   /// Open the image: Overloaded by child class.
   virtual void openImage() { throw file_error( "IIPImage openImage called" ); };
 
@@ -351,6 +376,31 @@ class IIPImage {
   virtual RawTile getTile( int h, int v, unsigned int r, int l, unsigned int t ) { return RawTile(); };
 
 
+  /// Return an individual tile as it is stored, if that is already a complete JPEG image
+  /** Allows such tiles to be sent without decoding and re-encoding them: Overloaded by child class.
+      @param h horizontal angle
+      @param v vertical angle
+      @param r resolution
+      @param t tile number
+      @return JPEG compressed RawTile or an empty RawTile with no data if the tile must be decoded
+   */
+  virtual RawTile getJPEGTile( int h, int v, unsigned int r, unsigned int t ) { return RawTile(); };
+
+
+  /// Hint that the tiles of a region will shortly be read
+  /** Allows them to be read ahead from disk: Overloaded by child class.
+      @param h horizontal angle
+      @param v vertical angle
+      @param r resolution
+      @param startx first tile column
+      @param starty first tile row
+      @param endx tile column following the last
+      @param endy tile row following the last
+   */
+  virtual void prefetch( int h, int v, unsigned int r, unsigned int startx, unsigned int starty,
+			 unsigned int endx, unsigned int endy ) {;};
+
+
   /// Return a region for a given angle and resolution
   /** Return a RawTile object: Overloaded by child class.
       @param ha horizontal angle
@@ -0,0 +1,165 @@
+// Image Metadata Cache Member Functions
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "ImageCache.h"
+#include "Memory.h"
+
+
+using namespace std;
+
+
+
+ImageCache::ImageCache( unsigned long max ) :
+  maxEntries( max ), memorySize( 0 ), hits( 0 ), misses( 0 ), negativeHits( 0 )
+{
+  if( maxEntries < 1 ) maxEntries = 1;
+}
+
+
+
+unsigned long ImageCache::entrySize( const string& key, const ImageDescriptor& d )
+{
+  // Our list node holding the key and reference, our index node, its bucket and the descriptor
+  return heapSize( sizeof( pair<string,ImageRef> ) + 2*sizeof(void*) ) +
+    heapSize( sizeof( pair<const string,List_Iter> ) + 2*sizeof(void*) ) + sizeof(void*) +
+    2 * heapSize( key ) + heapSize( sizeof(ImageDescriptor) ) +
+    heapSize( d.error ) + d.image.getMemorySize();
+}
+
+
+
+void ImageCache::_erase( List_Iter i )
+{
+  memorySize -= entrySize( i->first, *(i->second) );
+  imgMap.erase( i->first );
+  imgList.erase( i );
+}
+
+
+
+void ImageCache::_insert( const string& key, ImageDescriptor* d )
+{
+  ImageRef ref( d );
+
+  HASHMAP < string, List_Iter >::iterator i = imgMap.find( key );
+  if( i != imgMap.end() ) this->_erase( i->second );
+
+  // Make room by evicting our least recently used entries
+  while( imgMap.size() >= maxEntries && !imgList.empty() ){
+    this->_erase( --imgList.end() );
+  }
+
+  imgList.push_front( make_pair( key, ref ) );
+  imgMap[key] = imgList.begin();
+  memorySize += entrySize( key, *ref );
+}
+
+
+
+ImageRef ImageCache::get( const string& key )
+{
+  ScopedLock l( lock );
+
+  HASHMAP < string, List_Iter >::iterator i = imgMap.find( key );
+  if( i == imgMap.end() ){
+    misses++;
+    return ImageRef();
+  }
+
+  List_Iter entry = i->second;
+
+  // Forget missing images once they have expired, so that we check for them again
+  if( entry->second->missing() ){
+    if( time(NULL) - entry->second->created >= NEGATIVE_CACHE_TTL ){
+      this->_erase( entry );
+      misses++;
+      return ImageRef();
+    }
+    negativeHits++;
+  }
+  else hits++;
+
+  // Move to the head of our list
+  imgList.splice( imgList.begin(), imgList, entry );
+  return entry->second;
+}
+
+
+
+void ImageCache::insert( const string& key, const IIPImage& image )
+{
+  // Copy the metadata before taking our lock
+  ImageDescriptor* d = new ImageDescriptor( image );
+  ScopedLock l( lock );
+  this->_insert( key, d );
+}
+
+
+
+void ImageCache::insertMissing( const string& key, const string& error )
+{
+  ImageDescriptor* d = new ImageDescriptor( error );
+  ScopedLock l( lock );
+  this->_insert( key, d );
+}
+
+
+
+void ImageCache::erase( const string& key )
+{
+  ScopedLock l( lock );
+  HASHMAP < string, List_Iter >::iterator i = imgMap.find( key );
+  if( i != imgMap.end() ) this->_erase( i->second );
+}
+
+
+
+void ImageCache::clear()
+{
+  ScopedLock l( lock );
+  imgMap.clear();
+  imgList.clear();
+  memorySize = 0;
+}
+
+
+
+unsigned long ImageCache::trim( unsigned long bytes )
+{
+  ScopedLock l( lock );
+  unsigned long size = memorySize;
+  while( size - memorySize < bytes && !imgList.empty() ){
+    this->_erase( --imgList.end() );
+  }
+  return size - memorySize;
+}
+
+
+
+void ImageCache::getImages( vector < pair<string,ImageRef> >& images )
+{
+  ScopedLock l( lock );
+  images.reserve( imgList.size() );
+  for( List_Iter i = imgList.begin(); i != imgList.end(); ++i ){
+    if( !i->second->missing() ) images.push_back( *i );
+  }
+}
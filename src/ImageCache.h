@@ -0,0 +1,247 @@
+// Image Metadata Cache
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _IMAGECACHE_H
+#define _IMAGECACHE_H
+
+
+#include <ctime>
+#include <list>
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "IIPImage.h"
+#include "Cache.h"
+#include "Mutex.h"
+
+
+// Number of seconds for which we remember that an image does not exist
+#define NEGATIVE_CACHE_TTL 10
+
+
+
+/// Immutable, reference counted image metadata
+/** Held by our image metadata cache and by any requests that have looked it up, so
+    that a cache hit only takes another reference. Images that do not exist are also
+    described, by the error raised when they were opened.
+ */
+class ImageDescriptor {
+
+ private:
+
+  volatile long references;
+
+  ~ImageDescriptor() {};
+
+  /// Disallow copying
+  ImageDescriptor( const ImageDescriptor& );
+  ImageDescriptor& operator = ( const ImageDescriptor& );
+
+
+ public:
+
+  /// The image metadata, which is empty for an image which does not exist
+  const IIPImage image;
+
+  /// The error raised when opening an image which does not exist
+  const std::string error;
+
+  /// Time at which we were created
+  const time_t created;
+
+  /// Constructor for an existing image
+  ImageDescriptor( const IIPImage& i ) : references( 1 ), image( i ), created( time(NULL) ) {};
+
+  /// Constructor for an image which does not exist
+  ImageDescriptor( const std::string& e ) : references( 1 ), error( e ), created( time(NULL) ) {};
+
+  /// Whether this describes an image which does not exist
+  bool missing() const { return !error.empty(); };
+
+  /// Take a reference
+  void retain() {
+#ifdef _MSC_VER
+    _InterlockedIncrement( &references );
+#else
+    __sync_add_and_fetch( &references, 1 );
+#endif
+  };
+
+  /// Release a reference, deleting ourselves once the last has gone
+  void release() {
+#ifdef _MSC_VER
+    if( _InterlockedDecrement( &references ) == 0 ) delete this;
+#else
+    if( __sync_sub_and_fetch( &references, 1 ) == 0 ) delete this;
+#endif
+  };
+
+};
+
+
+
+/// Reference to a shared ImageDescriptor, which is released when we go out of scope
+class ImageRef {
+
+ private:
+
+  ImageDescriptor* descriptor;
+
+
+ public:
+
+  /// Constructor: takes over a reference already held on d
+  explicit ImageRef( ImageDescriptor* d = NULL ) : descriptor( d ) {};
+
+  /// Copy constructor
+  ImageRef( const ImageRef& r ) : descriptor( r.descriptor ) {
+    if( descriptor ) descriptor->retain();
+  };
+
+  /// Destructor
+  ~ImageRef() { if( descriptor ) descriptor->release(); };
+
+  /// Assignment operator
+  ImageRef& operator = ( const ImageRef& r ) {
+    if( r.descriptor ) r.descriptor->retain();
+    if( descriptor ) descriptor->release();
+    descriptor = r.descriptor;
+    return *this;
+  };
+
+  const ImageDescriptor* operator -> () const { return descriptor; };
+  const ImageDescriptor& operator * () const { return *descriptor; };
+
+  /// Whether we refer to a descriptor
+  bool valid() const { return descriptor != NULL; };
+
+};
+
+
+
+/// Size-bounded least recently used cache of image metadata
+/** Maps the image paths given in our requests to shared, immutable descriptors of the
+    image metadata, so that images need only be opened and their metadata read once.
+    Lookups and insertions move an entry to the head of our list and, once we hold our
+    maximum number of entries, the entry at the tail, which has gone unused for longest,
+    is evicted. Images which do not exist are also remembered for NEGATIVE_CACHE_TTL
+    seconds, so that repeated requests for a missing image do not each have to search
+    the file system. All functions are thread safe.
+ */
+class ImageCache {
+
+ private:
+
+  typedef std::list < std::pair<std::string,ImageRef> > List;
+  typedef List::iterator List_Iter;
+
+  /// Our entries, most recently used first
+  List imgList;
+
+  /// Index of our entries
+  HASHMAP < std::string, List_Iter > imgMap;
+
+  /// Maximum number of entries
+  unsigned long maxEntries;
+
+  /// Heap memory used by our entries in bytes
+  unsigned long memorySize;
+
+  /// Our counters
+  unsigned long hits, misses, negativeHits;
+
+  /// Lock protecting our state
+  Mutex lock;
+
+  /// Heap memory used by an entry
+  static unsigned long entrySize( const std::string& key, const ImageDescriptor& d );
+
+  /// Remove an entry
+  void _erase( List_Iter i );
+
+  /// Add an entry at the head of our list, replacing any existing entry
+  void _insert( const std::string& key, ImageDescriptor* d );
+
+  /// Disallow copying
+  ImageCache( const ImageCache& );
+  ImageCache& operator = ( const ImageCache& );
+
+
+ public:
+
+  /// Constructor
+  /** @param max maximum number of entries */
+  ImageCache( unsigned long max );
+
+  /// Look up an image
+  /** @param key image path as given in our request
+      @return a reference to the descriptor, which is not valid on a miss. Descriptors
+      of missing images are only returned for NEGATIVE_CACHE_TTL seconds
+   */
+  ImageRef get( const std::string& key );
+
+  /// Add or replace the metadata of an image
+  /** @param key image path as given in our request
+      @param image image metadata, which is copied
+   */
+  void insert( const std::string& key, const IIPImage& image );
+
+  /// Remember that an image does not exist
+  /** @param key image path as given in our request
+      @param error error raised when opening the image
+   */
+  void insertMissing( const std::string& key, const std::string& error );
+
+  /// Remove an image
+  void erase( const std::string& key );
+
+  /// Remove all entries
+  void clear();
+
+  /// Evict our least recently used entries
+  /** @param bytes number of bytes to free
+      @return number of bytes freed
+   */
+  unsigned long trim( unsigned long bytes );
+
+  /// Return our existing images, most recently used first
+  void getImages( std::vector < std::pair<std::string,ImageRef> >& images );
+
+  /// Return the number of entries
+  unsigned long size() { ScopedLock l( lock ); return imgMap.size(); };
+
+  /// Return the maximum number of entries
+  unsigned long getMaxEntries() const { return maxEntries; };
+
+  /// Return the heap memory used by our entries in bytes
+  unsigned long getMemorySize() { ScopedLock l( lock ); return memorySize; };
+
+  /// Return our counters
+  unsigned long getHits() { ScopedLock l( lock ); return hits; };
+  unsigned long getMisses() { ScopedLock l( lock ); return misses; };
+  unsigned long getNegativeHits() { ScopedLock l( lock ); return negativeHits; };
+
+};
+
+
+#endif
@@ -0,0 +1,248 @@
+// Pool of Open Image Handles Member Functions
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "ImagePool.h"
+#include "FileWatcher.h"
+#include "Memory.h"
+
+#include <cstdio>
+#include <sys/stat.h>
+
+
+using namespace std;
+
+
+
+ImagePool::ImagePool( unsigned int max, unsigned int t ) :
+  maxHandles( max ), ttl( t ), watcher( NULL ), memorySize( 0 ), hits( 0 ), misses( 0 ), stale( 0 )
+{
+}
+
+
+
+ImagePool::~ImagePool()
+{
+  for( List_Iter i = handleList.begin(); i != handleList.end(); ++i ) delete i->image;
+}
+
+
+
+string ImagePool::key( const string& path, int x, int y )
+{
+  char position[32];
+  snprintf( position, 32, "|%d,%d", x, y );
+  return path + position;
+}
+
+
+
+unsigned long ImagePool::handleSize( IIPImage& image )
+{
+  // Our decoders keep a buffer of one raw tile in addition to the image metadata
+  return heapSize( sizeof(IIPImage) ) + image.getMemorySize() +
+    heapSize( (size_t) image.getTileWidth() * image.getTileHeight() *
+	      image.getNumChannels() * ( ( image.getNumBitsPerPixel() + 7 ) / 8 ) );
+}
+
+
+
+IIPImage* ImagePool::_remove( List_Iter i )
+{
+  HASHMAP < string, list<List_Iter> >::iterator k = handleMap.find( i->key );
+  if( k != handleMap.end() ){
+    k->second.remove( i );
+    if( k->second.empty() ) handleMap.erase( k );
+  }
+  IIPImage* image = i->image;
+  memorySize -= i->size;
+  handleList.erase( i );
+  return image;
+}
+
+
+
+IIPImage* ImagePool::checkout( const string& path, int x, int y, const IIPImage* metadata )
+{
+  IIPImage* image = NULL;
+  State state;
+  {
+    ScopedLock l( lock );
+    HASHMAP < string, list<List_Iter> >::iterator k = handleMap.find( key( path, x, y ) );
+    if( k == handleMap.end() ){
+      misses++;
+      return NULL;
+    }
+    // Take the most recently returned handle, whose file data is most likely to be cached
+    state = k->second.front()->state;
+    image = this->_remove( k->second.front() );
+  }
+
+  // Revalidate outside of our lock, as the handle is ours alone now, unless changes to
+  // its file would have been reported by our watcher or it was validated recently enough
+  time_t now = time( NULL );
+  if( !state.watched && ( ttl == 0 || now - state.validated >= (time_t) ttl ) ){
+    struct stat sb;
+    string filename = image->getFileName( image->currentX, image->currentY );
+    if( stat( filename.c_str(), &sb ) != 0 || sb.st_mtime != image->timestamp ){
+      delete image;
+      ScopedLock l( lock );
+      stale++;
+      return NULL;
+    }
+    state.validated = now;
+  }
+
+  // Our handle still carries any changes made by the request that last used it
+  if( metadata ) image->restore( *metadata );
+
+  ScopedLock l( lock );
+  hits++;
+  inUse[image] = state;
+  return image;
+}
+
+
+
+void ImagePool::track( IIPImage* image )
+{
+  if( !image ) return;
+
+  State state;
+  state.path = image->getImagePath();
+  state.validated = time( NULL );
+  state.stale = false;
+
+  // Start watching the directory of our file before it is opened, so that no change is missed
+  FileWatcher* w = this->getWatcher();
+  state.watched = w && w->watch( image->getFileName( image->currentX, image->currentY ) );
+
+  ScopedLock l( lock );
+  inUse[image] = state;
+}
+
+
+
+void ImagePool::checkin( IIPImage* image )
+{
+  if( !image ) return;
+
+  Handle handle;
+  handle.state.path = image->getImagePath();
+  handle.state.validated = time( NULL );
+  handle.state.watched = false;
+  handle.state.stale = false;
+  {
+    ScopedLock l( lock );
+    map < IIPImage*, State >::iterator i = inUse.find( image );
+    if( i != inUse.end() ){
+      handle.state = i->second;
+      inUse.erase( i );
+    }
+  }
+
+  if( maxHandles == 0 || !image->set() || handle.state.stale ){
+    delete image;
+    return;
+  }
+
+  handle.key = key( handle.state.path, image->currentX, image->currentY );
+  handle.image = image;
+  handle.size = handleSize( *image );
+
+  // Close our least recently returned handles outside of our lock
+  list<IIPImage*> evicted;
+  {
+    ScopedLock l( lock );
+    while( handleList.size() >= maxHandles ){
+      evicted.push_back( this->_remove( --handleList.end() ) );
+    }
+    handleList.push_front( handle );
+    handleMap[handle.key].push_front( handleList.begin() );
+    memorySize += handle.size;
+  }
+
+  for( list<IIPImage*>::iterator i = evicted.begin(); i != evicted.end(); ++i ) delete *i;
+}
+
+
+
+unsigned long ImagePool::trim( unsigned long bytes )
+{
+  list<IIPImage*> evicted;
+  unsigned long freed = 0;
+  {
+    ScopedLock l( lock );
+    unsigned long size = memorySize;
+    while( size - memorySize < bytes && !handleList.empty() ){
+      evicted.push_back( this->_remove( --handleList.end() ) );
+    }
+    freed = size - memorySize;
+  }
+
+  for( list<IIPImage*>::iterator i = evicted.begin(); i != evicted.end(); ++i ) delete *i;
+  return freed;
+}
+
+
+
+void ImagePool::discard( IIPImage* image )
+{
+  if( !image ) return;
+  {
+    ScopedLock l( lock );
+    inUse.erase( image );
+  }
+  delete image;
+}
+
+
+
+void ImagePool::invalidate( const string& path )
+{
+  list<IIPImage*> evicted;
+  {
+    ScopedLock l( lock );
+    for( List_Iter i = handleList.begin(); i != handleList.end(); ){
+      List_Iter j = i++;
+      if( j->state.path == path ) evicted.push_back( this->_remove( j ) );
+    }
+    for( map < IIPImage*, State >::iterator i = inUse.begin(); i != inUse.end(); ++i ){
+      if( i->second.path == path ) i->second.stale = true;
+    }
+  }
+
+  for( list<IIPImage*>::iterator i = evicted.begin(); i != evicted.end(); ++i ) delete *i;
+}
+
+
+
+void ImagePool::flush()
+{
+  list<IIPImage*> evicted;
+  {
+    ScopedLock l( lock );
+    while( !handleList.empty() ) evicted.push_back( this->_remove( handleList.begin() ) );
+    for( map < IIPImage*, State >::iterator i = inUse.begin(); i != inUse.end(); ++i ) i->second.stale = true;
+  }
+
+  for( list<IIPImage*>::iterator i = evicted.begin(); i != evicted.end(); ++i ) delete *i;
+}
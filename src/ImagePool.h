@@ -0,0 +1,191 @@
+// Pool of Open Image Handles
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _IMAGEPOOL_H
+#define _IMAGEPOOL_H
+
+
+#include <ctime>
+#include <list>
+#include <map>
+#include <string>
+
+#include "IIPImage.h"
+#include "Cache.h"
+#include "Mutex.h"
+
+
+class FileWatcher;
+
+
+
+/// Size-bounded least recently used pool of open image handles
+/** Opening an image, which for TIFF means opening the file and parsing its directory, is
+    far more expensive than decoding a cached tile. Rather than deleting the image object
+    used by a request, it is returned to this pool still open, keyed by its image path and
+    current position within any image sequence, and checked out again by the next request
+    for the same image. A handle is only ever used by one request at a time, so several
+    idle handles may be held for a popular image. Handles are revalidated against the
+    modification time of their file when checked out and closed if the file has changed.
+    Revalidation is skipped for handles whose directory is watched by a FileWatcher,
+    which invalidates them when their file changes, and otherwise for handles validated
+    less than our revalidation TTL ago. Once we hold our maximum number of handles, the
+    least recently returned is closed. All functions are thread safe.
+ */
+class ImagePool {
+
+ private:
+
+  /// Validity of a handle
+  struct State {
+    std::string path;     // Image path as given in our request
+    time_t validated;     // When the handle was last opened or checked against its file
+    bool watched;         // Whether its directory was being watched before it was opened
+    bool stale;           // Whether its file has changed while it was in use
+  };
+
+  /// An idle handle and its key
+  struct Handle {
+    std::string key;
+    IIPImage* image;
+    unsigned long size;
+    State state;
+  };
+
+  typedef std::list <Handle> List;
+  typedef List::iterator List_Iter;
+
+  /// Our idle handles, most recently returned first
+  List handleList;
+
+  /// Index of our idle handles by key. Each key may have several handles
+  HASHMAP < std::string, std::list<List_Iter> > handleMap;
+
+  /// Handles checked out to a request
+  std::map < IIPImage*, State > inUse;
+
+  /// Maximum number of idle handles
+  unsigned int maxHandles;
+
+  /// Number of seconds for which an unwatched handle is trusted without checking its file
+  unsigned int ttl;
+
+  /// Optional watcher of our image files
+  FileWatcher* watcher;
+
+  /// Estimated heap memory used by our idle handles in bytes
+  unsigned long memorySize;
+
+  /// Our counters
+  unsigned long hits, misses, stale;
+
+  /// Lock protecting our state
+  Mutex lock;
+
+  /// Build our key from an image path and sequence position
+  static std::string key( const std::string& path, int x, int y );
+
+  /// Estimate the heap memory held by an open handle
+  static unsigned long handleSize( IIPImage& image );
+
+  /// Remove a handle from our pool, returning the image, which must then be deleted
+  IIPImage* _remove( List_Iter i );
+
+  /// Disallow copying
+  ImagePool( const ImagePool& );
+  ImagePool& operator = ( const ImagePool& );
+
+
+ public:
+
+  /// Constructor
+  /** @param max maximum number of idle handles
+      @param ttl number of seconds for which an unwatched handle is trusted without
+      checking its file: 0 checks on every checkout
+   */
+  ImagePool( unsigned int max, unsigned int ttl = 0 );
+
+  /// Destructor: closes all of our handles
+  ~ImagePool();
+
+  /// Take an open handle for an image
+  /** @param path image path as given in our request
+      @param x horizontal sequence position
+      @param y vertical sequence position
+      @param metadata optional metadata of our image, from which any changes made to the
+      handle by the request that last used it are undone
+      @return an open image, which is now owned by the caller, or NULL if we have none
+      or its file has been modified
+   */
+  IIPImage* checkout( const std::string& path, int x, int y, const IIPImage* metadata = NULL );
+
+  /// Register a new handle before it is opened
+  /** So that any change to its file while it is in use is noticed when it is returned
+      @param image new image
+   */
+  void track( IIPImage* image );
+
+  /// Return a handle once a request has finished with it
+  /** Handles which are not open are simply deleted
+      @param image open image, whose ownership passes to the pool
+   */
+  void checkin( IIPImage* image );
+
+  /// Close a handle which must not be reused, such as after an error
+  void discard( IIPImage* image );
+
+  /// Close our least recently used handles
+  /** @param bytes number of bytes to free
+      @return estimated number of bytes freed
+   */
+  unsigned long trim( unsigned long bytes );
+
+  /// Close the handles of an image whose file has changed
+  /** Handles in use are closed when they are returned
+      @param path image path as given in our request
+   */
+  void invalidate( const std::string& path );
+
+  /// Close all of our handles
+  void flush();
+
+  /// Set the watcher of our image files or NULL to remove it
+  void setWatcher( FileWatcher* w ) { ScopedLock l( lock ); watcher = w; };
+
+  /// Return the watcher of our image files
+  FileWatcher* getWatcher() { ScopedLock l( lock ); return watcher; };
+
+  /// Return the number of idle handles
+  unsigned int size() { ScopedLock l( lock ); return handleList.size(); };
+
+  /// Return the estimated heap memory used by our idle handles in bytes
+  unsigned long getMemorySize() { ScopedLock l( lock ); return memorySize; };
+
+  /// Return our counters
+  unsigned long getHits() { ScopedLock l( lock ); return hits; };
+  unsigned long getMisses() { ScopedLock l( lock ); return misses; };
+  unsigned long getStale() { ScopedLock l( lock ); return stale; };
+
+};
+
+
+#endif
@@ -0,0 +1,98 @@
+// Tests of our Pool of Open Image Handles
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "ImagePool.h"
+
+#include <iostream>
+
+
+using namespace std;
+
+
+static int failures = 0;
+
+
+static void check( bool condition, const string& test )
+{
+  if( !condition ){
+    cerr << "FAIL: " << test << endl;
+    failures++;
+  }
+}
+
+
+
+/// Open a handle for an image as FIF does on a cache miss
+static IIPImage* open( ImagePool& pool, const IIPImage& metadata )
+{
+  IIPImage* image = new IIPImage( metadata );
+  pool.track( image );
+  return image;
+}
+
+
+
+int main()
+{
+  // The metadata of our image as held in our image cache
+  IIPImage metadata( "test.tif" );
+  metadata.isSet = true;
+  metadata.channels = 1;
+  metadata.min.push_back( 0.0 );
+  metadata.max.push_back( 255.0 );
+
+  // Trust our handles for long enough that our non-existent file is never checked
+  ImagePool pool( 4, 3600 );
+
+
+  // A request with MINMAX sets its own sample range on the handle it uses
+  IIPImage* image = open( pool, metadata );
+  image->min[0] = 10.0;
+  image->max[0] = 1000.0;
+  pool.checkin( image );
+  check( pool.size() == 1, "handle returned to our pool" );
+
+  // A following plain request for the same image must see the image's own range
+  image = pool.checkout( "test.tif", metadata.currentX, metadata.currentY, &metadata );
+  check( image != NULL, "handle reused" );
+  if( image ){
+    check( image->getMinValue( 0 ) == 0.0, "minimum restored after MINMAX" );
+    check( image->getMaxValue( 0 ) == 255.0, "maximum restored after MINMAX" );
+    pool.checkin( image );
+  }
+
+
+  // Handles are only reused for the same sequence position
+  image = pool.checkout( "test.tif", metadata.currentX + 1, metadata.currentY, &metadata );
+  check( image == NULL, "no handle for another position" );
+
+
+  // Handles which were never opened are not kept
+  IIPImage* unset = new IIPImage( "other.tif" );
+  pool.track( unset );
+  pool.checkin( unset );
+  check( pool.checkout( "other.tif", 0, 90 ) == NULL, "unopened handle discarded" );
+
+
+  if( failures == 0 ) cout << "ImagePool: all tests passed" << endl;
+  return failures ? 1 : 0;
+}
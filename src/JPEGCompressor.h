@@ -67,6 +67,9 @@ class JPEGCompressor{
   /// The JPEG quality factor
   int Q;
 
+  /// Whether our quality factor has been explicitly set rather than left at its default
+  bool requested;
+
   /// Buffer for the JPEG header
   unsigned char header[1024];
 
@@ -87,7 +90,7 @@ class JPEGCompressor{
 
   /// Constructor
   /** @param quality JPEG Quality factor (0-100) */
-   JPEGCompressor( int quality ) { Q = quality; dest = NULL; };
+   JPEGCompressor( int quality ) { Q = quality; requested = false; dest = NULL; };
 
 
   /// Set the compression quality
@@ -96,6 +99,7 @@ class JPEGCompressor{
     if( factor < 0 ) Q = 0;
     else if( factor > 100 ) Q = 100;
     else Q = factor;
+    requested = true;
   };
 
 
@@ -103,6 +107,10 @@ class JPEGCompressor{
   int getQuality() { return Q; }
 
 
+  /// Whether a particular quality level has been requested
+  bool qualityRequested() { return requested; }
+
+
   /// Initialise strip based compression
   /** If we are doing a strip based encoding, we need to first initialise
       with InitCompression, then compress a single strip at a time using
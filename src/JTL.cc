@@ -78,9 +78,18 @@ void JTL::send( Session* session, int resolution, int tile ){
   else ct = JPEG;
 
 
+  // Don't decode anything if our client has already gone away
+  if( session->out->cancelled() ){
+    if( session->loglevel >= 2 ) *(session->logfile) << "JTL :: Client has gone away: abandoning tile" << endl;
+    throw 499;
+  }
+
   RawTile rawtile = tilemanager.getTile( resolution, tile, session->view->xangle,
 					 session->view->yangle, session->view->getLayers(), ct );
 
+  // Cached tile data is shared, so take our own copy of any raw data we are going to process
+  if( rawtile.compressionType == UNCOMPRESSED ) rawtile.detach();
+
 
   int len = rawtile.dataLength;
 
@@ -261,6 +270,10 @@ void JTL::send( Session* session, int resolution, int tile ){
 
   // Compress to JPEG
   if( rawtile.compressionType == UNCOMPRESSED ){
+    if( session->out->cancelled() ){
+      if( session->loglevel >= 2 ) *(session->logfile) << "JTL :: Client has gone away: abandoning tile" << endl;
+      throw 499;
+    }
     if( session->loglevel >= 4 ){
       *(session->logfile) << "JTL :: Compressing UNCOMPRESSED to JPEG";
       function_timer.start();
@@ -291,7 +304,7 @@ void JTL::send( Session* session, int resolution, int tile ){
 #endif
 
 
-  if( session->out->putStr( static_cast<const char*>(rawtile.data), len ) != len ){
+  if( session->out->putTile( rawtile ) != len ){
     if( session->loglevel >= 1 ){
       *(session->logfile) << "JTL :: Error writing jpeg tile" << endl;
     }
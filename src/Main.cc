@@ -31,9 +31,12 @@
 #include <string>
 #include <utility>
 #include <map>
+#include <vector>
 
 #include "TPTImage.h"
+#include "TIFFIO.h"
 #include "JPEGCompressor.h"
+#include "DeflateCompressor.h"
 #include "Tokenizer.h"
 #include "IIPResponse.h"
 #include "View.h"
@@ -42,6 +45,24 @@
 #include "Task.h"
 #include "Environment.h"
 #include "Writer.h"
+#include "Mutex.h"
+#include "Scheduler.h"
+#include "MemoryLimit.h"
+#include "FileWatcher.h"
+#include "ThreadPool.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifndef WIN32
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include "HTTPServer.h"
+#include "ProcessManager.h"
+#include "CacheSnapshot.h"
+#endif
 
 #ifdef HAVE_MEMCACHED
 #ifdef WIN32
@@ -105,24 +126,685 @@ void IIPSignalHandler( int signal )
     else unsetenv("TZ");
     tzset();
 
-    time_t current_time = time( NULL );
-    char *date = ctime( &current_time );
+    time_t current_time = time( NULL );
+    char *date = ctime( &current_time );
+
+    // No strsignal on Windows
+#ifdef WIN32
+    int sigstr = signal;
+#else
+    char *sigstr = strsignal( signal );
+#endif
+
+    logfile << endl << "Caught " << sigstr << " signal. "
+	    << "Terminating after " << IIPcount << " accesses" << endl
+	    << date
+	    << "<----------------------------------->" << endl << endl;
+    logfile.close();
+  }
+
+  exit( 1 );
+}
+
+
+
+#ifndef WIN32
+
+/* Handle SIGHUP by finishing any requests in progress and then exiting, which allows
+   our process manager or the web server to restart us without losing any requests.
+   To avoid interrupting any I/O in progress, this signal is blocked except while
+   waiting for a new connection. If we save a cache snapshot on exit, SIGTERM and
+   SIGINT are handled in the same way
+*/
+static volatile sig_atomic_t draining = 0;
+static sigset_t drain_signals;
+#ifdef HAVE_EPOLL
+static HTTPEventLoop* http_events = NULL;
+#endif
+
+void IIPDrainHandler( int signal )
+{
+  draining = 1;
+  FCGX_ShutdownPending();
+#ifdef HAVE_EPOLL
+  if( http_events ) http_events->stop();
+#endif
+}
+
+
+/* Allow or block delivery of our drain signals to the calling thread
+ */
+static void setDrainable( bool allow )
+{
+#ifdef HAVE_PTHREAD
+  pthread_sigmask( allow ? SIG_UNBLOCK : SIG_BLOCK, &drain_signals, NULL );
+#else
+  sigprocmask( allow ? SIG_UNBLOCK : SIG_BLOCK, &drain_signals, NULL );
+#endif
+}
+
+#endif
+
+
+
+
+
+/* Lock used to serialize calls to FCGX_Accept_r() or accept() between our worker threads
+   and a lock to protect our request counter
+*/
+static Mutex accept_mutex;
+static Mutex count_mutex;
+
+
+
+/// Settings and objects shared between all worker threads
+struct ServerSettings {
+  std::string version;
+  unsigned int threads;
+  int listen_socket;
+  bool http;
+#ifdef HAVE_EPOLL
+  HTTPEventLoop* events;
+#endif
+  int jpeg_quality;
+  int max_CVT;
+  int max_layers;
+  bool allow_upscaling;
+  std::string cors;
+  std::string base_url;
+  std::string cache_control;
+  Watermark* watermark;
+  ImageCache* imageCache;
+  ImagePool* imagePool;
+  ThreadPool* threadPool;
+  Cache* tileCache;
+  AdmissionControl* admission;
+  Scheduler* scheduler;
+  MemoryLimit* memory;
+#ifdef HAVE_MEMCACHED
+  std::string memcached_servers;
+  unsigned int memcached_timeout;
+#endif
+#ifdef DEBUG
+  char* query;
+#endif
+};
+
+
+
+/// Per-thread state used while processing requests
+struct WorkerState {
+  ServerSettings* server;
+  ofstream* logfile;
+#ifdef HAVE_MEMCACHED
+  Memcache* memcached;
+#endif
+  Timer request_timer;
+};
+
+
+
+/* Handle a single request: parse the query string, run each command and send the
+   response through the given writer. Request parameters are passed in the same form
+   as FCGI, a NULL terminated array of "NAME=value" strings, whether they come from
+   the FCGI library or from our own HTTP front end.
+*/
+template <class W> static void processRequest( WorkerState& state, W& writer, char** envp )
+{
+  ServerSettings* server = state.server;
+
+  const string& version = server->version;
+  const int jpeg_quality = server->jpeg_quality;
+  const int max_CVT = server->max_CVT;
+  const int max_layers = server->max_layers;
+  const bool allow_upscaling = server->allow_upscaling;
+  const string& cors = server->cors;
+  const string& base_url = server->base_url;
+  const string& cache_control = server->cache_control;
+  Watermark& watermark = *(server->watermark);
+  ImageCache& imageCache = *(server->imageCache);
+  Cache& tileCache = *(server->tileCache);
+  ofstream& logfile = *(state.logfile);
+#ifdef HAVE_MEMCACHED
+  Memcache& memcached = *(state.memcached);
+#endif
+  Timer& request_timer = state.request_timer;
+
+  Task* task = NULL;
+  int i;
+
+
+  // Time each request
+  if( loglevel >= 2 ) request_timer.start();
+
+
+  // Declare our image pointer here outside of the try scope
+  //  so that we can close the image on exceptions
+  IIPImage *image = NULL;
+  JPEGCompressor jpeg( jpeg_quality );
+
+
+  // View object for use with the CVT command etc
+  View view;
+  if( max_CVT != -1 ) view.setMaxSize( max_CVT );
+  if( max_layers != 0 ) view.setMaxLayers( max_layers );
+  view.setAllowUpscaling( allow_upscaling );
+
+
+
+  // Create an IIPResponse object - we use this for the OBJ requests.
+  // As the commands return images etc, they handle their own responses.
+  IIPResponse response;
+  response.setCORS( cors );
+  response.setCacheControl( cache_control );
+
+  try{
+
+    // Set up our session data object
+    Session session;
+    session.image = &image;
+    session.response = &response;
+    session.view = &view;
+    session.jpeg = &jpeg;
+    session.loglevel = loglevel;
+    session.logfile = &logfile;
+    session.imageCache = &imageCache;
+    session.imagePool = server->imagePool;
+    session.threadPool = server->threadPool;
+    session.tileCache = &tileCache;
+    session.admission = server->admission;
+    session.scheduler = server->scheduler;
+    session.memory = server->memory;
+    session.out = &writer;
+#ifdef HAVE_MEMCACHED
+    // Responses stored in Memcached must be held entirely within our writer's buffer
+    writer.direct = !memcached.connected();
+#endif
+    session.watermark = &watermark;
+    session.headers.clear();
+
+    char* header = NULL;
+
+    // Get the query into a string
+#ifdef DEBUG
+    header = server->query;
+#else
+    header = FCGX_GetParam( "QUERY_STRING", envp );
+#endif
+
+    const string request_string = (header!=NULL)? header : "";
+
+    // Check that we actually have a request string
+    if( request_string.empty() ){
+      throw string( "QUERY_STRING not set" );
+    }
+
+    if( loglevel >=2 ){
+      logfile << "Full Request is " << request_string << endl;
+    }
+
+
+    // Store some headers
+    session.headers["QUERY_STRING"] = request_string;
+    session.headers["BASE_URL"] = base_url;
+
+    // Get several other HTTP headers
+    if( (header = FCGX_GetParam("SERVER_PROTOCOL", envp)) ){
+      session.headers["SERVER_PROTOCOL"] = string(header);
+    }
+    if( (header = FCGX_GetParam("HTTP_HOST", envp)) ){
+      session.headers["HTTP_HOST"] = string(header);
+    }
+    if( (header = FCGX_GetParam("REQUEST_URI", envp)) ){
+      session.headers["REQUEST_URI"] = string(header);
+    }
+    if ( (header = FCGX_GetParam("HTTPS", envp)) ) {
+      session.headers["HTTPS"] = string(header);
+    }
+    if ( (header = FCGX_GetParam("HTTP_X_IIIF_ID", envp)) ) {
+      session.headers["HTTP_X_IIIF_ID"] = string(header);
+    }
+
+    // Check for IF_MODIFIED_SINCE
+    if( (header = FCGX_GetParam("HTTP_IF_MODIFIED_SINCE", envp)) ){
+      session.headers["HTTP_IF_MODIFIED_SINCE"] = string(header);
+      if( loglevel >= 2 ){
+	logfile << "HTTP Header: If-Modified-Since: " << header << endl;
+      }
+    }
+
+
+#ifdef HAVE_MEMCACHED
+    // Check whether this exists in memcached, but only if we haven't had an if_modified_since
+    // request, which should always be faster to send
+    if( !header || session.headers["HTTP_IF_MODIFIED_SINCE"].empty() ){
+      char* memcached_response = NULL;
+      if( (memcached_response = memcached.retrieve( request_string )) ){
+	writer.putStr( memcached_response, memcached.length() );
+	writer.flush();
+	free( memcached_response );
+	throw( 100 );
+      }
+    }
+#endif
+
+
+    // Parse up the command list
+
+    list < pair<string,string> > requests;
+    list < pair<string,string> > :: const_iterator commands;
+
+    Tokenizer izer( request_string, "&" );
+    while( izer.hasMoreTokens() ){
+      pair <string,string> p;
+      string token = izer.nextToken();
+      int n = token.find_first_of( "=" );
+      p.first = token.substr( 0, n );
+      p.second = token.substr( n+1, token.length() );
+      if( p.first.length() && p.second.length() ) requests.push_back( p );
+    }
+
+
+    i = 0;
+    for( commands = requests.begin(); commands != requests.end(); commands++ ){
+
+      string command = (*commands).first;
+      string argument = (*commands).second;
+
+      if( loglevel >= 2 ){
+	logfile << "[" << i+1 << "/" << requests.size() << "]: Command / Argument is " << command << " : " << argument << endl;
+	i++;
+      }
+
+      task = Task::factory( command );
+      if( task ) task->run( &session, argument );
+
+      if( !task ){
+	if( loglevel >= 1 ) logfile << "Unsupported command: " << command << endl;
+	// Unsupported command error code is 2 2
+	response.setError( "2 2", command );
+      }
+
+
+      // Delete our task
+      if( task ){
+	delete task;
+	task = NULL;
+      }
+
+    }
+
+
+
+    ////////////////////////////////////////////////////////
+    ////////// Send out our Errors if necessary ////////////
+    ////////////////////////////////////////////////////////
+
+    /* Make sure something has actually been sent to the client
+       If no response has been sent by now, we must have a malformed command
+     */
+    if( (!response.imageSent()) && (!response.isSet()) ){
+      // Malformed command syntax error code is 2 1
+      response.setError( "2 1", request_string );
+    }
+
+
+    /* Once we have finished parsing all our OBJ and COMMAND requests
+       send out our response.
+     */
+    if( response.isSet() ){
+      if( loglevel >= 4 ){
+	logfile << "---" << endl <<
+	  response.formatResponse() <<
+	  endl << "---" << endl;
+      }
+      if( writer.printf( response.formatResponse().c_str() ) == -1 ){
+	if( loglevel >= 1 ) logfile << "Error sending IIPResponse" << endl;
+      }
+    }
+
+
+    ////////////////////////////////////////////////////////
+    ////////// Insert the result into Memcached  ///////////
+    ////////// - Note that we never store errors ///////////
+    //////////   or 304 replies                  ///////////
+    ////////////////////////////////////////////////////////
+
+#ifdef HAVE_MEMCACHED
+    if( memcached.connected() ){
+      Timer memcached_timer;
+      memcached_timer.start();
+      memcached.store( session.headers["QUERY_STRING"], writer.buffer, writer.sz );
+      if( loglevel >= 3 ){
+	logfile << "Memcached :: stored " << writer.sz << " bytes in "
+		<< memcached_timer.getTime() << " microseconds" << endl;
+      }
+    }
+#endif
+
+
+
+    //////////////////////////////////////////////////////
+    //////////////// End of try block ////////////////////
+    //////////////////////////////////////////////////////
+  }
+
+  /* Use this for sending various HTTP status codes
+   */
+  catch( const int& code ){
+
+    string status;
+
+    switch( code ){
+
+      case 304:
+	status = "Status: 304 Not Modified\r\nServer: iipsrv/" + version + "\r\n\r\n";
+	writer.printf( status.c_str() );
+	writer.flush();
+	if( loglevel >= 2 ){
+	  logfile << "Sending HTTP 304 Not Modified" << endl;
+	}
+	break;
+
+      case 100:
+	if( loglevel >= 2 ){
+	  logfile << "Memcached hit" << endl;
+	}
+	break;
+
+      case 499:
+	// Our client went away before we finished, so there is nobody to send anything to
+	if( loglevel >= 2 ){
+	  logfile << "Client closed connection: request abandoned" << endl;
+	}
+	break;
+
+      case 503:
+	{
+	  char retry[32];
+	  snprintf( retry, 32, "%u", server->admission->getRetryAfter() );
+	  status = "Status: 503 Service Unavailable\r\nServer: iipsrv/" + version + "\r\nRetry-After: " + retry + "\r\n\r\n";
+	  writer.printf( status.c_str() );
+	  writer.flush();
+	  if( loglevel >= 1 ){
+	    logfile << "Server busy: sending HTTP 503 Service Unavailable" << endl;
+	  }
+	}
+	break;
+
+      default:
+	if( loglevel >= 1 ){
+	  logfile << "Unsupported HTTP status code: " << code << endl << endl;
+	}
+     }
+  }
+
+  /* Catch any errors
+   */
+  catch( const string& error ){
+
+    if( loglevel >= 1 ){
+      logfile << endl << error << endl << endl;
+    }
+
+    if( response.errorIsSet() ){
+      if( loglevel >= 4 ){
+	logfile << "---" << endl <<
+	  response.formatResponse() <<
+	  endl << "---" << endl;
+      }
+      if( writer.printf( response.formatResponse().c_str() ) == -1 ){
+	if( loglevel >= 1 ) logfile << "Error sending IIPResponse" << endl;
+      }
+    }
+    else{
+      /* Display our advertising banner ;-)
+       */
+      writer.printf( response.getAdvert( version ).c_str() );
+    }
+
+  }
+
+  // Image file errors
+  catch( const file_error& error ){
+    // Never keep a handle whose file has just failed
+    server->imagePool->discard( image );
+    image = NULL;
+    string status = "Status: 404 Not Found\r\nServer: iipsrv/" + version + "\r\n\r\n" + error.what();
+    writer.printf( status.c_str() );
+    writer.flush();
+    if( loglevel >= 2 ){
+      logfile << error.what() << endl;
+      logfile << "Sending HTTP 404 Not Found" << endl;
+    }
+  }
+
+  // Parameter errors
+  catch( const invalid_argument& error ){
+    string status = "Status: 400 Bad Request\r\nServer: iipsrv/" + version + "\r\n\r\n" + error.what();
+    writer.printf( status.c_str() );
+    writer.flush();
+    if( loglevel >= 2 ){
+      logfile << error.what() << endl;
+      logfile << "Sending HTTP 400 Bad Request" << endl;
+    }
+  }
+
+  /* Default catch
+   */
+  catch( ... ){
+
+    if( loglevel >= 1 ){
+      logfile << "Error: Default Catch: " << endl << endl;
+    }
+
+    /* Display our advertising banner ;-)
+     */
+    writer.printf( response.getAdvert( version ).c_str() );
+
+  }
+
+
+  /* Do some cleaning up etc. here after all the potential exceptions
+     have been handled
+   */
+  if( task ){
+    delete task;
+    task = NULL;
+  }
+  // Keep our image open for the next request for it
+  server->imagePool->checkin( image );
+  image = NULL;
+
+  // Now that this request's buffers have been freed, keep our process within its memory ceiling
+  if( server->memory ) server->memory->check();
+
+  count_mutex.lock();
+  IIPcount ++;
+  count_mutex.unlock();
+
+  // How long did this request take?
+  if( loglevel >= 2 ){
+    logfile << "Total Request Time: " << request_timer.getTime() << " microseconds" << endl;
+  }
+
+
+  if( loglevel >= 2 ){
+    logfile << "image closed and deleted" << endl
+	    << "Server count is " << IIPcount << endl << endl;
+  }
+}
+
+
+
+/* Worker loop: accept and handle requests until the FCGI library tells us to stop.
+   Each worker has its own FCGI request, log stream and memcached connection and
+   creates its own JPEGCompressor, View and IIPResponse for each request, whereas
+   the tile cache and image metadata cache are shared between all workers.
+*/
+static void* worker( void* arg )
+{
+  ServerSettings* server = static_cast<ServerSettings*>( arg );
+
+  // When running several threads, each one writes to the log through its own
+  // append-mode stream so that output is interleaved line by line rather than
+  // corrupting a single shared stream buffer
+  ofstream threadlog;
+  if( server->threads > 1 && loglevel >= 1 ){
+    threadlog.open( Environment::getLogFile().c_str(), ios::app );
+  }
+  ofstream& logfile = (server->threads > 1) ? threadlog : ::logfile;
+
+#ifdef HAVE_MEMCACHED
+  // Memcached connections cannot be shared between threads
+  Memcache memcached( server->memcached_servers, server->memcached_timeout );
+#endif
+
+  WorkerState state;
+  state.server = server;
+  state.logfile = &logfile;
+#ifdef HAVE_MEMCACHED
+  state.memcached = &memcached;
+#endif
+
+
+#ifdef DEBUG
+
+  FILE *f = fopen( "test.jpg", "w" );
+  FileWriter writer( f );
+  processRequest( state, writer, NULL );
+  fclose( f );
+
+#else
+
+#ifdef HAVE_EPOLL
+
+  /**************************************
+    Event-driven HTTP front end workers
+  **************************************/
+
+  if( server->events ){
+    HTTPEventLoop::Job* job;
+    while( (job = server->events->next()) ){
+
+      // Park bulk requests beyond our limit until a worker finishes another bulk request
+      bool bulk = server->scheduler->enabled() &&
+	Scheduler::classify( FCGX_GetParam( "QUERY_STRING", job->request.getParams() ) );
+      if( bulk && !server->scheduler->admit( job ) ) continue;
+
+      while( job ){
+	processRequest( state, job->writer, job->request.getParams() );
+	server->events->complete( job );
+	job = bulk ? static_cast<HTTPEventLoop::Job*>( server->scheduler->release() ) : NULL;
+      }
+    }
+    return NULL;
+  }
+
+#endif
+
+#ifndef WIN32
+
+  /****************
+    Main HTTP loop
+  ****************/
+
+  if( server->http ){
+
+    while( !draining ){
+
+      // Only one thread at a time should wait in accept()
+      int fd;
+      {
+	ScopedLock lock( accept_mutex );
+	setDrainable( true );
+	do{
+	  fd = accept( server->listen_socket, NULL, NULL );
+	}
+	while( fd < 0 && !draining && (errno == EINTR || errno == ECONNABORTED) );
+	setDrainable( false );
+      }
+      if( fd < 0 ){
+	if( !draining && loglevel >= 1 ) logfile << "Unable to accept connection: " << strerror( errno ) << endl;
+	break;
+      }
+
+      // Serve each request on this connection in turn, including any pipelined ones,
+      // until the client closes it, asks us to close it or stays idle for too long
+      HTTPConnection connection( fd, HTTP_KEEPALIVE_TIMEOUT );
+      HTTPRequest request;
+      while( connection.next( request ) ){
+	HTTPWriter writer;
+	writer.socket = fd;
+	processRequest( state, writer, request.getParams() );
+	if( draining ) request.keepAlive = false;
+	if( !writer.send( fd, request ) || !request.keepAlive ) break;
+      }
+    }
+
+    return NULL;
+  }
+
+#endif
+
+
+  /****************
+    Main FCGI loop
+  ****************/
+
+  FCGX_Request* request = new FCGX_Request;
+  if( FCGX_InitRequest( request, server->listen_socket, 0 ) ){
+    delete request;
+    return NULL;
+  }
+
+  while( true ){
+
+    // Only one thread at a time should wait in accept()
+    {
+      ScopedLock lock( accept_mutex );
+#ifndef WIN32
+      setDrainable( true );
+#endif
+      int status = FCGX_Accept_r( request );
+#ifndef WIN32
+      setDrainable( false );
+#endif
+      if( status < 0 ) break;
+    }
+
+    // Park bulk requests beyond our limit until a worker finishes another bulk request
+    // and carry on accepting with a new request object
+    bool bulk = server->scheduler->enabled() &&
+      Scheduler::classify( FCGX_GetParam( "QUERY_STRING", request->envp ) );
+    if( bulk && !server->scheduler->admit( request ) ){
+      request = new FCGX_Request;
+      FCGX_InitRequest( request, server->listen_socket, 0 );
+      continue;
+    }
+
+    while( true ){
+
+      FCGIWriter writer( request->out, request->ipcFd );
+      processRequest( state, writer, request->envp );
 
-    // No strsignal on Windows
-#ifdef WIN32
-    int sigstr = signal;
-#else
-    char *sigstr = strsignal( signal );
-#endif
+      // Finish the request here rather than in the next FCGX_Accept_r() call
+      // so that the response is not flushed while holding the accept lock
+      FCGX_Finish_r( request );
 
-    logfile << endl << "Caught " << sigstr << " signal. "
-	    << "Terminating after " << IIPcount << " accesses" << endl
-	    << date
-	    << "<----------------------------------->" << endl << endl;
-    logfile.close();
+      // Take over any parked request in place of a finished bulk request
+      FCGX_Request* next = bulk ? static_cast<FCGX_Request*>( server->scheduler->release() ) : NULL;
+      if( !next ) break;
+      delete request;
+      request = next;
+    }
   }
 
-  exit( 1 );
+  delete request;
+
+#endif
+
+  return NULL;
 }
 
 
@@ -133,7 +815,6 @@ int main( int argc, char *argv[] )
 {
 
   IIPcount = 0;
-  int i;
 
 
   // Define ourselves a version
@@ -191,11 +872,19 @@ int main( int argc, char *argv[] )
 
 #ifndef DEBUG
 
-  FCGX_Request request;
   int listen_socket = 0;
   bool standalone = false;
+  bool http = false;
+#ifndef WIN32
+  ProcessManager* processManager = NULL;
+#endif
+
+#ifndef WIN32
+  // Our built-in HTTP server uses the same socket options as standalone FCGI mode
+  if( argv[1] && (string(argv[1]) == "--http") ) http = true;
+#endif
 
-  if( argv[1] && (string(argv[1]) == "--bind") ){
+  if( argv[1] && (string(argv[1]) == "--bind" || http) ){
     string socket = argv[2];
     if( !socket.length() ){
       logfile << "No socket specified" << endl << endl;
@@ -206,16 +895,32 @@ int main( int argc, char *argv[] )
       string bklg = argv[4];
       if( bklg.length() ) backlog = atoi( bklg.c_str() );
     }
+#ifndef WIN32
+    // Optionally run several worker processes, each with its own socket where possible
+    unsigned int processes = Environment::getWorkerProcesses();
+    if( processes > 0 ){
+      processManager = new ProcessManager( processes, Environment::getWorkerAffinity(), loglevel, &logfile );
+      try{
+	processManager->listen( socket, backlog );
+      }
+      catch( const string& error ){
+	logfile << error << endl << endl;
+	exit(1);
+      }
+    }
+    else
+#endif
     listen_socket = FCGX_OpenSocket( socket.c_str(), backlog );
     if( listen_socket < 0 ){
       logfile << "Unable to open socket '" << socket << "'" << endl << endl;
       exit(1);
     }
     standalone = true;
-    logfile << "Running in standalone mode on socket: " << socket << " with backlog: " << backlog << endl << endl;
+    if( http ) logfile << "Running in HTTP mode on socket: " << socket << " with backlog: " << backlog << endl << endl;
+    else logfile << "Running in standalone mode on socket: " << socket << " with backlog: " << backlog << endl << endl;
   }
 
-  if( FCGX_InitRequest( &request, listen_socket, 0 ) ) return(1);
+  if( FCGX_Init() ) return(1);
 
   // Check whether we are really in FCGI mode - only if we are not in standalone mode
   if( FCGX_IsCGI() ){
@@ -224,7 +929,7 @@ int main( int argc, char *argv[] )
       return( 1 );
     }
   }
-  else{
+  else if( !http ){
     if( loglevel >= 1 ) logfile << "Running in FCGI mode" << endl << endl;
   }
 
@@ -233,7 +938,52 @@ int main( int argc, char *argv[] )
 
   // Set our maximum image cache size
   float max_image_cache_size = Environment::getMaxImageCacheSize();
-  imageCacheMapType imageCache;
+
+
+  // Set the maximum number of images in our metadata cache
+  unsigned int max_image_metadata_cache = Environment::getMaxImageMetadataCache();
+  ImageCache imageCache( max_image_metadata_cache );
+
+
+  // Set the maximum number of idle open image handles we keep
+  unsigned int max_open_images = Environment::getMaxOpenImages();
+  unsigned int revalidate_ttl = Environment::getRevalidateTTL();
+  ImagePool imagePool( max_open_images, revalidate_ttl );
+  bool file_watch = Environment::getFileWatch();
+
+
+  // Get the way in which we read our TIFF images
+  string tiff_io = Environment::getTIFFIO();
+  TIFFIOMode io_mode = TIFFIO_LIBTIFF;
+  if( tiff_io == "mmap" ) io_mode = TIFFIO_MMAP;
+  else if( tiff_io == "pread" ) io_mode = TIFFIO_PREAD;
+  else if( tiff_io == "direct" ) io_mode = TIFFIO_DIRECT;
+  else if( tiff_io == "readahead" ) io_mode = TIFFIO_READAHEAD;
+  else tiff_io = "libtiff";
+#ifdef WIN32
+  io_mode = TIFFIO_LIBTIFF;
+  tiff_io = "libtiff";
+#endif
+  TIFFIO::setMode( io_mode );
+
+
+  // Get our tile cache eviction policy
+  string cache_policy = Environment::getCachePolicy();
+  CachePolicy policy = CLOCK;
+  if( cache_policy == "tinylfu" ) policy = TINYLFU;
+  else cache_policy = "clock";
+
+
+  // Get any ceiling on the memory used by our whole process
+  float memory_limit = Environment::getMemoryLimit();
+
+
+  // Get the level at which to losslessly compress uncompressed tiles in our tile cache
+  int cache_compression = Environment::getCacheCompression();
+  if( cache_compression > 0 && !DeflateCompressor::available() ){
+    if( loglevel >= 1 ) logfile << "Tile cache compression requested, but not available in this build" << endl;
+    cache_compression = 0;
+  }
 
 
   // Get our image pattern variable
@@ -277,9 +1027,47 @@ int main( int argc, char *argv[] )
   bool allow_upscaling = Environment::getAllowUpscaling();
 
 
+  // Get the number of worker threads - this is always 1 without thread support or in debug mode
+  unsigned int threads = Environment::getWorkerThreads();
+#if !defined(HAVE_PTHREAD) || defined(DEBUG)
+  threads = 1;
+#endif
+
+  // Get the number of extra threads with which each region request may decode its tiles
+  unsigned int decoder_threads = Environment::getDecoderThreads();
+#if !defined(HAVE_PTHREAD) || defined(DEBUG)
+  decoder_threads = 0;
+#endif
+
+
+  // Get our admission control limits for region requests
+  float admission_memory = Environment::getAdmissionMemory();
+  unsigned int admission_concurrency = Environment::getAdmissionConcurrency();
+  unsigned int admission_queue = Environment::getAdmissionQueue();
+  unsigned int admission_timeout = Environment::getAdmissionTimeout();
+
+
+  // Get the number of workers reserved for interactive requests
+  unsigned int interactive_workers = Environment::getInteractiveWorkers();
+
+
+  // Get any cache snapshot file and the interval between periodic snapshots
+#ifndef WIN32
+  string cache_snapshot = Environment::getCacheSnapshot();
+  unsigned int cache_snapshot_interval = Environment::getCacheSnapshotInterval();
+#endif
+
+
   // Print out some information
   if( loglevel >= 1 ){
     logfile << "Setting maximum image cache size to " << max_image_cache_size << "MB" << endl;
+    logfile << "Setting tile cache eviction policy to " << cache_policy << endl;
+    if( cache_compression > 0 ) logfile << "Setting tile cache compression level to " << cache_compression << endl;
+    if( memory_limit > 0 ) logfile << "Setting process memory limit to " << memory_limit << "MB" << endl;
+    logfile << "Setting maximum image metadata cache size to " << max_image_metadata_cache << " images" << endl;
+    logfile << "Setting maximum number of open images to " << max_open_images << endl;
+    if( revalidate_ttl > 0 ) logfile << "Setting open image revalidation TTL to " << revalidate_ttl << " seconds" << endl;
+    logfile << "Setting TIFF I/O mode to " << tiff_io << endl;
     logfile << "Setting filesystem prefix to '" << filesystem_prefix << "'" << endl;
     logfile << "Setting default JPEG quality to " << jpeg_quality << endl;
     logfile << "Setting maximum CVT size to " << max_CVT << endl;
@@ -298,6 +1086,32 @@ int main( int argc, char *argv[] )
     logfile << "Setting up JPEG2000 support via OpenJPEG" << endl;
 #endif
     logfile << "Setting Allow Upscaling to " << (allow_upscaling? "true" : "false") << endl;
+    logfile << "Setting number of worker threads to " << threads << endl;
+    if( decoder_threads > 0 ) logfile << "Setting number of region decoder threads to " << decoder_threads << endl;
+#ifdef _OPENMP
+    // Our filters' OpenMP threads are not shared between workers, unlike our decoder threads
+    unsigned int omp_threads = omp_get_max_threads();
+    if( decoder_threads > 0 && omp_threads > 1 ){
+      logfile << "Image processing filters use up to " << omp_threads << " OpenMP threads per worker: up to "
+	      << decoder_threads + threads * omp_threads << " threads may compete for the CPU" << endl;
+    }
+#endif
+    if( interactive_workers > 0 && threads > 1 ){
+      logfile << "Setting number of workers reserved for interactive requests to " << interactive_workers << endl;
+    }
+    if( admission_memory > 0 || admission_concurrency > 0 ){
+      logfile << "Setting admission control for region requests to ";
+      if( admission_memory > 0 ) logfile << admission_memory << "MB ";
+      if( admission_concurrency > 0 ) logfile << admission_concurrency << " concurrent ";
+      logfile << "with a queue of " << admission_queue << " for up to " << admission_timeout << "s" << endl;
+    }
+#ifndef WIN32
+    if( !cache_snapshot.empty() ){
+      logfile << "Setting cache snapshot file to '" << cache_snapshot << "'";
+      if( cache_snapshot_interval > 0 ) logfile << " with an interval of " << cache_snapshot_interval << "s";
+      logfile << endl;
+    }
+#endif
   }
 
 
@@ -386,20 +1200,56 @@ int main( int argc, char *argv[] )
 
 
 
+#if !defined(WIN32) && !defined(DEBUG)
+
+  /***********************************************************
+    In standalone mode, optionally fork and supervise a pool
+    of worker processes. This only returns in the workers
+  ***********************************************************/
+
+  if( processManager ){
+    listen_socket = processManager->run();
+    delete processManager;
+  }
+
+#endif
+
+
   /***********************************************************
     Set up a signal handler for USR1, TERM, HUP and INT signals
-    - to simplify things, they can all just shutdown the
+    - to simplify things, USR1, TERM and INT just shutdown the
       server. We can rely on mod_fastcgi to restart us.
+    - HUP lets requests in progress finish before shutting down,
+      as do TERM and INT if we save a cache snapshot on exit
     - SIGUSR1 and SIGHUP don't exist on Windows, though. 
   ***********************************************************/
 
+  signal( SIGTERM, IIPSignalHandler );
+  signal( SIGINT, IIPSignalHandler );
+
 #ifndef WIN32
   signal( SIGUSR1, IIPSignalHandler );
-  signal( SIGHUP, IIPSignalHandler );
-#endif
 
-  signal( SIGTERM, IIPSignalHandler );
-  signal( SIGINT, IIPSignalHandler );
+  struct sigaction drain;
+  memset( &drain, 0, sizeof(drain) );
+  sigemptyset( &drain.sa_mask );
+  drain.sa_handler = IIPDrainHandler;
+  sigemptyset( &drain_signals );
+  sigaddset( &drain_signals, SIGHUP );
+  sigaction( SIGHUP, &drain, NULL );
+  if( !cache_snapshot.empty() ){
+    sigaddset( &drain_signals, SIGTERM );
+    sigaddset( &drain_signals, SIGINT );
+    sigaction( SIGTERM, &drain, NULL );
+    sigaction( SIGINT, &drain, NULL );
+  }
+  setDrainable( false );
+
+#ifndef DEBUG
+  // In HTTP mode, a client closing its connection early should not kill the server
+  if( http ) signal( SIGPIPE, SIG_IGN );
+#endif
+#endif
 
 
 
@@ -410,369 +1260,223 @@ int main( int argc, char *argv[] )
   }
 
 
-  // Set up our request timers and seed our random number generator with the millisecond count from it
+  // Seed our random number generator with the millisecond count from a timer
   Timer request_timer;
   srand( request_timer.getTime() );
 
-  // Create our tile cache
-  Cache tileCache( max_image_cache_size );
-  Task* task = NULL;
-
-
-
-  /****************
-    Main FCGI loop
-  ****************/
-
-#ifdef DEBUG
-  int status = true;
-  while( status ){
-
-    FILE *f = fopen( "test.jpg", "w" );
-    FileWriter writer( f );
-    status = false;
-
-#else
-
-  while( FCGX_Accept_r( &request ) >= 0 ){
-
-    FCGIWriter writer( request.out );
-
-#endif
-
-
-    // Time each request
-    if( loglevel >= 2 ) request_timer.start();
-
-
-    // Declare our image pointer here outside of the try scope
-    //  so that we can close the image on exceptions
-    IIPImage *image = NULL;
-    JPEGCompressor jpeg( jpeg_quality );
-
+  // Create our tile cache and a lock for our image cache, both of which are shared by all workers.
+  // With several threads, split the tile cache into independently locked segments to reduce lock
+  // contention, but keep each segment large enough to hold a useful number of tiles
+  unsigned int segments = 1;
+  if( threads > 1 ){
+    segments = 4 * threads;
+    if( segments > (unsigned int) max_image_cache_size ) segments = (unsigned int) max_image_cache_size;
+    if( segments < 1 ) segments = 1;
+  }
+  if( loglevel >= 1 ) logfile << "Dividing tile cache into " << segments << " segment" << ((segments>1)?"s":"") << endl << endl;
+  Cache tileCache( max_image_cache_size, segments, policy );
+  tileCache.setCompression( cache_compression );
 
-    // View object for use with the CVT command etc
-    View view;
-    if( max_CVT != -1 ) view.setMaxSize( max_CVT );
-    if( max_layers != 0 ) view.setMaxLayers( max_layers );
-    view.setAllowUpscaling( allow_upscaling );
+  // Limit the memory and number of region requests processed at the same time
+  AdmissionControl admission( admission_memory, admission_concurrency, admission_queue, admission_timeout );
 
+  // Keep some of our workers free for interactive requests while bulk exports are running
+  Scheduler scheduler( threads, interactive_workers );
 
+  // Evict from our caches whenever our process exceeds its memory ceiling
+  MemoryLimit memoryLimit( memory_limit, &tileCache, &imageCache, &imagePool, loglevel, &logfile );
 
-    // Create an IIPResponse object - we use this for the OBJ requests.
-    // As the commands return images etc, they handle their own responses.
-    IIPResponse response;
-    response.setCORS( cors );
-    response.setCacheControl( cache_control );
 
+  // Optionally attach to a shared memory cache for our JPEG tiles, which is shared with
+  // any other iipsrv processes on this host
+  SharedCache* sharedCache = NULL;
+  float shared_cache_size = Environment::getSharedCacheSize();
+  if( shared_cache_size > 0 ){
+    string shared_cache_name = Environment::getSharedCacheName();
     try{
-
-      // Set up our session data object
-      Session session;
-      session.image = &image;
-      session.response = &response;
-      session.view = &view;
-      session.jpeg = &jpeg;
-      session.loglevel = loglevel;
-      session.logfile = &logfile;
-      session.imageCache = &imageCache;
-      session.tileCache = &tileCache;
-      session.out = &writer;
-      session.watermark = &watermark;
-      session.headers.clear();
-
-      char* header = NULL;
-
-      // Get the query into a string
-#ifdef DEBUG
-      header = argv[1];
-#else
-      header = FCGX_GetParam( "QUERY_STRING", request.envp );
-#endif
-
-      const string request_string = (header!=NULL)? header : "";
-
-      // Check that we actually have a request string
-      if( request_string.empty() ){
-	throw string( "QUERY_STRING not set" );
-      }
-
-      if( loglevel >=2 ){
-	logfile << "Full Request is " << request_string << endl;
-      }
-
-
-      // Store some headers
-      session.headers["QUERY_STRING"] = request_string;
-      session.headers["BASE_URL"] = base_url;
-
-      // Get several other HTTP headers
-      if( (header = FCGX_GetParam("SERVER_PROTOCOL", request.envp)) ){
-        session.headers["SERVER_PROTOCOL"] = string(header);
-      }
-      if( (header = FCGX_GetParam("HTTP_HOST", request.envp)) ){
-        session.headers["HTTP_HOST"] = string(header);
-      }
-      if( (header = FCGX_GetParam("REQUEST_URI", request.envp)) ){
-        session.headers["REQUEST_URI"] = string(header);
-      }
-      if ( (header = FCGX_GetParam("HTTPS", request.envp)) ) {
-        session.headers["HTTPS"] = string(header);
-      }
-      if ( (header = FCGX_GetParam("HTTP_X_IIIF_ID", request.envp)) ) {
-        session.headers["HTTP_X_IIIF_ID"] = string(header);
-      }
-
-      // Check for IF_MODIFIED_SINCE
-      if( (header = FCGX_GetParam("HTTP_IF_MODIFIED_SINCE", request.envp)) ){
-	session.headers["HTTP_IF_MODIFIED_SINCE"] = string(header);
-	if( loglevel >= 2 ){
-	  logfile << "HTTP Header: If-Modified-Since: " << header << endl;
-	}
-      }
-
-
-#ifdef HAVE_MEMCACHED
-      // Check whether this exists in memcached, but only if we haven't had an if_modified_since
-      // request, which should always be faster to send
-      if( !header || session.headers["HTTP_IF_MODIFIED_SINCE"].empty() ){
-	char* memcached_response = NULL;
-	if( (memcached_response = memcached.retrieve( request_string )) ){
-	  writer.putStr( memcached_response, memcached.length() );
-	  writer.flush();
-	  free( memcached_response );
-	  throw( 100 );
-	}
-      }
-#endif
-
-
-      // Parse up the command list
-
-      list < pair<string,string> > requests;
-      list < pair<string,string> > :: const_iterator commands;
-
-      Tokenizer izer( request_string, "&" );
-      while( izer.hasMoreTokens() ){
-	pair <string,string> p;
-	string token = izer.nextToken();
-	int n = token.find_first_of( "=" );
-	p.first = token.substr( 0, n );
-	p.second = token.substr( n+1, token.length() );
-	if( p.first.length() && p.second.length() ) requests.push_back( p );
+      sharedCache = new SharedCache( shared_cache_name, shared_cache_size );
+      tileCache.setSharedCache( sharedCache );
+      if( loglevel >= 1 ){
+	logfile << "Using shared memory tile cache '" << shared_cache_name << "' of "
+		<< sharedCache->getSize() / 1048576 << "MB" << endl << endl;
       }
+    }
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << error << endl << endl;
+    }
+  }
 
 
-      i = 0;
-      for( commands = requests.begin(); commands != requests.end(); commands++ ){
-
-	string command = (*commands).first;
-	string argument = (*commands).second;
-
-	if( loglevel >= 2 ){
-	  logfile << "[" << i+1 << "/" << requests.size() << "]: Command / Argument is " << command << " : " << argument << endl;
-	  i++;
-	}
-
-	task = Task::factory( command );
-	if( task ) task->run( &session, argument );
-
-	if( !task ){
-	  if( loglevel >= 1 ) logfile << "Unsupported command: " << command << endl;
-	  // Unsupported command error code is 2 2
-	  response.setError( "2 2", command );
-	}
-
-
-	// Delete our task
-	if( task ){
-	  delete task;
-	  task = NULL;
-	}
-
+  // Optionally keep JPEG tiles evicted from memory in a cache on local disk
+  DiskCache* diskCache = NULL;
+  string disk_cache = Environment::getDiskCache();
+  if( !disk_cache.empty() ){
+    float disk_cache_size = Environment::getDiskCacheSize();
+    try{
+      diskCache = new DiskCache( disk_cache, disk_cache_size, loglevel, &logfile );
+      tileCache.setDiskCache( diskCache );
+      if( loglevel >= 1 ){
+	logfile << "Using disk tile cache '" << diskCache->getDirectory() << "' of "
+		<< disk_cache_size << "MB" << endl << endl;
       }
+    }
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << error << endl << endl;
+    }
+  }
 
 
+  // Optionally watch our image files for changes, so that open images need not be checked on every request
+  FileWatcher* fileWatcher = NULL;
+  if( file_watch ){
+    try{
+      fileWatcher = new FileWatcher( filesystem_prefix, filename_pattern, &imageCache, &imagePool, loglevel, &logfile );
+      imagePool.setWatcher( fileWatcher );
+      if( loglevel >= 1 ) logfile << "Watching image files for changes" << endl << endl;
+    }
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << error << endl << endl;
+    }
+  }
 
-      ////////////////////////////////////////////////////////
-      ////////// Send out our Errors if necessary ////////////
-      ////////////////////////////////////////////////////////
-
-      /* Make sure something has actually been sent to the client
-	 If no response has been sent by now, we must have a malformed command
-       */
-      if( (!response.imageSent()) && (!response.isSet()) ){
-	// Malformed command syntax error code is 2 1
-	response.setError( "2 1", request_string );
-      }
 
+  // Optionally decode the tiles of regions in parallel
+  ThreadPool* threadPool = NULL;
+  if( decoder_threads > 0 ){
+    try{
+      threadPool = new ThreadPool( decoder_threads );
+    }
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << error << endl << endl;
+    }
+  }
 
-      /* Once we have finished parsing all our OBJ and COMMAND requests
-	 send out our response.
-       */
-      if( response.isSet() ){
-	if( loglevel >= 4 ){
-	  logfile << "---" << endl <<
-	    response.formatResponse() <<
-	    endl << "---" << endl;
-	}
-	if( writer.printf( response.formatResponse().c_str() ) == -1 ){
-	  if( loglevel >= 1 ) logfile << "Error sending IIPResponse" << endl;
-	}
-      }
 
+  // Warm up our caches from any previous snapshot and optionally keep saving them in the background
+#ifndef WIN32
+  CacheSnapshot* snapshot = NULL;
+  if( !cache_snapshot.empty() ){
+    snapshot = new CacheSnapshot( cache_snapshot, &imageCache, &tileCache, loglevel, &logfile );
+    try{
+      snapshot->load();
+    }
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << error << endl << endl;
+    }
+    if( cache_snapshot_interval > 0 ) snapshot->start( cache_snapshot_interval );
+  }
+#endif
 
-      ////////////////////////////////////////////////////////
-      ////////// Insert the result into Memcached  ///////////
-      ////////// - Note that we never store errors ///////////
-      //////////   or 304 replies                  ///////////
-      ////////////////////////////////////////////////////////
 
+  // Gather together everything our workers need
+  ServerSettings settings;
+  settings.version = version;
+  settings.threads = threads;
+#ifndef DEBUG
+  settings.listen_socket = listen_socket;
+  settings.http = http;
+#else
+  settings.listen_socket = 0;
+  settings.http = false;
+  settings.query = argv[1];
+#endif
+  settings.jpeg_quality = jpeg_quality;
+  settings.max_CVT = max_CVT;
+  settings.max_layers = max_layers;
+  settings.allow_upscaling = allow_upscaling;
+  settings.cors = cors;
+  settings.base_url = base_url;
+  settings.cache_control = cache_control;
+  settings.watermark = &watermark;
+  settings.imageCache = &imageCache;
+  settings.imagePool = &imagePool;
+  settings.threadPool = threadPool;
+  settings.tileCache = &tileCache;
+  settings.admission = &admission;
+  settings.scheduler = &scheduler;
+  settings.memory = &memoryLimit;
 #ifdef HAVE_MEMCACHED
-      if( memcached.connected() ){
-	Timer memcached_timer;
-	memcached_timer.start();
-	memcached.store( session.headers["QUERY_STRING"], writer.buffer, writer.sz );
-	if( loglevel >= 3 ){
-	  logfile << "Memcached :: stored " << writer.sz << " bytes in "
-		  << memcached_timer.getTime() << " microseconds" << endl;
-	}
-      }
+  settings.memcached_servers = memcached_servers;
+  settings.memcached_timeout = memcached_timeout;
 #endif
 
 
-
-      //////////////////////////////////////////////////////
-      //////////////// End of try block ////////////////////
-      //////////////////////////////////////////////////////
-    }
-
-    /* Use this for sending various HTTP status codes
-     */
-    catch( const int& code ){
-
-      string status;
-
-      switch( code ){
-
-        case 304:
-	  status = "Status: 304 Not Modified\r\nServer: iipsrv/" + version + "\r\n\r\n";
-	  writer.printf( status.c_str() );
-	  writer.flush();
-          if( loglevel >= 2 ){
-	    logfile << "Sending HTTP 304 Not Modified" << endl;
-	  }
-	  break;
-
-        case 100:
-	  if( loglevel >= 2 ){
-	    logfile << "Memcached hit" << endl;
-	  }
-	  break;
-
-        default:
-          if( loglevel >= 1 ){
-	    logfile << "Unsupported HTTP status code: " << code << endl << endl;
-	  }
-       }
+  // In HTTP mode, use our event-driven front end if available. This runs in the main
+  // thread and handles all network I/O, leaving our workers free to process requests
+  bool pool = ( threads > 1 );
+#ifdef HAVE_EPOLL
+  settings.events = NULL;
+#ifndef DEBUG
+  if( http ){
+    try{
+      settings.events = new HTTPEventLoop( listen_socket, HTTP_KEEPALIVE_TIMEOUT );
+      http_events = settings.events;
+      pool = true;
+      if( loglevel >= 1 ) logfile << "Using event-driven HTTP front end" << endl << endl;
     }
-
-    /* Catch any errors
-     */
     catch( const string& error ){
-
-      if( loglevel >= 1 ){
-	logfile << endl << error << endl << endl;
-      }
-
-      if( response.errorIsSet() ){
-	if( loglevel >= 4 ){
-	  logfile << "---" << endl <<
-	    response.formatResponse() <<
-	    endl << "---" << endl;
-	}
-	if( writer.printf( response.formatResponse().c_str() ) == -1 ){
-	  if( loglevel >= 1 ) logfile << "Error sending IIPResponse" << endl;
-	}
-      }
-      else{
-	/* Display our advertising banner ;-)
-	 */
-	writer.printf( response.getAdvert( version ).c_str() );
-      }
-
+      if( loglevel >= 1 ) logfile << error << endl << endl;
     }
+  }
+#endif
+#endif
 
-    // Image file errors
-    catch( const file_error& error ){
-      string status = "Status: 404 Not Found\r\nServer: iipsrv/" + version + "\r\n\r\n" + error.what();
-      writer.printf( status.c_str() );
-      writer.flush();
-      if( loglevel >= 2 ){
-	logfile << error.what() << endl;
-	logfile << "Sending HTTP 404 Not Found" << endl;
-      }
-    }
 
-    // Parameter errors
-    catch( const invalid_argument& error ){
-      string status = "Status: 400 Bad Request\r\nServer: iipsrv/" + version + "\r\n\r\n" + error.what();
-      writer.printf( status.c_str() );
-      writer.flush();
-      if( loglevel >= 2 ){
-	logfile << error.what() << endl;
-	logfile << "Sending HTTP 400 Bad Request" << endl;
-      }
+  // Run our worker loop directly in single-threaded mode, otherwise start our pool of workers
+  if( !pool ) worker( &settings );
+#ifdef HAVE_PTHREAD
+  else{
+    vector<pthread_t> workers;
+    for( unsigned int n = 0; n < threads; n++ ){
+      pthread_t id;
+      if( pthread_create( &id, NULL, worker, &settings ) == 0 ) workers.push_back( id );
+      else if( loglevel >= 1 ) logfile << "Unable to create worker thread " << n << endl;
     }
+#ifdef HAVE_EPOLL
+    if( settings.events ) settings.events->run();
+#endif
+    for( unsigned int n = 0; n < workers.size(); n++ ) pthread_join( workers[n], NULL );
+  }
+#endif
 
-    /* Default catch
-     */
-    catch( ... ){
-
-      if( loglevel >= 1 ){
-	logfile << "Error: Default Catch: " << endl << endl;
-      }
+#ifdef HAVE_EPOLL
+  http_events = NULL;
+  delete settings.events;
+#endif
 
-      /* Display our advertising banner ;-)
-       */
-      writer.printf( response.getAdvert( version ).c_str() );
+#ifndef WIN32
+  if( draining && loglevel >= 1 ) logfile << endl << "Finished requests in progress" << endl;
 
+  // Save our caches for our next start
+  if( snapshot ){
+    try{
+      snapshot->save();
+      if( loglevel >= 1 ) logfile << "Saved cache snapshot to '" << cache_snapshot << "'" << endl;
     }
-
-
-    /* Do some cleaning up etc. here after all the potential exceptions
-       have been handled
-     */
-    if( task ){
-      delete task;
-      task = NULL;
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << error << endl;
     }
-    delete image;
-    image = NULL;
-    IIPcount ++;
-
-#ifdef DEBUG
-    fclose( f );
+  }
 #endif
 
 
 
-    // How long did this request take?
-    if( loglevel >= 2 ){
-      logfile << "Total Request Time: " << request_timer.getTime() << " microseconds" << endl;
-    }
+  // Stop our region decoder threads
+  delete threadPool;
 
 
-    if( loglevel >= 2 ){
-      logfile << "image closed and deleted" << endl
-	      << "Server count is " << IIPcount << endl << endl;
-    }
+  // Stop watching our image files
+  imagePool.setWatcher( NULL );
+  delete fileWatcher;
 
 
+  // Write out any tiles still queued for our disk cache
+  tileCache.setDiskCache( NULL );
+  delete diskCache;
 
-    ///////// End of FCGI_ACCEPT while loop or for loop in debug mode //////////
-  }
 
+  // Detach from our shared memory cache
+  delete sharedCache;
 
 
   if( loglevel >= 1 ){
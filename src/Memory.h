@@ -0,0 +1,78 @@
+// Heap Memory Accounting Helpers
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _MEMORY_H
+#define _MEMORY_H
+
+
+#include <cstddef>
+#include <string>
+
+#if defined(HAVE_MALLOC_USABLE_SIZE) || defined(HAVE_MALLOC_TRIM)
+#include <malloc.h>
+#endif
+
+
+
+/// Estimate the heap memory taken by an allocation of a given size
+/** Allocators such as glibc's malloc add a header word to each block and round it up
+    to a multiple of 16 bytes
+    @param n requested size in bytes
+ */
+inline size_t heapSize( size_t n ){
+  size_t size = ( n + sizeof(size_t) + 15 ) & ~((size_t)15);
+  return ( size < 32 ) ? 32 : size;
+}
+
+
+/// Heap memory actually taken by a block allocated with malloc() or new[]
+/** Uses malloc_usable_size() where available, which also accounts for the page
+    rounding of large blocks
+    @param p block or NULL
+    @param n requested size in bytes, used if the real size is unknown
+ */
+inline size_t heapSize( const void* p, size_t n ){
+  if( !p ) return 0;
+#ifdef HAVE_MALLOC_USABLE_SIZE
+  return malloc_usable_size( const_cast<void*>( p ) ) + sizeof(size_t);
+#else
+  return heapSize( n );
+#endif
+}
+
+
+/// Heap memory taken by the contents of a string
+/** Short strings are held within the string object itself */
+inline size_t heapSize( const std::string& s ){
+  return ( s.capacity() < sizeof(std::string) ) ? 0 : heapSize( s.capacity() + 1 );
+}
+
+
+/// Hand memory freed by our caches back to the operating system
+inline void releaseMemory(){
+#ifdef HAVE_MALLOC_TRIM
+  malloc_trim( 0 );
+#endif
+}
+
+
+#endif
@@ -0,0 +1,128 @@
+// Process-wide Memory Ceiling Member Functions
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "MemoryLimit.h"
+#include "Memory.h"
+
+#include <cstdio>
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+
+using namespace std;
+
+
+MemoryLimit::MemoryLimit( float max, Cache* tc, ImageCache* ic, ImagePool* ip, int l, ofstream* log ) :
+  tileCache( tc ), imageCache( ic ), imagePool( ip ), loglevel( l ), logfile( log ),
+  used( 0 ), trims( 0 ), freed( 0 ), busy( false )
+{
+  limit = (unsigned long)( max * 1048576.0 );
+  ceiling = limit;
+  interval.start();
+}
+
+
+
+unsigned long MemoryLimit::getResidentMemory()
+{
+#ifndef WIN32
+  // Linux provides our resident size and the part of it backed by files or shared memory
+  // in pages as the second and third fields. Only the remainder can be freed by evicting
+  // from our own caches: pages of our shared tile cache or of memory mapped images cannot
+  FILE* f = fopen( "/proc/self/statm", "r" );
+  if( !f ) return 0;
+  unsigned long pages = 0, resident = 0, shared = 0;
+  int n = fscanf( f, "%lu %lu %lu", &pages, &resident, &shared );
+  fclose( f );
+  if( n != 3 || resident == 0 ) return 0;
+  if( shared > resident ) shared = resident;
+  return ( resident - shared ) * (unsigned long) sysconf( _SC_PAGESIZE );
+#else
+  return 0;
+#endif
+}
+
+
+
+void MemoryLimit::check()
+{
+  if( limit == 0 ) return;
+
+  // Only one thread measures at a time
+  {
+    ScopedLock l( lock );
+    if( busy || interval.getTime() < MEMORY_CHECK_INTERVAL ) return;
+    busy = true;
+    interval.start();
+  }
+
+  bool measured = true;
+  unsigned long size = getResidentMemory();
+  if( size == 0 ){
+    measured = false;
+    size = tileCache->getLocalMemorySize() + imagePool->getMemorySize() + imageCache->getMemorySize();
+  }
+
+  // Forget any memory we previously found we could not free once we are back within our limit
+  if( size <= limit ) ceiling = limit;
+
+  unsigned long evicted = 0;
+
+  if( size > ceiling ){
+
+    // Free enough to get a tenth below our ceiling, so that we do not evict after every request
+    unsigned long target = size - limit + limit / 10;
+    unsigned long tiles = tileCache->trim( target );
+    unsigned long handles = ( tiles < target ) ? imagePool->trim( target - tiles ) : 0;
+    unsigned long images = ( tiles + handles < target ) ? imageCache->trim( target - tiles - handles ) : 0;
+    evicted = tiles + handles + images;
+    releaseMemory();
+
+    if( loglevel >= 1 && evicted > 0 ){
+      *logfile << "MemoryLimit :: Memory use of " << size / 1048576 << "MB exceeds limit of "
+	       << limit / 1048576 << "MB: evicted " << tiles / 1048576 << "MB of tiles, "
+	       << handles / 1024 << "kB of open images and " << images / 1024 << "kB of image metadata" << endl;
+    }
+
+    // Should we still be over our limit, the rest of our memory is beyond the reach of our
+    // caches. Only evict again once we have grown by a tenth of our limit beyond it, rather
+    // than flushing our caches as soon as they refill
+    unsigned long remaining = measured ? getResidentMemory() : size - ( ( evicted < size ) ? evicted : size );
+    if( evicted == 0 || remaining > limit ){
+      ceiling = ( ( evicted == 0 || remaining == 0 ) ? size : remaining ) + limit / 10;
+      if( loglevel >= 1 ){
+	*logfile << "MemoryLimit :: Unable to free enough memory: " << ( ( evicted == 0 ) ? size : remaining ) / 1048576
+		 << "MB cannot be evicted. Next evicting above " << ceiling / 1048576 << "MB" << endl;
+      }
+    }
+  }
+
+  ScopedLock l( lock );
+  used = size;
+  if( evicted > 0 ){
+    trims++;
+    freed += evicted;
+  }
+  busy = false;
+}
@@ -0,0 +1,119 @@
+// Process-wide Memory Ceiling
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _MEMORYLIMIT_H
+#define _MEMORYLIMIT_H
+
+
+#include <fstream>
+#include "Task.h"
+#include "Mutex.h"
+#include "Timer.h"
+
+
+// Minimum interval in microseconds between measurements of our memory use
+#define MEMORY_CHECK_INTERVAL 100000
+
+
+
+/// Keeps our process within a memory ceiling by evicting from our caches
+/** Our workers check the memory use of the whole process after each request, at most
+    every MEMORY_CHECK_INTERVAL. This is the private resident memory where the operating
+    system provides it, which includes request buffers and allocator overhead, or
+    otherwise the accounted size of our own caches. Pages of our shared memory tile cache
+    and of memory mapped image files are excluded, as evicting from our caches cannot
+    free them. If the ceiling is exceeded, tiles are evicted from our tile cache,
+    followed if necessary by idle open image handles and then entries of our image
+    metadata cache, least recently used first, until we are a tenth below the ceiling.
+    The freed memory is then handed back to the operating system. Should that not be
+    enough, we only evict again once our memory has grown by a further tenth of the
+    ceiling, so that memory we cannot free does not flush our caches on every check.
+ */
+class MemoryLimit {
+
+ private:
+
+  /// Our ceiling in bytes and the size above which we next evict, which is raised above
+  /// our ceiling while we hold more memory than we are able to free
+  unsigned long limit;
+  unsigned long ceiling;
+
+  /// Our caches
+  Cache* tileCache;
+  ImageCache* imageCache;
+  ImagePool* imagePool;
+
+  /// Our log
+  int loglevel;
+  std::ofstream* logfile;
+
+  /// Memory use at our last measurement
+  unsigned long used;
+
+  /// Number of times we have had to evict and the number of bytes evicted
+  unsigned long trims;
+  unsigned long freed;
+
+  /// Whether a thread is currently checking and the time since our last check
+  bool busy;
+  Timer interval;
+
+  /// Lock protecting our state
+  Mutex lock;
+
+  /// Disallow copying
+  MemoryLimit( const MemoryLimit& );
+  MemoryLimit& operator = ( const MemoryLimit& );
+
+
+ public:
+
+  /// Constructor
+  /** @param max ceiling in MB
+      @param tileCache tile cache
+      @param imageCache image metadata cache
+      @param imagePool pool of open image handles
+      @param loglevel logging level
+      @param logfile log stream
+   */
+  MemoryLimit( float max, Cache* tileCache, ImageCache* imageCache, ImagePool* imagePool,
+	       int loglevel, std::ofstream* logfile );
+
+  /// Return the private resident memory of our process in bytes or 0 if this is unavailable
+  /** Pages shared with other processes or backed by files, such as those of our shared
+      memory tile cache or of memory mapped images, are excluded
+   */
+  static unsigned long getResidentMemory();
+
+  /// Check our memory use and evict from our caches if we are over our ceiling
+  void check();
+
+  /// Return our counters
+  unsigned long getLimit() const { return limit; };
+  unsigned long getUsed() { ScopedLock l( lock ); return used; };
+  unsigned long getTrims() { ScopedLock l( lock ); return trims; };
+  unsigned long getFreed() { ScopedLock l( lock ); return freed; };
+
+};
+
+
+#endif
@@ -0,0 +1,298 @@
+// Simple Mutex, reader-writer lock, condition variable and lock guard classes
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _MUTEX_H
+#define _MUTEX_H
+
+
+#include <ctime>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <cerrno>
+#endif
+
+
+
+/// Wrapper around a POSIX mutex. If no thread support is available, locking is a no-op
+
+class Mutex {
+
+ private:
+
+#ifdef HAVE_PTHREAD
+  /// The underlying pthread mutex
+  pthread_mutex_t mutex;
+#endif
+
+  /// Disallow copying
+  Mutex( const Mutex& );
+  Mutex& operator = ( const Mutex& );
+
+  /// Conditions need access to our underlying mutex
+  friend class Condition;
+
+
+ public:
+
+  /// Constructor
+  Mutex() {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init( &mutex, NULL );
+#endif
+  };
+
+  /// Destructor
+  ~Mutex() {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy( &mutex );
+#endif
+  };
+
+  /// Acquire the lock
+  void lock() {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock( &mutex );
+#endif
+  };
+
+  /// Release the lock
+  void unlock() {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock( &mutex );
+#endif
+  };
+
+};
+
+
+
+/// Wrapper around a POSIX condition variable. Without thread support, waiting returns immediately
+
+class Condition {
+
+ private:
+
+#ifdef HAVE_PTHREAD
+  /// The underlying pthread condition variable
+  pthread_cond_t cond;
+#endif
+
+  /// Disallow copying
+  Condition( const Condition& );
+  Condition& operator = ( const Condition& );
+
+
+ public:
+
+  /// Constructor
+  Condition() {
+#ifdef HAVE_PTHREAD
+    pthread_cond_init( &cond, NULL );
+#endif
+  };
+
+  /// Destructor
+  ~Condition() {
+#ifdef HAVE_PTHREAD
+    pthread_cond_destroy( &cond );
+#endif
+  };
+
+  /// Wait to be signalled
+  /** @param m Mutex, which must be locked by the caller and is released while waiting */
+  void wait( Mutex& m ) {
+#ifdef HAVE_PTHREAD
+    pthread_cond_wait( &cond, &m.mutex );
+#endif
+  };
+
+  /// Wait to be signalled or until a deadline
+  /** @param m Mutex, which must be locked by the caller and is released while waiting
+      @param deadline absolute time until which to wait
+      @return false if the deadline passed without our being signalled
+   */
+  bool wait( Mutex& m, const struct timespec& deadline ) {
+#ifdef HAVE_PTHREAD
+    return ( pthread_cond_timedwait( &cond, &m.mutex, &deadline ) != ETIMEDOUT );
+#else
+    return false;
+#endif
+  };
+
+  /// Wake up a single waiting thread
+  void signal() {
+#ifdef HAVE_PTHREAD
+    pthread_cond_signal( &cond );
+#endif
+  };
+
+  /// Wake up all waiting threads
+  void broadcast() {
+#ifdef HAVE_PTHREAD
+    pthread_cond_broadcast( &cond );
+#endif
+  };
+
+};
+
+
+
+/// Wrapper around a POSIX reader-writer lock, allowing many concurrent readers.
+/// If no thread support is available, locking is a no-op
+
+class RWLock {
+
+ private:
+
+#ifdef HAVE_PTHREAD
+  /// The underlying pthread reader-writer lock
+  pthread_rwlock_t rwlock;
+#endif
+
+  /// Disallow copying
+  RWLock( const RWLock& );
+  RWLock& operator = ( const RWLock& );
+
+
+ public:
+
+  /// Constructor
+  RWLock() {
+#ifdef HAVE_PTHREAD
+    pthread_rwlock_init( &rwlock, NULL );
+#endif
+  };
+
+  /// Destructor
+  ~RWLock() {
+#ifdef HAVE_PTHREAD
+    pthread_rwlock_destroy( &rwlock );
+#endif
+  };
+
+  /// Acquire a shared lock for reading
+  void readLock() {
+#ifdef HAVE_PTHREAD
+    pthread_rwlock_rdlock( &rwlock );
+#endif
+  };
+
+  /// Acquire an exclusive lock for writing
+  void writeLock() {
+#ifdef HAVE_PTHREAD
+    pthread_rwlock_wrlock( &rwlock );
+#endif
+  };
+
+  /// Release the lock
+  void unlock() {
+#ifdef HAVE_PTHREAD
+    pthread_rwlock_unlock( &rwlock );
+#endif
+  };
+
+};
+
+
+
+/// Scoped lock: acquires a Mutex on construction and releases it on destruction
+
+class ScopedLock {
+
+ private:
+
+  /// The mutex we are holding
+  Mutex& m;
+
+  /// Disallow copying
+  ScopedLock( const ScopedLock& );
+  ScopedLock& operator = ( const ScopedLock& );
+
+
+ public:
+
+  /// Constructor
+  /** @param mutex Mutex to lock for the lifetime of this object */
+  ScopedLock( Mutex& mutex ) : m( mutex ) { m.lock(); };
+
+  /// Destructor
+  ~ScopedLock() { m.unlock(); };
+
+};
+
+
+/// Scoped shared lock on a RWLock for the lifetime of the object
+
+class ScopedReadLock {
+
+ private:
+
+  /// The lock we are holding
+  RWLock& l;
+
+  /// Disallow copying
+  ScopedReadLock( const ScopedReadLock& );
+  ScopedReadLock& operator = ( const ScopedReadLock& );
+
+
+ public:
+
+  /// Constructor
+  /** @param lock RWLock to acquire for reading */
+  ScopedReadLock( RWLock& lock ) : l( lock ) { l.readLock(); };
+
+  /// Destructor
+  ~ScopedReadLock() { l.unlock(); };
+
+};
+
+
+
+/// Scoped exclusive lock on a RWLock for the lifetime of the object
+
+class ScopedWriteLock {
+
+ private:
+
+  /// The lock we are holding
+  RWLock& l;
+
+  /// Disallow copying
+  ScopedWriteLock( const ScopedWriteLock& );
+  ScopedWriteLock& operator = ( const ScopedWriteLock& );
+
+
+ public:
+
+  /// Constructor
+  /** @param lock RWLock to acquire for writing */
+  ScopedWriteLock( RWLock& lock ) : l( lock ) { l.writeLock(); };
+
+  /// Destructor
+  ~ScopedWriteLock() { l.unlock(); };
+
+};
+
+
+
+#endif
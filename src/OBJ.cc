@@ -20,6 +20,8 @@
 
 
 #include "Task.h"
+#include "MemoryLimit.h"
+#include "FileWatcher.h"
 #include <iostream>
 #include <algorithm>
 
@@ -52,6 +54,8 @@ void OBJ::run( Session* s, const std::string& a )
     colorspace( "*,*" );
   }
   else if( argument == "iip-server" ) iip_server();
+  // Server load and admission control counters
+  else if( argument == "server-status" ) server_status();
   // IIP optional commands
   else if( argument == "iip-opt-comm" ) session->response->addResponse( "IIP-opt-comm:CVT CNT QLT JTL JTLS WID HEI RGN MINMAX SHD CMP INV CTW" );
   // IIP optional objects
@@ -134,6 +138,78 @@ void OBJ::iip_server(){
 }
 
 
+void OBJ::server_status(){
+  Scheduler* scheduler = session->scheduler;
+  if( scheduler ){
+    session->response->addResponse( "Server-status/bulk-limit", (int) scheduler->getLimit() );
+    session->response->addResponse( "Server-status/bulk-running", (int) scheduler->getRunning() );
+    session->response->addResponse( "Server-status/bulk-queue-depth", (int) scheduler->getParked() );
+    session->response->addResponse( "Server-status/bulk-processed", (int) scheduler->getProcessed() );
+    session->response->addResponse( "Server-status/bulk-deferred", (int) scheduler->getDeferred() );
+  }
+
+  MemoryLimit* memory = session->memory;
+  if( memory && memory->getLimit() > 0 ){
+    session->response->addResponse( "Server-status/memory-limit", (int)( memory->getLimit() / 1048576 ) );
+    session->response->addResponse( "Server-status/memory-used", (int)( memory->getUsed() / 1048576 ) );
+    session->response->addResponse( "Server-status/memory-trims", (int) memory->getTrims() );
+    session->response->addResponse( "Server-status/memory-freed", (int)( memory->getFreed() / 1048576 ) );
+  }
+  if( memory && session->tileCache ){
+    session->response->addResponse( "Server-status/tile-cache-tiles", (int) session->tileCache->getNumElements() );
+    session->response->addResponse( "Server-status/tile-cache-size", (int) session->tileCache->getMemorySize() );
+  }
+  if( session->imageCache ){
+    ImageCache* images = session->imageCache;
+    session->response->addResponse( "Server-status/image-cache-entries", (int) images->size() );
+    session->response->addResponse( "Server-status/image-cache-size-kb", (int)( images->getMemorySize() / 1024 ) );
+    session->response->addResponse( "Server-status/image-cache-hits", (int) images->getHits() );
+    session->response->addResponse( "Server-status/image-cache-misses", (int) images->getMisses() );
+    session->response->addResponse( "Server-status/image-cache-negative-hits", (int) images->getNegativeHits() );
+  }
+  if( session->imagePool ){
+    ImagePool* pool = session->imagePool;
+    session->response->addResponse( "Server-status/open-images", (int) pool->size() );
+    session->response->addResponse( "Server-status/open-images-size-kb", (int)( pool->getMemorySize() / 1024 ) );
+    session->response->addResponse( "Server-status/open-images-hits", (int) pool->getHits() );
+    session->response->addResponse( "Server-status/open-images-misses", (int) pool->getMisses() );
+    session->response->addResponse( "Server-status/open-images-stale", (int) pool->getStale() );
+    FileWatcher* watcher = pool->getWatcher();
+    if( watcher ){
+      session->response->addResponse( "Server-status/file-watch-directories", (int) watcher->getWatches() );
+      session->response->addResponse( "Server-status/file-watch-events", (int) watcher->getEvents() );
+      session->response->addResponse( "Server-status/file-watch-overflows", (int) watcher->getOverflows() );
+    }
+  }
+
+  if( session->threadPool ){
+    session->response->addResponse( "Server-status/decoder-threads", (int) session->threadPool->size() );
+    session->response->addResponse( "Server-status/decoder-regions", (int) session->threadPool->getLoops() );
+  }
+
+  DiskCache* disk = session->tileCache ? session->tileCache->getDiskCache() : NULL;
+  if( disk ){
+    session->response->addResponse( "Server-status/disk-cache-tiles", (int) disk->getNumElements() );
+    session->response->addResponse( "Server-status/disk-cache-size", (int)( disk->getSize() / 1048576 ) );
+    session->response->addResponse( "Server-status/disk-cache-hits", (int) disk->getHits() );
+    session->response->addResponse( "Server-status/disk-cache-misses", (int) disk->getMisses() );
+    session->response->addResponse( "Server-status/disk-cache-writes", (int) disk->getWrites() );
+    session->response->addResponse( "Server-status/disk-cache-dropped", (int) disk->getDropped() );
+  }
+
+  AdmissionControl* admission = session->admission;
+  if( !admission ) return;
+  session->response->addResponse( "Server-status/admission-budget", (int)( admission->getBudget() / 1048576 ) );
+  session->response->addResponse( "Server-status/admission-concurrency", (int) admission->getConcurrency() );
+  session->response->addResponse( "Server-status/admission-memory-used", (int)( admission->getUsed() / 1048576 ) );
+  session->response->addResponse( "Server-status/admission-active", (int) admission->getActive() );
+  session->response->addResponse( "Server-status/admission-queue-depth", (int) admission->getWaiting() );
+  session->response->addResponse( "Server-status/admission-admitted", (int) admission->getAdmitted() );
+  session->response->addResponse( "Server-status/admission-delayed", (int) admission->getDelayed() );
+  session->response->addResponse( "Server-status/admission-shed", (int) admission->getShed() );
+}
+
+
 void OBJ::max_size(){
   checkImage();
   int x = (*session->image)->getImageWidth();
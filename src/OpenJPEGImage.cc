@@ -116,13 +116,19 @@ void OpenJPEGImage::loadImageInfo(int /*seq*/, int /*ang*/) throw(file_error)
           << flush;
 #endif
 
-  static opj_image_t* l_image; // Image structure
-  static opj_stream_t* l_stream; // File stream
-  static opj_codec_t* l_codec; // Handle to a decompressor
+  opj_image_t* l_image = NULL; // Image structure
+  opj_stream_t* l_stream = NULL; // File stream
+  opj_codec_t* l_codec = NULL; // Handle to a decompressor
 
   class Finally {
-    // This class makes sure that the resources are deallocated properly
+    // This class makes sure that the resources are deallocated properly.
+    // It holds references to our local handles as these must not be static
+    // if we are to be called concurrently from several threads
+    opj_image_t*& l_image;
+    opj_stream_t*& l_stream;
+    opj_codec_t*& l_codec;
   public:
+    Finally( opj_image_t*& i, opj_stream_t*& s, opj_codec_t*& c ) : l_image(i), l_stream(s), l_codec(c) {}
     ~Finally()
     {
       opj_end_decompress(l_codec, l_stream);
@@ -134,7 +140,7 @@ void OpenJPEGImage::loadImageInfo(int /*seq*/, int /*ang*/) throw(file_error)
       l_image = NULL;
     }
   };
-  Finally finally; // Allocated on stack, destructor is called on both successful and exceptional scope exit
+  Finally finally( l_image, l_stream, l_codec ); // Allocated on stack, destructor is called on both successful and exceptional scope exit
 
   l_codec = opj_create_decompress(OPJ_CODEC_JP2); // Create decompress codec
 
@@ -420,9 +426,9 @@ void OpenJPEGImage::process(unsigned int res, int layers,
                             unsigned int tw, unsigned int th, int tile,
                             void* d) throw(file_error)
 {
-  static opj_image_t* out_image; // Decoded image
-  static opj_stream_t* l_stream; // File stream
-  static opj_codec_t* l_codec; // Handle to a decompressor
+  opj_image_t* out_image = NULL; // Decoded image
+  opj_stream_t* l_stream = NULL; // File stream
+  opj_codec_t* l_codec = NULL; // Handle to a decompressor
 
   unsigned int factor = 1; // Downsampling factor - set it to default value
   int vipsres = (numResolutions - 1) - res; // Reverse resolution number
@@ -444,8 +450,14 @@ void OpenJPEGImage::process(unsigned int res, int layers,
   }
 
   class Finally {
-    // This class makes sure that the resources are deallocated properly
+    // This class makes sure that the resources are deallocated properly.
+    // It holds references to our local handles as these must not be static
+    // if we are to be called concurrently from several threads
+    opj_image_t*& out_image;
+    opj_stream_t*& l_stream;
+    opj_codec_t*& l_codec;
   public:
+    Finally( opj_image_t*& i, opj_stream_t*& s, opj_codec_t*& c ) : out_image(i), l_stream(s), l_codec(c) {}
     ~Finally()
     {
       opj_end_decompress(l_codec, l_stream);
@@ -458,7 +470,7 @@ void OpenJPEGImage::process(unsigned int res, int layers,
     }
   };
   // Allocated on stack, destructor is called on both successful and exceptional scope exit
-  Finally finally;
+  Finally finally( out_image, l_stream, l_codec );
 
   l_codec = opj_create_decompress(OPJ_CODEC_JP2); // Create decompress codec
   opj_set_info_handler(l_codec, info_callback, 00); // Set callback handlers
@@ -0,0 +1,316 @@
+// Pre-forking Worker Process Manager Member Functions
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "ProcessManager.h"
+
+#include <fcgiapp.h>
+#include <csignal>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+
+
+using namespace std;
+
+
+
+/* Signals received by our parent process. These are handled without SA_RESTART
+   so that they interrupt our waits
+*/
+static volatile sig_atomic_t restartRequested = 0;
+static volatile sig_atomic_t terminateRequested = 0;
+
+static void restartHandler( int signal ){ restartRequested = 1; }
+static void terminateHandler( int signal ){ terminateRequested = 1; }
+
+
+
+ProcessManager::ProcessManager( unsigned int p, bool a, int l, ofstream* f )
+{
+  processes = p;
+  affinity = a;
+  loglevel = l;
+  logfile = f;
+  reuseport = false;
+}
+
+
+
+int ProcessManager::openSocket( const string& host, const string& port, int backlog )
+{
+#ifdef SO_REUSEPORT
+  struct addrinfo hints;
+  struct addrinfo *result;
+  memset( &hints, 0, sizeof(hints) );
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  if( getaddrinfo( host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &result ) != 0 ) return -1;
+
+  int fd = socket( result->ai_family, result->ai_socktype, result->ai_protocol );
+  if( fd != -1 ){
+    int one = 1;
+    if( setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) ) == -1 ||
+	setsockopt( fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one) ) == -1 ||
+	bind( fd, result->ai_addr, result->ai_addrlen ) == -1 ||
+	::listen( fd, backlog ) == -1 ){
+      close( fd );
+      fd = -1;
+    }
+  }
+
+  freeaddrinfo( result );
+  return fd;
+#else
+  return -1;
+#endif
+}
+
+
+
+void ProcessManager::listen( const string& address, int backlog )
+{
+  // Give each worker its own socket for TCP addresses if the system supports SO_REUSEPORT
+  size_t colon = address.rfind( ':' );
+  if( colon != string::npos ){
+    string host = address.substr( 0, colon );
+    string port = address.substr( colon+1 );
+    for( unsigned int i = 0; i < processes; i++ ){
+      int fd = this->openSocket( host, port, backlog );
+      if( fd == -1 ) break;
+      sockets.push_back( fd );
+    }
+    if( sockets.size() == processes ){
+      reuseport = true;
+      return;
+    }
+    for( unsigned int i = 0; i < sockets.size(); i++ ) close( sockets[i] );
+    sockets.clear();
+  }
+
+  // Otherwise share a single socket between all our workers
+  int fd = FCGX_OpenSocket( address.c_str(), backlog );
+  if( fd < 0 ) throw string( "ProcessManager :: Unable to open socket '" + address + "'" );
+  sockets.push_back( fd );
+}
+
+
+
+int ProcessManager::run()
+{
+  struct sigaction sa;
+  memset( &sa, 0, sizeof(sa) );
+  sigemptyset( &sa.sa_mask );
+  sa.sa_handler = restartHandler;
+  sigaction( SIGHUP, &sa, NULL );
+  sa.sa_handler = terminateHandler;
+  sigaction( SIGTERM, &sa, NULL );
+  sigaction( SIGINT, &sa, NULL );
+  sigaction( SIGUSR1, &sa, NULL );
+
+  pids.assign( processes, 0 );
+  started.assign( processes, 0 );
+
+  if( loglevel >= 1 ){
+    *logfile << "Starting " << processes << " worker processes"
+	     << ( reuseport ? " with SO_REUSEPORT" : " sharing a single socket" )
+	     << ( affinity ? " pinned to CPUs" : "" ) << endl << endl;
+  }
+
+  int fd = this->respawn();
+  if( fd != -1 ) return fd;
+
+  // Supervise our workers until we are told to stop
+  while( true ){
+
+    if( terminateRequested ) this->terminate();
+
+    if( restartRequested ){
+      restartRequested = 0;
+      fd = this->restart();
+      if( fd != -1 ) return fd;
+    }
+
+    int status;
+    pid_t pid;
+    while( (pid = waitpid( -1, &status, WNOHANG )) > 0 ) this->reap( pid, status );
+
+    fd = this->respawn();
+    if( fd != -1 ) return fd;
+
+    // Any signal cuts this short
+    if( !terminateRequested && !restartRequested ) sleep( 1 );
+  }
+}
+
+
+
+int ProcessManager::spawn( unsigned int slot )
+{
+  logfile->flush();
+
+  pid_t pid = fork();
+  if( pid == -1 ){
+    if( loglevel >= 1 ) *logfile << "Unable to fork worker process: " << strerror( errno ) << endl;
+    return -1;
+  }
+
+  if( pid > 0 ){
+    pids[slot] = pid;
+    started[slot] = time( NULL );
+    if( loglevel >= 2 ) *logfile << "Started worker process " << pid << " in slot " << slot << endl;
+    return -1;
+  }
+
+  // We are now in the new worker: restore default signal handling and close the
+  // sockets of other slots
+  signal( SIGHUP, SIG_DFL );
+  signal( SIGTERM, SIG_DFL );
+  signal( SIGINT, SIG_DFL );
+  signal( SIGUSR1, SIG_DFL );
+
+  int fd = reuseport ? sockets[slot] : sockets[0];
+  for( unsigned int i = 0; i < sockets.size(); i++ ){
+    if( sockets[i] != fd ) close( sockets[i] );
+  }
+
+#ifdef HAVE_SCHED_SETAFFINITY
+  if( affinity ){
+    long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    if( cpus > 0 ){
+      cpu_set_t set;
+      CPU_ZERO( &set );
+      CPU_SET( slot % cpus, &set );
+      if( sched_setaffinity( 0, sizeof(set), &set ) == -1 && loglevel >= 1 ){
+	*logfile << "Unable to set CPU affinity for worker process " << getpid() << endl;
+      }
+    }
+  }
+#endif
+
+  return fd;
+}
+
+
+
+int ProcessManager::respawn()
+{
+  for( unsigned int slot = 0; slot < processes; slot++ ){
+    if( pids[slot] != 0 || terminateRequested ) continue;
+    // Don't restart a failing worker in a tight loop
+    if( started[slot] != 0 && time( NULL ) - started[slot] < 1 ) continue;
+    int fd = this->spawn( slot );
+    if( fd != -1 ) return fd;
+  }
+  return -1;
+}
+
+
+
+int ProcessManager::restart()
+{
+  if( loglevel >= 1 ) *logfile << "Restarting worker processes" << endl;
+
+  for( unsigned int slot = 0; slot < processes && !terminateRequested; slot++ ){
+
+    // Start the replacement first, so that there is always a worker listening
+    pid_t old = pids[slot];
+    pids[slot] = 0;
+    int fd = this->spawn( slot );
+    if( fd != -1 ) return fd;
+    if( old == 0 ) continue;
+
+    // Ask the old worker to finish its requests and exit, looking after any other workers meanwhile
+    kill( old, SIGHUP );
+    time_t start = time( NULL );
+    bool finished = false;
+
+    while( !finished && !terminateRequested ){
+      int status;
+      pid_t pid;
+      while( (pid = waitpid( -1, &status, WNOHANG )) > 0 ){
+	if( pid == old ) finished = true;
+	else this->reap( pid, status );
+      }
+      if( finished ) break;
+
+      if( time( NULL ) - start >= WORKER_RESTART_TIMEOUT ){
+	if( loglevel >= 1 ) *logfile << "Worker process " << old << " did not finish in time: killing" << endl;
+	kill( old, SIGKILL );
+	waitpid( old, &status, 0 );
+	break;
+      }
+      usleep( 100000 );
+    }
+
+    fd = this->respawn();
+    if( fd != -1 ) return fd;
+  }
+
+  return -1;
+}
+
+
+
+void ProcessManager::reap( pid_t pid, int status )
+{
+  for( unsigned int slot = 0; slot < processes; slot++ ){
+    if( pids[slot] == pid ){
+      pids[slot] = 0;
+      if( loglevel >= 1 ){
+	*logfile << "Worker process " << pid;
+	if( WIFSIGNALED(status) ) *logfile << " killed by signal " << WTERMSIG(status);
+	else *logfile << " exited with status " << WEXITSTATUS(status);
+	*logfile << ": restarting" << endl;
+      }
+      return;
+    }
+  }
+  if( loglevel >= 2 ) *logfile << "Retired worker process " << pid << " has exited" << endl;
+}
+
+
+
+void ProcessManager::terminate()
+{
+  if( loglevel >= 1 ) *logfile << "Stopping worker processes" << endl;
+
+  for( unsigned int slot = 0; slot < processes; slot++ ){
+    if( pids[slot] > 0 ) kill( pids[slot], SIGTERM );
+  }
+  while( waitpid( -1, NULL, 0 ) > 0 || errno == EINTR );
+
+  if( loglevel >= 1 ){
+    *logfile << "All worker processes stopped" << endl << endl;
+    logfile->close();
+  }
+
+  exit( 0 );
+}
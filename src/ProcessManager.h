@@ -0,0 +1,121 @@
+// Pre-forking Worker Process Manager
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _PROCESSMANAGER_H
+#define _PROCESSMANAGER_H
+
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <ctime>
+#include <sys/types.h>
+
+
+// Time in seconds to allow a worker to finish its requests during a restart
+#define WORKER_RESTART_TIMEOUT 60
+
+
+
+/// Forks and supervises a pool of worker processes in standalone mode
+/** For TCP sockets, each worker slot has its own listening socket bound to the same
+    address with SO_REUSEPORT, so that the kernel spreads connections across workers.
+    Otherwise all workers share a single socket. The sockets are held open by the parent,
+    so a worker that dies or is restarted is replaced by a new one listening on the same
+    socket and no queued connections are lost.
+
+    The parent respawns any worker that exits. On SIGHUP, it restarts each worker in turn:
+    a replacement is started before the old worker is sent SIGHUP, asking it to finish its
+    requests in progress and exit. SIGTERM, SIGINT and SIGUSR1 stop all workers.
+ */
+class ProcessManager {
+
+ private:
+
+  /// Number of workers and whether to pin each to a CPU
+  unsigned int processes;
+  bool affinity;
+
+  /// Our log
+  int loglevel;
+  std::ofstream* logfile;
+
+  /// Listening socket for each worker slot, or a single socket shared by all
+  std::vector<int> sockets;
+  bool reuseport;
+
+  /// Process ID and start time of the worker in each slot
+  std::vector<pid_t> pids;
+  std::vector<time_t> started;
+
+  /// Open a TCP listening socket with SO_REUSEPORT
+  /** @return socket or -1 on failure */
+  int openSocket( const std::string& host, const std::string& port, int backlog );
+
+  /// Fork a worker for a slot
+  /** @return -1 in the parent or the worker's listening socket in the new worker */
+  int spawn( unsigned int slot );
+
+  /// Start workers in any empty slots
+  /** @return -1 in the parent or the worker's listening socket in a new worker */
+  int respawn();
+
+  /// Restart each worker in turn
+  /** @return -1 in the parent or the worker's listening socket in a new worker */
+  int restart();
+
+  /// Handle the exit of a worker
+  void reap( pid_t pid, int status );
+
+  /// Stop all workers and exit
+  void terminate();
+
+
+ public:
+
+  /// Constructor
+  /** @param processes number of worker processes
+      @param affinity whether to pin each worker to a CPU
+      @param loglevel logging level
+      @param logfile log stream
+   */
+  ProcessManager( unsigned int processes, bool affinity, int loglevel, std::ofstream* logfile );
+
+  /// Open our listening sockets
+  /** @param address socket address as host:port, :port or a Unix socket path
+      @param backlog socket backlog
+   */
+  void listen( const std::string& address, int backlog );
+
+  /// Whether each worker has its own SO_REUSEPORT socket
+  bool reusePort() const { return reuseport; };
+
+  /// Fork our workers and supervise them
+  /** This only returns in a worker process. The parent exits once stopped.
+      @return listening socket for the worker to use
+   */
+  int run();
+
+};
+
+
+#endif
@@ -28,6 +28,10 @@
 #include <cstdlib>
 #include <ctime>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 
 
 /// Colour spaces - GREYSCALE, sRGB and CIELAB
@@ -40,10 +44,144 @@ enum CompressionType { UNCOMPRESSED, JPEG, DEFLATE, PNG };
 enum SampleType { FIXEDPOINT, FLOATINGPOINT };
 
 
+/// Allocate a data buffer of the appropriate type for a tile
+/** @param bpc bits per channel
+    @param sampleType sample format type
+    @param length size of the buffer in bytes
+ */
+inline void* allocateTileData( int bpc, SampleType sampleType, int length ){
+  switch( bpc ){
+    case 32:
+      if( sampleType == FLOATINGPOINT ) return new float[length/4];
+      else return new unsigned int[length/4];
+    case 16:
+      return new unsigned short[length/2];
+    default:
+      return new unsigned char[length];
+  }
+}
+
+
+/// Free a data buffer allocated with allocateTileData()
+inline void freeTileData( void* data, int bpc, SampleType sampleType ){
+  switch( bpc ){
+    case 32:
+      if( sampleType == FLOATINGPOINT ) delete[] (float*) data;
+      else delete[] (unsigned int*) data;
+      break;
+    case 16:
+      delete[] (unsigned short*) data;
+      break;
+    default:
+      delete[] (unsigned char*) data;
+      break;
+  }
+}
+
+
+
+/// Immutable, reference counted tile data
+/** Tiles held in our cache keep their data in a TileBuffer, so that a cache hit and any
+    further copies of the tile simply take another reference rather than copying the data.
+    The data must never be modified once it is shared: use RawTile::detach() first.
+ */
+class TileBuffer {
+
+ private:
+
+  volatile long references;
+  int bpc;
+  SampleType sampleType;
+
+  ~TileBuffer() { freeTileData( data, bpc, sampleType ); };
+
+  /// Disallow copying
+  TileBuffer( const TileBuffer& );
+  TileBuffer& operator = ( const TileBuffer& );
+
+
+ public:
+
+  /// The shared data
+  void* const data;
+
+  /// Constructor: takes ownership of data allocated with allocateTileData()
+  TileBuffer( void* d, int b, SampleType s ) : references( 1 ), bpc( b ), sampleType( s ), data( d ) {};
+
+  /// Take a reference
+  void retain() {
+#ifdef _MSC_VER
+    _InterlockedIncrement( &references );
+#else
+    __sync_add_and_fetch( &references, 1 );
+#endif
+  };
+
+  /// Release a reference, freeing the data once the last has gone
+  void release() {
+#ifdef _MSC_VER
+    if( _InterlockedDecrement( &references ) == 0 ) delete this;
+#else
+    if( __sync_sub_and_fetch( &references, 1 ) == 0 ) delete this;
+#endif
+  };
+
+};
+
+
+
 /// Class to represent a single image tile
 
 class RawTile{
 
+ private:
+
+  /// Copy all fields other than the data itself
+  void copyFields( const RawTile& tile ) {
+    tileNum = tile.tileNum;
+    resolution = tile.resolution;
+    hSequence = tile.hSequence;
+    vSequence = tile.vSequence;
+    compressionType = tile.compressionType;
+    quality = tile.quality;
+    filename = tile.filename;
+    timestamp = tile.timestamp;
+    dataLength = tile.dataLength;
+    width = tile.width;
+    height = tile.height;
+    channels = tile.channels;
+    bpc = tile.bpc;
+    sampleType = tile.sampleType;
+    padded = tile.padded;
+  }
+
+  /// Share the data of a tile if it is held in a TileBuffer or otherwise take a private copy
+  void copyData( const RawTile& tile ) {
+    if( tile.buffer ){
+      buffer = tile.buffer;
+      buffer->retain();
+      data = tile.data;
+      memoryManaged = 0;
+      return;
+    }
+    buffer = NULL;
+    memoryManaged = tile.memoryManaged;
+    data = tile.data ? allocateTileData( bpc, sampleType, dataLength ) : NULL;
+    if( data && (dataLength > 0) ){
+      memcpy( data, tile.data, dataLength );
+      memoryManaged = 1;
+    }
+  }
+
+  /// Free or release our data
+  void freeData() {
+    if( buffer ) buffer->release();
+    else if( data && memoryManaged ) freeTileData( data, bpc, sampleType );
+    buffer = NULL;
+    data = NULL;
+  }
+
+
  public:
 
   /// The tile number for this tile
@@ -78,6 +216,10 @@ class RawTile{
   /** This is used in the destructor to make sure we deallocate correctly */
   int memoryManaged;
 
+  /// Shared buffer holding our data or NULL if our data is not shared
+  /** If set, data points to the shared data, which must not be modified */
+  TileBuffer* buffer;
+
   /// The size of the data pointed to by data
   int dataLength;
 
@@ -112,7 +254,7 @@ class RawTile{
   */
   RawTile( int tn = 0, int res = 0, int hs = 0, int vs = 0,
 	   int w = 0, int h = 0, int c = 0, int b = 0 ) {
-    width = w; height = h; bpc = b; dataLength = 0; data = NULL;
+    width = w; height = h; bpc = b; dataLength = 0; data = NULL; buffer = NULL;
     tileNum = tn; resolution = res; hSequence = hs ; vSequence = vs;
     memoryManaged = 1; channels = c; compressionType = UNCOMPRESSED; quality = 0;
     timestamp = 0; sampleType = FIXEDPOINT; padded = false;
@@ -121,102 +263,93 @@ class RawTile{
 
   /// Destructor to free the data array if is has previously be allocated locally
   ~RawTile() {
-    if( data && memoryManaged ){
-      switch( bpc ){
-      case 32:
-        if( sampleType == FLOATINGPOINT ) delete[] (float*) data;
-        else delete[] (unsigned int*) data;
-        break;
-      case 16:
-	delete[] (unsigned short*) data;
-        break;
-      default:
-	delete[] (unsigned char*) data;
-        break;
-      }
-    }
+    this->freeData();
   }
 
 
-  /// Copy constructor - handles copying of data buffer
+  /// Copy constructor - shares the data of tiles with a TileBuffer and copies any others
   RawTile( const RawTile& tile ) {
+    this->copyFields( tile );
+    this->copyData( tile );
+  }
 
-    tileNum = tile.tileNum;
-    resolution = tile.resolution;
-    hSequence = tile.hSequence;
-    vSequence = tile.vSequence;
-    compressionType = tile.compressionType;
-    quality = tile.quality;
-    filename = tile.filename;
-    timestamp = tile.timestamp;
-    memoryManaged = tile.memoryManaged;
-    dataLength = tile.dataLength;
-    width = tile.width;
-    height = tile.height;
-    channels = tile.channels;
-    bpc = tile.bpc;
-    sampleType = tile.sampleType;
-    padded = tile.padded;
 
-    switch( bpc ){
-      case 32:
-	if( sampleType == FLOATINGPOINT ) data = new float[dataLength/4];
-	else data = new unsigned int[dataLength/4];
-	break;
-      case 16:
-	data = new unsigned short[dataLength/2];
-	break;
-      default:
-	data = new unsigned char[dataLength];
-	break;
-    }
+  /// Copy assignment constructor
+  RawTile& operator= ( const RawTile& tile ) {
 
-    if( data && (dataLength > 0) && tile.data ){
-      memcpy( data, tile.data, dataLength );
-      memoryManaged = 1;
-    }
+    if( this == &tile ) return *this;
+
+    // Free any data we already hold, as tiles may be re-used, for example when re-reading from the cache
+    this->freeData();
+    this->copyFields( tile );
+    this->copyData( tile );
+
+    return *this;
   }
 
 
-  /// Copy assignment constructor
-  RawTile& operator= ( const RawTile& tile ) {
+#if __cplusplus >= 201103L
+  /// Move constructor - takes over the data of a temporary tile
+  RawTile( RawTile&& tile ) {
+    this->copyFields( tile );
+    data = tile.data;
+    buffer = tile.buffer;
+    memoryManaged = tile.memoryManaged;
+    tile.data = NULL;
+    tile.buffer = NULL;
+  }
 
-    tileNum = tile.tileNum;
-    resolution = tile.resolution;
-    hSequence = tile.hSequence;
-    vSequence = tile.vSequence;
-    compressionType = tile.compressionType;
-    quality = tile.quality;
-    filename = tile.filename;
-    timestamp = tile.timestamp;
+
+  /// Move assignment
+  RawTile& operator= ( RawTile&& tile ) {
+    if( this == &tile ) return *this;
+    this->freeData();
+    this->copyFields( tile );
+    data = tile.data;
+    buffer = tile.buffer;
     memoryManaged = tile.memoryManaged;
-    dataLength = tile.dataLength;
-    width = tile.width;
-    height = tile.height;
-    channels = tile.channels;
-    bpc = tile.bpc;
-    sampleType = tile.sampleType;
-    padded = tile.padded;
+    tile.data = NULL;
+    tile.buffer = NULL;
+    return *this;
+  }
+#endif
 
-    switch( bpc ){
-      case 32:
-	if( sampleType == FLOATINGPOINT ) data = new float[dataLength/4];
-	else data = new int[dataLength/4];
-	break;
-      case 16:
-	data = new unsigned short[dataLength/2];
-	break;
-      default:
-	data = new unsigned char[dataLength];
-	break;
-    }
 
-    if( data && (dataLength > 0) && tile.data ){
-      memcpy( data, tile.data, dataLength );
-      memoryManaged = 1;
+  /// Make our data immutable and shareable, so that copies of this tile no longer copy the data
+  /** Data we own is handed over to a TileBuffer without copying */
+  void share() {
+    if( buffer || !data ) return;
+    if( !memoryManaged ){
+      void* d = allocateTileData( bpc, sampleType, dataLength );
+      memcpy( d, data, dataLength );
+      data = d;
     }
+    buffer = new TileBuffer( data, bpc, sampleType );
+    memoryManaged = 0;
+  }
 
-    return *this;
+
+  /// Take a private copy of any shared data so that it can be modified in place
+  void detach() {
+    if( !buffer ) return;
+    void* d = allocateTileData( bpc, sampleType, dataLength );
+    memcpy( d, data, dataLength );
+    buffer->release();
+    buffer = NULL;
+    data = d;
+    memoryManaged = 1;
+  }
+
+
+  /// Replace our data by a buffer allocated with allocateTileData(), which we then own
+  /** @param d new data
+      @param length size of the new data in bytes
+   */
+  void setData( void* d, int length ) {
+    this->freeData();
+    data = d;
+    dataLength = length;
+    memoryManaged = 1;
   }
 
 
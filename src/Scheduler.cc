@@ -0,0 +1,115 @@
+// Scheduling of Interactive and Bulk Requests Member Functions
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Scheduler.h"
+#include "Task.h"
+#include "Tokenizer.h"
+
+#include <cstdlib>
+#include <algorithm>
+
+
+using namespace std;
+
+
+
+Scheduler::Scheduler( unsigned int workers, unsigned int reserved )
+{
+  // Always leave at least one worker for bulk requests
+  if( reserved == 0 || workers < 2 ) limit = 0;
+  else if( reserved >= workers ) limit = 1;
+  else limit = workers - reserved;
+
+  running = 0;
+  processed = 0;
+  deferred = 0;
+}
+
+
+
+bool Scheduler::classify( const char* query )
+{
+  if( !query ) return false;
+
+  bool bulk = false;
+  bool sized = false;
+  bool small = true;
+
+  Tokenizer izer( query, "&" );
+  while( izer.hasMoreTokens() ){
+
+    string token = izer.nextToken();
+    size_t n = token.find_first_of( "=" );
+    if( n == string::npos ) continue;
+    string command = token.substr( 0, n );
+    string argument = token.substr( n+1 );
+    transform( command.begin(), command.end(), command.begin(), ::tolower );
+
+    // Note any explicit output size
+    if( command == "wid" || command == "hei" ){
+      sized = true;
+      if( atoi( argument.c_str() ) > INTERACTIVE_MAX_SIZE ) small = false;
+      continue;
+    }
+
+    Task* task = Task::factory( command );
+    if( task ){
+      if( task->bulk( argument ) ) bulk = true;
+      delete task;
+    }
+  }
+
+  return ( bulk && !( sized && small ) );
+}
+
+
+
+bool Scheduler::admit( void* request )
+{
+  ScopedLock l( lock );
+  if( running < limit || limit == 0 ){
+    running++;
+    processed++;
+    return true;
+  }
+  parked.push_back( request );
+  deferred++;
+  return false;
+}
+
+
+
+void* Scheduler::release()
+{
+  ScopedLock l( lock );
+
+  // Hand our place directly to the next parked request
+  if( !parked.empty() ){
+    void* request = parked.front();
+    parked.pop_front();
+    processed++;
+    return request;
+  }
+
+  running--;
+  return NULL;
+}
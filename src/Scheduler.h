@@ -0,0 +1,107 @@
+// Scheduling of Interactive and Bulk Requests
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+
+#include <deque>
+#include "Mutex.h"
+
+
+
+/// Keeps a share of our workers free for interactive tile requests
+/** Requests are classified as interactive, such as tile requests and small regions, or
+    as bulk, such as large CVT or IIIF exports. Only a limited number of workers may
+    process bulk requests at the same time. Any further bulk requests are parked in a
+    queue rather than occupying a worker, and are handed in order to the next worker to
+    finish a bulk request. The remaining workers are therefore always free to serve
+    interactive requests, however many exports are waiting.
+
+    Requests are opaque to the scheduler, so that it can hold FCGI requests or jobs from
+    our HTTP front end.
+ */
+class Scheduler {
+
+ private:
+
+  /// Maximum number of bulk requests processed at the same time or 0 for no limit
+  unsigned int limit;
+
+  /// Number of bulk requests being processed
+  unsigned int running;
+
+  /// Bulk requests waiting for a worker
+  std::deque<void*> parked;
+
+  /// Number of bulk requests processed and parked so far
+  unsigned long processed;
+  unsigned long deferred;
+
+  Mutex lock;
+
+  /// Disallow copying
+  Scheduler( const Scheduler& );
+  Scheduler& operator = ( const Scheduler& );
+
+
+ public:
+
+  /// Constructor
+  /** @param workers total number of workers
+      @param reserved number of workers reserved for interactive requests
+   */
+  Scheduler( unsigned int workers, unsigned int reserved );
+
+  /// Classify a request from its query string
+  /** Each command is checked through the Task created for it by Task::factory(). Region
+      requests with an explicit WID or HEI no larger than INTERACTIVE_MAX_SIZE are treated
+      as interactive thumbnails
+      @param query request query string
+      @return true for a bulk request
+   */
+  static bool classify( const char* query );
+
+  /// Whether we have a limit on bulk requests
+  bool enabled() const { return limit > 0; };
+
+  /// Admit a bulk request or park it until a worker becomes available
+  /** @param request the request
+      @return true if the request should be processed now or false if it has been parked
+   */
+  bool admit( void* request );
+
+  /// Finish a bulk request
+  /** @return a parked request, which the caller should now process in its place, or NULL */
+  void* release();
+
+  /// Return our counters
+  unsigned int getLimit() const { return limit; };
+  unsigned int getRunning() { ScopedLock l( lock ); return running; };
+  unsigned int getParked() { ScopedLock l( lock ); return parked.size(); };
+  unsigned long getProcessed() { ScopedLock l( lock ); return processed; };
+  unsigned long getDeferred() { ScopedLock l( lock ); return deferred; };
+
+};
+
+
+#endif
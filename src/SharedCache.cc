@@ -0,0 +1,679 @@
+// Shared Memory Tile Cache Class Member Functions
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "SharedCache.h"
+
+#include <cstring>
+#include <cerrno>
+
+#if defined(HAVE_SHM) && defined(HAVE_PTHREAD)
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#endif
+
+
+using namespace std;
+
+
+// Magic number and layout version of our segment
+#define SHM_MAGIC 0x49495043
+#define SHM_VERSION 2
+
+// Page size and smallest chunk size. Chunk offsets are stored in units of the smallest chunk
+#define SHM_PAGE_SIZE 1048576
+#define SHM_MIN_CHUNK 1024
+#define SHM_CLASSES 11
+
+// Number of tiles that can be marked as in-flight at once and the time in seconds after which
+// such a claim is considered stale
+#define SHM_FLIGHTS 256
+#define SHM_FLIGHT_TIMEOUT 30
+
+// Null offset used to mark empty index slots, unassigned pages and the end of free lists
+#define SHM_NONE 0xFFFFFFFF
+
+
+
+/// Tile currently being produced: hash of its key, the process producing it and when it started
+struct SharedCache::Flight {
+  uint64_t hash;
+  int32_t pid;
+  int32_t unused;
+  int64_t started;
+};
+
+
+/// Segment header
+struct SharedCache::Header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;
+  uint32_t numPages;
+  uint32_t indexSize;
+  uint32_t nextPage;                   // Next page that has never been assigned
+  uint32_t pageHand;                   // Next page to reclaim for another size class
+  uint32_t freeList[SHM_CLASSES];      // Free chunks for each size class
+  uint32_t clockHand[SHM_CLASSES];     // CLOCK position for each size class
+  uint64_t entries;
+  uint64_t bytes;
+  Flight flights[SHM_FLIGHTS];
+#if defined(HAVE_SHM) && defined(HAVE_PTHREAD)
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;                 // Signalled whenever an in-flight tile is released
+#endif
+};
+
+
+/// Index slot: hash of the key and offset of the chunk holding the tile
+struct SharedCache::Slot {
+  uint64_t hash;
+  uint32_t chunk;
+  uint32_t unused;
+};
+
+
+/// Chunk header, followed by the key and then the tile data
+struct SharedCache::Chunk {
+  uint64_t hash;
+  uint32_t next;                       // Next free chunk if on a free list
+  uint8_t used;
+  uint8_t referenced;
+  uint16_t keyLength;
+  uint32_t dataLength;
+  int32_t width;
+  int32_t height;
+  int32_t channels;
+  int32_t bpc;
+  int32_t sampleType;
+  int32_t compressionType;
+  int32_t quality;
+  int32_t padded;
+  int64_t timestamp;
+};
+
+
+
+/// 64 bit FNV-1a hash of a key
+static uint64_t hashKey( const string& key )
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for( string::const_iterator i = key.begin(); i != key.end(); ++i ){
+    hash = ( hash ^ (unsigned char)(*i) ) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+
+/// Chunk size in bytes of a size class
+static inline uint32_t classSize( unsigned int c ){ return SHM_MIN_CHUNK << c; }
+
+
+
+SharedCache::Chunk* SharedCache::_chunk( uint32_t offset ) const
+{
+  return (Chunk*)( arena + (size_t)offset * SHM_MIN_CHUNK );
+}
+
+
+
+long SharedCache::_find( const string& key, uint64_t hash ) const
+{
+  unsigned long mask = header->indexSize - 1;
+  unsigned long i = hash & mask;
+
+  while( index[i].chunk != SHM_NONE ){
+    if( index[i].hash == hash ){
+      Chunk *c = this->_chunk( index[i].chunk );
+      if( c->keyLength == key.length() &&
+	  memcmp( (unsigned char*)c + sizeof(Chunk), key.data(), c->keyLength ) == 0 ) return i;
+    }
+    i = (i+1) & mask;
+  }
+  return -1;
+}
+
+
+
+void SharedCache::_removeSlot( unsigned long slot )
+{
+  // Backward shift deletion for linear probing: move any following entries whose
+  // probe sequence passes through the freed slot back into it
+  unsigned long mask = header->indexSize - 1;
+  unsigned long i = slot;
+  unsigned long j = slot;
+
+  while( true ){
+    index[i].chunk = SHM_NONE;
+    while( true ){
+      j = (j+1) & mask;
+      if( index[j].chunk == SHM_NONE ) return;
+      unsigned long k = index[j].hash & mask;
+      // Leave entries whose home slot lies cyclically within (i,j]
+      if( (i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)) ) continue;
+      break;
+    }
+    index[i] = index[j];
+    i = j;
+  }
+}
+
+
+
+void SharedCache::_release( uint32_t offset )
+{
+  Chunk *c = this->_chunk( offset );
+  if( !c->used ) return;
+
+  string key( (char*)c + sizeof(Chunk), c->keyLength );
+  long slot = this->_find( key, c->hash );
+  if( slot >= 0 ) this->_removeSlot( slot );
+
+  header->entries--;
+  header->bytes -= c->dataLength;
+  c->used = 0;
+  c->referenced = 0;
+}
+
+
+
+void SharedCache::_carve( uint32_t page, unsigned int sizeClass )
+{
+  pages[page] = sizeClass;
+  uint32_t step = classSize( sizeClass ) / SHM_MIN_CHUNK;
+  uint32_t first = page * (SHM_PAGE_SIZE / SHM_MIN_CHUNK);
+  uint32_t last = first + (SHM_PAGE_SIZE / SHM_MIN_CHUNK);
+
+  for( uint32_t offset = first; offset < last; offset += step ){
+    Chunk *c = this->_chunk( offset );
+    c->used = 0;
+    c->referenced = 0;
+    c->next = header->freeList[sizeClass];
+    header->freeList[sizeClass] = offset;
+  }
+}
+
+
+
+uint32_t SharedCache::_evict( unsigned int sizeClass )
+{
+  uint32_t perPage = SHM_PAGE_SIZE / SHM_MIN_CHUNK;
+  uint32_t step = classSize( sizeClass ) / SHM_MIN_CHUNK;
+  uint32_t total = header->numPages * perPage;
+  uint32_t hand = header->clockHand[sizeClass];
+  if( hand >= total ) hand = 0;
+
+  // Two full passes are enough to find an unreferenced chunk
+  for( uint32_t n = 0; n < 2 * total; ){
+
+    uint32_t page = hand / perPage;
+
+    // Skip pages belonging to other size classes
+    if( pages[page] != sizeClass ){
+      hand = ( (page+1) % header->numPages ) * perPage;
+      n += perPage;
+      continue;
+    }
+
+    uint32_t offset = hand;
+    hand += step;
+    if( hand >= total ) hand = 0;
+    n += step;
+
+    Chunk *c = this->_chunk( offset );
+    if( c->used && c->referenced ){
+      c->referenced = 0;
+      continue;
+    }
+    if( c->used ) this->_release( offset );
+    header->clockHand[sizeClass] = hand;
+    return offset;
+  }
+
+  header->clockHand[sizeClass] = hand;
+  return SHM_NONE;
+}
+
+
+
+uint32_t SharedCache::_steal( unsigned int sizeClass )
+{
+  uint32_t perPage = SHM_PAGE_SIZE / SHM_MIN_CHUNK;
+  uint32_t page = header->pageHand % header->numPages;
+  header->pageHand = (page + 1) % header->numPages;
+
+  unsigned int old = pages[page];
+  uint32_t first = page * perPage;
+  uint32_t last = first + perPage;
+
+  if( old < SHM_CLASSES ){
+    // Evict all tiles in this page
+    uint32_t step = classSize( old ) / SHM_MIN_CHUNK;
+    for( uint32_t offset = first; offset < last; offset += step ) this->_release( offset );
+
+    // Rebuild the free list of the old class without the chunks of this page
+    uint32_t *link = &header->freeList[old];
+    while( *link != SHM_NONE ){
+      if( *link >= first && *link < last ) *link = this->_chunk( *link )->next;
+      else link = &( this->_chunk( *link )->next );
+    }
+  }
+
+  this->_carve( page, sizeClass );
+  uint32_t offset = header->freeList[sizeClass];
+  header->freeList[sizeClass] = this->_chunk( offset )->next;
+  return offset;
+}
+
+
+
+uint32_t SharedCache::_allocate( unsigned int sizeClass )
+{
+  // Use a free chunk if we have one
+  uint32_t offset = header->freeList[sizeClass];
+  if( offset != SHM_NONE ){
+    header->freeList[sizeClass] = this->_chunk( offset )->next;
+    return offset;
+  }
+
+  // Otherwise assign a new page to this size class if any remain
+  if( header->nextPage < header->numPages ){
+    this->_carve( header->nextPage++, sizeClass );
+    offset = header->freeList[sizeClass];
+    header->freeList[sizeClass] = this->_chunk( offset )->next;
+    return offset;
+  }
+
+  // Otherwise evict a tile of the same size class or take a page from another class
+  offset = this->_evict( sizeClass );
+  if( offset == SHM_NONE ) offset = this->_steal( sizeClass );
+  return offset;
+}
+
+
+
+#if defined(HAVE_SHM) && defined(HAVE_PTHREAD)
+
+
+void SharedCache::_lock()
+{
+  // If another process died while holding the lock, take it over
+  if( pthread_mutex_lock( &header->mutex ) == EOWNERDEAD ){
+    pthread_mutex_consistent( &header->mutex );
+  }
+}
+
+
+void SharedCache::_unlock()
+{
+  pthread_mutex_unlock( &header->mutex );
+}
+
+
+
+SharedCache::SharedCache( const string& n, float max ) :
+  name( n ), base( NULL ), size( 0 ), header( NULL ), pages( NULL ), index( NULL ), arena( NULL )
+{
+  int fd = shm_open( name.c_str(), O_RDWR | O_CREAT, 0600 );
+  if( fd == -1 ) throw string( "SharedCache :: Unable to open shared memory object " + name + ": " + strerror(errno) );
+
+  // Serialize creation between processes starting at the same time
+  flock( fd, LOCK_EX );
+
+  struct stat sb;
+  if( fstat( fd, &sb ) == -1 ){
+    close( fd );
+    throw string( "SharedCache :: Unable to stat shared memory object " + name );
+  }
+
+  bool create = ( sb.st_size == 0 );
+
+  if( create ){
+    // Work out our layout: each page needs at most one index entry per smallest chunk
+    // and we keep the index at most half full
+    uint32_t numPages = (uint32_t)( max * 1048576 / SHM_PAGE_SIZE );
+    if( numPages < 1 ) numPages = 1;
+    uint32_t indexSize = 1;
+    while( indexSize < 2 * numPages * (SHM_PAGE_SIZE / SHM_MIN_CHUNK) ) indexSize <<= 1;
+
+    size_t offset = sizeof(Header) + numPages * sizeof(uint32_t);
+    offset = ( offset + 63 ) & ~((size_t)63);
+    offset += indexSize * sizeof(Slot);
+    offset = ( offset + 4095 ) & ~((size_t)4095);
+    size = offset + (size_t) numPages * SHM_PAGE_SIZE;
+
+    if( ftruncate( fd, size ) == -1 ){
+      flock( fd, LOCK_UN );
+      close( fd );
+      shm_unlink( name.c_str() );
+      throw string( "SharedCache :: Unable to size shared memory object " + name + ": " + strerror(errno) );
+    }
+  }
+  else size = sb.st_size;
+
+  void *addr = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  if( addr == MAP_FAILED ){
+    flock( fd, LOCK_UN );
+    close( fd );
+    throw string( "SharedCache :: Unable to map shared memory object " + name + ": " + strerror(errno) );
+  }
+  base = (unsigned char*) addr;
+  header = (Header*) base;
+
+  if( create ){
+
+    memset( header, 0, sizeof(Header) );
+    header->size = size;
+    header->numPages = (uint32_t)( max * 1048576 / SHM_PAGE_SIZE );
+    if( header->numPages < 1 ) header->numPages = 1;
+    header->indexSize = 1;
+    while( header->indexSize < 2 * header->numPages * (SHM_PAGE_SIZE / SHM_MIN_CHUNK) ) header->indexSize <<= 1;
+    header->nextPage = 0;
+    header->pageHand = 0;
+    for( unsigned int i = 0; i < SHM_CLASSES; i++ ){
+      header->freeList[i] = SHM_NONE;
+      header->clockHand[i] = 0;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init( &attr );
+    pthread_mutexattr_setpshared( &attr, PTHREAD_PROCESS_SHARED );
+    pthread_mutexattr_setrobust( &attr, PTHREAD_MUTEX_ROBUST );
+    pthread_mutex_init( &header->mutex, &attr );
+    pthread_mutexattr_destroy( &attr );
+
+    pthread_condattr_t cattr;
+    pthread_condattr_init( &cattr );
+    pthread_condattr_setpshared( &cattr, PTHREAD_PROCESS_SHARED );
+    pthread_cond_init( &header->cond, &cattr );
+    pthread_condattr_destroy( &cattr );
+  }
+  else if( header->magic != SHM_MAGIC || header->version != SHM_VERSION || header->size != size ){
+    munmap( base, size );
+    flock( fd, LOCK_UN );
+    close( fd );
+    throw string( "SharedCache :: Incompatible shared memory object " + name );
+  }
+
+  // Set up our pointers into the segment
+  size_t offset = sizeof(Header);
+  pages = (uint32_t*)( base + offset );
+  offset += header->numPages * sizeof(uint32_t);
+  offset = ( offset + 63 ) & ~((size_t)63);
+  index = (Slot*)( base + offset );
+  offset += header->indexSize * sizeof(Slot);
+  offset = ( offset + 4095 ) & ~((size_t)4095);
+  arena = base + offset;
+
+  if( create ){
+    for( uint32_t i = 0; i < header->numPages; i++ ) pages[i] = SHM_NONE;
+    for( uint32_t i = 0; i < header->indexSize; i++ ) index[i].chunk = SHM_NONE;
+    // Only mark the segment as valid once it has been fully initialised
+    header->version = SHM_VERSION;
+    header->magic = SHM_MAGIC;
+  }
+
+  flock( fd, LOCK_UN );
+  close( fd );
+}
+
+
+
+SharedCache::~SharedCache()
+{
+  if( base ) munmap( base, size );
+}
+
+
+
+bool SharedCache::acquire( const string& key )
+{
+  uint64_t hash = hashKey( key );
+  int32_t pid = getpid();
+  bool waited = false;
+
+  this->_lock();
+
+  while( true ){
+
+    // If we have been waiting and the tile has now arrived, there is nothing more to do
+    if( waited && this->_find( key, hash ) >= 0 ){
+      this->_unlock();
+      return false;
+    }
+
+    int match = -1, available = -1;
+    for( int i = 0; i < SHM_FLIGHTS; i++ ){
+      if( header->flights[i].pid == 0 ){
+	if( available < 0 ) available = i;
+      }
+      else if( header->flights[i].hash == hash ){
+	match = i;
+	break;
+      }
+    }
+
+    time_t now = time( NULL );
+
+    // Nobody else is producing this tile, so claim it. If our table is full,
+    // simply go ahead without coalescing
+    if( match < 0 ){
+      if( available >= 0 ){
+	header->flights[available].hash = hash;
+	header->flights[available].pid = pid;
+	header->flights[available].started = now;
+      }
+      this->_unlock();
+      return true;
+    }
+
+    // Take over claims left by processes that have died or taken far too long
+    Flight& flight = header->flights[match];
+    if( ( kill( flight.pid, 0 ) == -1 && errno == ESRCH ) || ( now - flight.started > SHM_FLIGHT_TIMEOUT ) ){
+      flight.pid = pid;
+      flight.started = now;
+      this->_unlock();
+      return true;
+    }
+
+    // Otherwise wait for a tile to be released, waking up regularly to check on its owner
+    struct timespec ts;
+    clock_gettime( CLOCK_REALTIME, &ts );
+    ts.tv_nsec += 100000000;
+    if( ts.tv_nsec >= 1000000000 ){
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    if( pthread_cond_timedwait( &header->cond, &header->mutex, &ts ) == EOWNERDEAD ){
+      pthread_mutex_consistent( &header->mutex );
+    }
+    waited = true;
+  }
+}
+
+
+
+void SharedCache::release( const string& key )
+{
+  uint64_t hash = hashKey( key );
+  int32_t pid = getpid();
+
+  this->_lock();
+  for( int i = 0; i < SHM_FLIGHTS; i++ ){
+    if( header->flights[i].pid == pid && header->flights[i].hash == hash ){
+      header->flights[i].pid = 0;
+      break;
+    }
+  }
+  pthread_cond_broadcast( &header->cond );
+  this->_unlock();
+}
+
+
+#else
+
+
+// Without shared memory and process-shared mutex support, this backend is unavailable
+
+void SharedCache::_lock(){}
+void SharedCache::_unlock(){}
+
+SharedCache::SharedCache( const string& n, float max ) :
+  name( n ), base( NULL ), size( 0 ), header( NULL ), pages( NULL ), index( NULL ), arena( NULL )
+{
+  throw string( "SharedCache :: Shared memory not supported on this platform" );
+}
+
+SharedCache::~SharedCache(){}
+
+bool SharedCache::acquire( const string& key ){ return true; }
+void SharedCache::release( const string& key ){}
+
+
+#endif
+
+
+
+void SharedCache::insert( const string& key, const RawTile& r )
+{
+  // Find the size class for this tile
+  size_t needed = sizeof(Chunk) + key.length() + r.dataLength;
+  unsigned int sizeClass = 0;
+  while( sizeClass < SHM_CLASSES && classSize( sizeClass ) < needed ) sizeClass++;
+  if( sizeClass == SHM_CLASSES || key.length() > 0xFFFF ) return;
+
+  uint64_t hash = hashKey( key );
+
+  this->_lock();
+
+  // Check whether this tile already exists and whether it is up to date
+  long slot = this->_find( key, hash );
+  if( slot >= 0 ){
+    Chunk *c = this->_chunk( index[slot].chunk );
+    if( c->timestamp >= (int64_t) r.timestamp ){
+      c->referenced = 1;
+      this->_unlock();
+      return;
+    }
+    this->_release( index[slot].chunk );
+  }
+
+  uint32_t offset = this->_allocate( sizeClass );
+  if( offset == SHM_NONE ){
+    this->_unlock();
+    return;
+  }
+
+  // Fill in our chunk
+  Chunk *c = this->_chunk( offset );
+  c->hash = hash;
+  c->next = SHM_NONE;
+  c->used = 1;
+  c->referenced = 0;
+  c->keyLength = key.length();
+  c->dataLength = r.dataLength;
+  c->width = r.width;
+  c->height = r.height;
+  c->channels = r.channels;
+  c->bpc = r.bpc;
+  c->sampleType = r.sampleType;
+  c->compressionType = r.compressionType;
+  c->quality = r.quality;
+  c->padded = r.padded;
+  c->timestamp = r.timestamp;
+  memcpy( (unsigned char*)c + sizeof(Chunk), key.data(), key.length() );
+  memcpy( (unsigned char*)c + sizeof(Chunk) + key.length(), r.data, r.dataLength );
+
+  // And add it to our index
+  unsigned long mask = header->indexSize - 1;
+  unsigned long i = hash & mask;
+  while( index[i].chunk != SHM_NONE ) i = (i+1) & mask;
+  index[i].hash = hash;
+  index[i].chunk = offset;
+
+  header->entries++;
+  header->bytes += r.dataLength;
+
+  this->_unlock();
+}
+
+
+
+bool SharedCache::getTile( const string& key, RawTile& tile )
+{
+  uint64_t hash = hashKey( key );
+
+  this->_lock();
+
+  long slot = this->_find( key, hash );
+  if( slot < 0 ){
+    this->_unlock();
+    return false;
+  }
+
+  Chunk *c = this->_chunk( index[slot].chunk );
+  c->referenced = 1;
+
+  // Copy out our tile, freeing any existing data our tile may hold
+  tile = RawTile();
+  tile.data = new unsigned char[c->dataLength];
+  memcpy( tile.data, (unsigned char*)c + sizeof(Chunk) + c->keyLength, c->dataLength );
+  tile.memoryManaged = 1;
+  tile.dataLength = c->dataLength;
+  tile.width = c->width;
+  tile.height = c->height;
+  tile.channels = c->channels;
+  tile.bpc = c->bpc;
+  tile.sampleType = (SampleType) c->sampleType;
+  tile.compressionType = (CompressionType) c->compressionType;
+  tile.quality = c->quality;
+  tile.padded = c->padded;
+  tile.timestamp = c->timestamp;
+
+  this->_unlock();
+  return true;
+}
+
+
+
+unsigned int SharedCache::getNumElements()
+{
+  this->_lock();
+  unsigned int n = header->entries;
+  this->_unlock();
+  return n;
+}
+
+
+
+unsigned long SharedCache::getMemorySize()
+{
+  this->_lock();
+  unsigned long n = header->bytes;
+  this->_unlock();
+  return n;
+}
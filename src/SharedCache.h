@@ -0,0 +1,159 @@
+// Shared Memory Tile Cache Class
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+
+#ifndef _SHAREDCACHE_H
+#define _SHAREDCACHE_H
+
+
+#include <string>
+#include <stdint.h>
+#include "RawTile.h"
+
+
+
+/// Tile cache held in a POSIX shared memory segment and shared between iipsrv processes
+/** The segment is divided into a header, an open-addressing hash index and an arena
+ *  of fixed-size pages. Pages are assigned on demand to a slab size class (powers of
+ *  two from 1kB up to the page size) and split into chunks, each of which holds a single
+ *  encoded tile together with its key and metadata. When a size class runs out of space,
+ *  a chunk is evicted using the CLOCK algorithm or, if the class has no pages at all,
+ *  a whole page is reclaimed from another class. Access is serialized by a robust
+ *  process-shared mutex held within the segment itself, so every process attached to
+ *  the same segment sees every other process's tiles. The segment also records which
+ *  tiles are currently being produced, so that concurrent misses for the same tile
+ *  across processes can wait for a single decode.
+ */
+
+class SharedCache {
+
+
+ private:
+
+  /// Segment header, index slot, chunk header and in-flight tile layouts - see SharedCache.cc
+  struct Header;
+  struct Slot;
+  struct Chunk;
+  struct Flight;
+
+  /// Name of our shared memory object
+  std::string name;
+
+  /// Base address and size of our mapping
+  unsigned char *base;
+  size_t size;
+
+  /// Pointers into our mapping
+  Header *header;
+  uint32_t *pages;
+  Slot *index;
+  unsigned char *arena;
+
+
+  /// Return the chunk at a given offset within the arena
+  Chunk* _chunk( uint32_t offset ) const;
+
+  /// Find the index slot for a key
+  /** @param key the key
+      @param hash hash of the key
+      @return slot number or -1 if not found
+   */
+  long _find( const std::string& key, uint64_t hash ) const;
+
+  /// Remove an entry from the index, closing up the probe sequence behind it
+  void _removeSlot( unsigned long slot );
+
+  /// Remove the entry stored in a chunk from the index and mark the chunk as unused
+  void _release( uint32_t offset );
+
+  /// Split a page into free chunks of a given size class
+  void _carve( uint32_t page, unsigned int sizeClass );
+
+  /// Allocate a chunk of a given size class, evicting other tiles if necessary
+  /** @return chunk offset or the null offset if nothing could be allocated */
+  uint32_t _allocate( unsigned int sizeClass );
+
+  /// Evict a tile using the CLOCK algorithm within the pages of a size class
+  uint32_t _evict( unsigned int sizeClass );
+
+  /// Take a page away from another size class
+  uint32_t _steal( unsigned int sizeClass );
+
+  /// Lock and unlock our process-shared mutex
+  void _lock();
+  void _unlock();
+
+  /// Disallow copying
+  SharedCache( const SharedCache& );
+  SharedCache& operator = ( const SharedCache& );
+
+
+ public:
+
+  /// Constructor: create or attach to a shared memory segment
+  /** @param name name of the POSIX shared memory object
+      @param max size of the segment in MB if it needs to be created
+   */
+  SharedCache( const std::string& name, float max );
+
+  /// Destructor - unmaps the segment, which remains available to other processes
+  ~SharedCache();
+
+  /// Insert a tile
+  /** @param key cache index for this tile
+      @param r tile to be inserted
+   */
+  void insert( const std::string& key, const RawTile& r );
+
+  /// Get a tile
+  /** @param key cache index of the tile
+      @param tile RawTile into which the cached tile is copied
+      @return true if the tile was found
+   */
+  bool getTile( const std::string& key, RawTile& tile );
+
+  /// Claim the right to produce a missing tile
+  /** If another thread or process is already producing this tile, wait for it to
+      finish and return false. Claims held by processes that have died or that have
+      taken longer than a timeout are taken over.
+      @param key cache index of the tile
+      @return true if the caller should produce the tile and then call release()
+   */
+  bool acquire( const std::string& key );
+
+  /// Release a claim made with acquire() and wake up any waiting processes
+  /** @param key cache index of the tile */
+  void release( const std::string& key );
+
+  /// Return the number of tiles in the shared cache
+  unsigned int getNumElements();
+
+  /// Return the number of bytes of tile data stored
+  unsigned long getMemorySize();
+
+  /// Return the total size of the segment in bytes
+  size_t getSize() const { return size; };
+
+};
+
+
+#endif
@@ -0,0 +1,300 @@
+// Selectable I/O Layer for TIFF Images Member Functions
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "TIFFIO.h"
+
+#ifndef WIN32
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+using namespace std;
+
+
+TIFFIOMode TIFFIO::mode = TIFFIO_LIBTIFF;
+
+
+
+#ifndef WIN32
+
+
+/// An open file, passed to our callbacks as libtiff's client data
+struct TIFFFile {
+
+  /// A cached block of a file read with direct I/O
+  struct Block {
+    uint64_t index;          // Block number within our file
+    unsigned char* data;     // Aligned block buffer
+    unsigned int length;     // Number of bytes read, which is short at the end of our file
+    unsigned long used;      // Our clock when last used
+  };
+
+  int fd;
+  TIFFIOMode mode;
+  uint64_t size;
+  uint64_t position;
+  unsigned char* map;
+  vector<Block> blocks;
+  unsigned long clock;
+
+  TIFFFile() : fd( -1 ), mode( TIFFIO_PREAD ), size( 0 ), position( 0 ), map( NULL ), clock( 0 ) {};
+
+  ~TIFFFile(){
+    if( map ) munmap( map, size );
+    if( fd >= 0 ) ::close( fd );
+    for( unsigned int i = 0; i < blocks.size(); i++ ) free( blocks[i].data );
+  };
+
+  /// Return a block, reading it if we do not hold it, or NULL on error
+  Block* block( uint64_t index );
+};
+
+
+
+TIFFFile::Block* TIFFFile::block( uint64_t index )
+{
+  clock++;
+
+  Block* lru = NULL;
+  for( unsigned int i = 0; i < blocks.size(); i++ ){
+    if( blocks[i].index == index ){
+      blocks[i].used = clock;
+      return &blocks[i];
+    }
+    if( !lru || blocks[i].used < lru->used ) lru = &blocks[i];
+  }
+
+  // Take a new buffer until we have our full number, then replace our least recently used block
+  if( blocks.size() < DIRECT_IO_BLOCKS ){
+    void* data;
+    if( posix_memalign( &data, 4096, DIRECT_IO_BLOCK_SIZE ) != 0 ) return NULL;
+    Block b = { 0, (unsigned char*) data, 0, 0 };
+    blocks.push_back( b );
+    lru = &blocks.back();
+  }
+
+  // Direct reads must be of whole aligned blocks, so only the last block of our file is short
+  ssize_t n;
+  do n = pread( fd, lru->data, DIRECT_IO_BLOCK_SIZE, (off_t) ( index * DIRECT_IO_BLOCK_SIZE ) );
+  while( n < 0 && errno == EINTR );
+
+  if( n < 0 ){
+    lru->used = 0;
+    lru->length = 0;
+    lru->index = (uint64_t) -1;
+    return NULL;
+  }
+
+  lru->index = index;
+  lru->length = (unsigned int) n;
+  lru->used = clock;
+  return lru;
+}
+
+
+
+static tmsize_t tiffRead( thandle_t handle, void* buffer, tmsize_t size )
+{
+  TIFFFile* file = (TIFFFile*) handle;
+  unsigned char* out = (unsigned char*) buffer;
+
+  if( size <= 0 || file->position >= file->size ) return 0;
+  if( (uint64_t) size > file->size - file->position ) size = (tmsize_t) ( file->size - file->position );
+
+  tmsize_t done = 0;
+
+  if( file->map ){
+    memcpy( out, file->map + file->position, size );
+    done = size;
+  }
+  else if( file->mode == TIFFIO_DIRECT ){
+    while( done < size ){
+      uint64_t position = file->position + done;
+      TIFFFile::Block* b = file->block( position / DIRECT_IO_BLOCK_SIZE );
+      if( !b ) return -1;
+      unsigned int offset = (unsigned int) ( position % DIRECT_IO_BLOCK_SIZE );
+      if( offset >= b->length ) break;
+      tmsize_t n = b->length - offset;
+      if( n > size - done ) n = size - done;
+      memcpy( out + done, b->data + offset, n );
+      done += n;
+    }
+  }
+  else{
+    while( done < size ){
+      ssize_t n = pread( file->fd, out + done, size - done, (off_t) ( file->position + done ) );
+      if( n < 0 && errno == EINTR ) continue;
+      if( n < 0 ) return -1;
+      if( n == 0 ) break;
+      done += n;
+    }
+  }
+
+  file->position += done;
+  return done;
+}
+
+
+
+static tmsize_t tiffWrite( thandle_t handle, void* buffer, tmsize_t size )
+{
+  // Our images are only ever read
+  return -1;
+}
+
+
+
+static toff_t tiffSeek( thandle_t handle, toff_t offset, int whence )
+{
+  TIFFFile* file = (TIFFFile*) handle;
+  switch( whence ){
+    case SEEK_SET: file->position = offset; break;
+    case SEEK_CUR: file->position += (int64_t) offset; break;
+    case SEEK_END: file->position = file->size + (int64_t) offset; break;
+    default: return (toff_t) -1;
+  }
+  return file->position;
+}
+
+
+
+static int tiffClose( thandle_t handle )
+{
+  delete (TIFFFile*) handle;
+  return 0;
+}
+
+
+
+static toff_t tiffSize( thandle_t handle )
+{
+  return ( (TIFFFile*) handle )->size;
+}
+
+
+
+static int tiffMap( thandle_t handle, void** base, toff_t* size )
+{
+  // Allows libtiff to decode our tiles straight from our mapping without copying them
+  TIFFFile* file = (TIFFFile*) handle;
+  if( !file->map ) return 0;
+  *base = file->map;
+  *size = file->size;
+  return 1;
+}
+
+
+
+static void tiffUnmap( thandle_t handle, void* base, toff_t size )
+{
+  // Our mapping is released when our file is closed
+}
+
+
+
+TIFF* TIFFIO::open( const string& filename )
+{
+  if( mode == TIFFIO_LIBTIFF ) return TIFFOpen( filename.c_str(), "rm" );
+
+  TIFFFile* file = new TIFFFile;
+  file->mode = mode;
+
+  int flags = O_RDONLY;
+#ifdef O_CLOEXEC
+  flags |= O_CLOEXEC;
+#endif
+
+#ifdef O_DIRECT
+  // Not all file systems support direct I/O, in which case we still read in aligned blocks
+  if( mode == TIFFIO_DIRECT ){
+    file->fd = ::open( filename.c_str(), flags | O_DIRECT );
+  }
+#endif
+  if( file->fd < 0 ) file->fd = ::open( filename.c_str(), flags );
+
+  struct stat sb;
+  if( file->fd < 0 || fstat( file->fd, &sb ) != 0 ){
+    delete file;
+    return NULL;
+  }
+  file->size = sb.st_size;
+
+  if( mode == TIFFIO_MMAP && file->size > 0 ){
+    void* map = mmap( NULL, file->size, PROT_READ, MAP_SHARED, file->fd, 0 );
+    // Fall back to positioned reads if our file cannot be mapped
+    if( map != MAP_FAILED ){
+      file->map = (unsigned char*) map;
+      // Tiles are read in no particular order, so reading ahead around each page fault is wasted
+      madvise( map, file->size, MADV_RANDOM );
+      ::close( file->fd );
+      file->fd = -1;
+    }
+  }
+
+#ifdef POSIX_FADV_RANDOM
+  // Only read what we ask for ahead of time, rather than reading ahead of each tile
+  if( mode == TIFFIO_READAHEAD ) posix_fadvise( file->fd, 0, 0, POSIX_FADV_RANDOM );
+#endif
+
+  // Let libtiff use our mapping if we have one
+  TIFF* tiff = TIFFClientOpen( filename.c_str(), file->map ? "r" : "rm", (thandle_t) file,
+			       tiffRead, tiffWrite, tiffSeek, tiffClose, tiffSize, tiffMap, tiffUnmap );
+
+  // libtiff does not close files it fails to open
+  if( !tiff ) delete file;
+  return tiff;
+}
+
+
+
+void TIFFIO::willNeed( TIFF* tiff, uint64_t offset, uint64_t length )
+{
+#ifdef POSIX_FADV_WILLNEED
+  if( mode != TIFFIO_READAHEAD || length == 0 ) return;
+  TIFFFile* file = (TIFFFile*) TIFFClientdata( tiff );
+  posix_fadvise( file->fd, (off_t) offset, (off_t) length, POSIX_FADV_WILLNEED );
+#endif
+}
+
+
+
+#else
+
+
+// Windows images are always read through libtiff itself
+
+TIFF* TIFFIO::open( const string& filename )
+{
+  return TIFFOpen( filename.c_str(), "rm" );
+}
+
+void TIFFIO::willNeed( TIFF* tiff, uint64_t offset, uint64_t length ){}
+
+
+#endif
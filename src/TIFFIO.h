@@ -0,0 +1,86 @@
+// Selectable I/O Layer for TIFF Images
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _TIFFIO_H
+#define _TIFFIO_H
+
+
+#include <string>
+#include <stdint.h>
+#include <tiffio.h>
+
+
+// Size and number of the aligned blocks cached by each file read with direct I/O
+#define DIRECT_IO_BLOCK_SIZE 65536
+#define DIRECT_IO_BLOCKS 8
+
+
+
+/// Ways in which our TIFF images can be read
+/** TIFFIO_LIBTIFF: libtiff's own buffered reads
+    TIFFIO_MMAP: the whole file is memory mapped for random access
+    TIFFIO_PREAD: positioned reads with no hints to the kernel
+    TIFFIO_DIRECT: reads bypassing the page cache into a small cache of aligned blocks
+    TIFFIO_READAHEAD: positioned reads, with the tiles of each region read ahead
+ */
+enum TIFFIOMode { TIFFIO_LIBTIFF, TIFFIO_MMAP, TIFFIO_PREAD, TIFFIO_DIRECT, TIFFIO_READAHEAD };
+
+
+
+/// Opens our TIFF images through libtiff's client I/O callbacks in the selected mode
+/** The mode is chosen once at startup and applies to every image subsequently opened.
+    Without POSIX file functions, images are always read through libtiff itself.
+ */
+class TIFFIO {
+
+ private:
+
+  /// Our mode
+  static TIFFIOMode mode;
+
+
+ public:
+
+  /// Set the mode in which all subsequently opened images are read
+  static void setMode( TIFFIOMode m ){ mode = m; };
+
+  /// Return our mode
+  static TIFFIOMode getMode(){ return mode; };
+
+  /// Open a TIFF image for reading
+  /** @param filename file path
+      @return TIFF handle or NULL if the file cannot be opened
+   */
+  static TIFF* open( const std::string& filename );
+
+  /// Hint that part of a file will shortly be read, so that it can be read ahead
+  /** Only acted upon in TIFFIO_READAHEAD mode
+      @param tiff TIFF handle returned by open()
+      @param offset byte offset
+      @param length number of bytes
+   */
+  static void willNeed( TIFF* tiff, uint64_t offset, uint64_t length );
+
+};
+
+
+#endif
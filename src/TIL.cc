@@ -201,7 +201,7 @@ void TIL::run( Session* session, const std::string& a ){
 
       /* Send the actual tile data
        */
-      if( session->out->putStr( (const char*) rawtile.data, len ) != len ){
+      if( session->out->putTile( rawtile ) != len ){
 	if( session->loglevel >= 1 ){
 	  *(session->logfile) << "TIL :: Error writing jpeg tile" << endl;
 	}
@@ -22,7 +22,9 @@
 
 
 #include "TPTImage.h"
+#include "TIFFIO.h"
 #include <sstream>
+#include <cstring>
 
 
 using namespace std;
@@ -42,7 +44,7 @@ void TPTImage::openImage() throw (file_error)
   updateTimestamp( filename );
 
   // Try to open and allocate a buffer
-  if( ( tiff = TIFFOpen( filename.c_str(), "rm" ) ) == NULL ){
+  if( ( tiff = TIFFIO::open( filename ) ) == NULL ){
     throw file_error( "tiff open failed for: " + filename );
   }
 
@@ -61,7 +63,7 @@ void TPTImage::openImage() throw (file_error)
 
 void TPTImage::loadImageInfo( int seq, int ang ) throw(file_error)
 {
-  tdir_t current_dir;
+  toff_t current_dir;
   int count;
   uint16 colour, samplesperpixel, bitspersample, sampleformat;
   double sminvaluearr[4] = {0.0}, smaxvaluearr[4] = {0.0};
@@ -89,21 +91,25 @@ void TPTImage::loadImageInfo( int seq, int ang ) throw(file_error)
   sampleType = (sampleformat==3) ? FLOATINGPOINT : FIXEDPOINT;
 
   // Check for the no. of resolutions in the pyramidal image
-  current_dir = TIFFCurrentDirectory( tiff );
+  current_dir = TIFFCurrentDirOffset( tiff );
   TIFFSetDirectory( tiff, 0 );
 
-  // Store the list of image dimensions available
+  // Store the list of image dimensions available and the offset of the directory holding
+  // each, so that we can later move straight to any resolution
+  directory_offsets.clear();
+  directory_offsets.push_back( TIFFCurrentDirOffset( tiff ) );
   image_widths.push_back( w );
   image_heights.push_back( h );
 
   for( count = 0; TIFFReadDirectory( tiff ); count++ ){
     TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &w );
     TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &h );
+    directory_offsets.push_back( TIFFCurrentDirOffset( tiff ) );
     image_widths.push_back( w );
     image_heights.push_back( h );
   }
   // Reset the TIFF directory
-  TIFFSetDirectory( tiff, current_dir );
+  TIFFSetSubDirectory( tiff, current_dir );
 
   numResolutions = count+1;
 
@@ -186,11 +192,8 @@ void TPTImage::closeImage()
 }
 
 
-RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsigned int tile ) throw (file_error)
+void TPTImage::selectTile( int seq, int ang, unsigned int res, unsigned int tile ) throw (file_error)
 {
-  uint32 im_width, im_height, tw, th, ntlx, ntly;
-  uint32 rem_x, rem_y;
-  uint16 colour;
   string filename;
 
 
@@ -212,7 +215,7 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
   // Open the TIFF if it's not already open
   if( !tiff ){
     filename = getFileName( seq, ang );
-    if( ( tiff = TIFFOpen( filename.c_str(), "rm" ) ) == NULL ){
+    if( ( tiff = TIFFIO::open( filename ) ) == NULL ){
       throw file_error( "tiff open failed for:" + filename );
     }
   }
@@ -230,8 +233,16 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
   int vipsres = ( numResolutions - 1 ) - res;
   
 
-  // Change to the right directory for the resolution
-  if( !TIFFSetDirectory( tiff, vipsres ) ) {
+  // Change to the right directory for the resolution. Move straight to it by its offset
+  // rather than following the chain of directories from the start, and not at all if it
+  // is already our current directory
+  if( (unsigned int) vipsres < directory_offsets.size() ){
+    toff_t offset = (toff_t) directory_offsets[vipsres];
+    if( TIFFCurrentDirOffset( tiff ) != offset && !TIFFSetSubDirectory( tiff, offset ) ){
+      throw file_error( "TIFFSetSubDirectory failed" );
+    }
+  }
+  else if( !TIFFSetDirectory( tiff, vipsres ) ) {
     throw file_error( "TIFFSetDirectory failed" );
   }
 
@@ -241,7 +252,55 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
     ostringstream tile_no;
     tile_no << "Asked for non-existent tile: " << tile;
     throw file_error( tile_no.str() );
-  } 
+  }
+
+}
+
+
+void TPTImage::prefetch( int seq, int ang, unsigned int res, unsigned int startx, unsigned int starty,
+			 unsigned int endx, unsigned int endy ) throw (file_error)
+{
+  if( TIFFIO::getMode() != TIFFIO_READAHEAD || endx <= startx || endy <= starty ) return;
+
+  selectTile( seq, ang, res, 0 );
+
+  uint32 im_width, tw;
+  toff_t *offsets, *counts;
+  TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &im_width );
+  TIFFGetField( tiff, TIFFTAG_TILEWIDTH, &tw );
+  if( tw == 0 || !TIFFGetField( tiff, TIFFTAG_TILEOFFSETS, &offsets ) ||
+      !TIFFGetField( tiff, TIFFTAG_TILEBYTECOUNTS, &counts ) ) return;
+
+  unsigned int ntlx = ( im_width + tw - 1 ) / tw;
+  unsigned int ntiles = TIFFNumberOfTiles( tiff );
+
+  // Tiles within a row are usually stored one after another, so ask for each run of
+  // consecutive tiles in one go
+  toff_t start = 0, end = 0;
+  for( unsigned int i = starty; i < endy; i++ ){
+    for( unsigned int j = startx; j < endx; j++ ){
+      unsigned int tile = i*ntlx + j;
+      if( tile >= ntiles ) break;
+      if( offsets[tile] != end ){
+	TIFFIO::willNeed( tiff, start, end - start );
+	start = offsets[tile];
+      }
+      end = offsets[tile] + counts[tile];
+    }
+  }
+  TIFFIO::willNeed( tiff, start, end - start );
+}
+
+
+RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsigned int tile ) throw (file_error)
+{
+  uint32 im_width, im_height, tw, th, ntlx, ntly;
+  uint32 rem_x, rem_y;
+  uint16 colour;
+
+
+  // Move to the directory holding our tile
+  selectTile( seq, ang, res, tile );
 
 
   // Get the size of this tile, the current image,
@@ -364,3 +423,123 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
 
 }
 
+
+
+
+RawTile TPTImage::getJPEGTile( int seq, int ang, unsigned int res, unsigned int tile ) throw (file_error)
+{
+  uint32 im_width, im_height, tw, th, ntlx, ntly;
+  uint16 colour, compression, planar;
+
+  // An empty tile tells our caller to decode the tile instead
+  RawTile rawtile;
+
+  // Only 8 bit greyscale or colour JPEG data can be sent as it is
+  if( bpc != 8 || (channels != 1 && channels != 3) ) return rawtile;
+
+
+  // Move to the directory holding our tile
+  selectTile( seq, ang, res, tile );
+
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_COMPRESSION, &compression );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_PLANARCONFIG, &planar );
+  TIFFGetField( tiff, TIFFTAG_PHOTOMETRIC, &colour );
+  if( compression != COMPRESSION_JPEG || planar != PLANARCONFIG_CONTIG ) return rawtile;
+  if( !( (channels == 1 && colour == PHOTOMETRIC_MINISBLACK) ||
+	 (channels == 3 && (colour == PHOTOMETRIC_YCBCR || colour == PHOTOMETRIC_RGB)) ) ) return rawtile;
+
+
+  // Get the size of this tile, which is smaller than the tile size in the last row and column
+  TIFFGetField( tiff, TIFFTAG_TILEWIDTH, &tw );
+  TIFFGetField( tiff, TIFFTAG_TILELENGTH, &th );
+  TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &im_width );
+  TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &im_height );
+
+  ntlx = (im_width / tw) + (im_width % tw == 0 ? 0 : 1);
+  ntly = (im_height / th) + (im_height % th == 0 ? 0 : 1);
+  if( ( tile % ntlx == ntlx - 1 ) && ( im_width % tw != 0 ) ) tw = im_width % tw;
+  if( ( tile / ntlx == ntly - 1 ) && ( im_height % th != 0 ) ) th = im_height % th;
+
+
+  // Get the size of our raw tile data
+  toff_t *counts;
+  if( !TIFFGetField( tiff, TIFFTAG_TILEBYTECOUNTS, &counts ) || counts[tile] < 4 ) return rawtile;
+  tsize_t size = (tsize_t) counts[tile];
+
+  // Any quantization and Huffman tables shared between our tiles are held separately
+  uint32 tables_size = 0;
+  unsigned char *tables = NULL;
+  if( TIFFGetField( tiff, TIFFTAG_JPEGTABLES, &tables_size, &tables ) &&
+      ( tables_size < 4 || tables[0] != 0xFF || tables[1] != 0xD8 ) ){
+    tables_size = 0;
+  }
+
+  // Without markers of their own, JPEG decoders assume 3 channel data to be YCbCr
+  static const unsigned char adobe[] = { 0xFF, 0xEE, 0x00, 0x0E, 'A', 'd', 'o', 'b', 'e',
+					 0x00, 0x64, 0x00, 0x00, 0x00, 0x00, 0x00 };
+  unsigned int adobe_size = (colour == PHOTOMETRIC_RGB) ? sizeof(adobe) : 0;
+
+
+  // Build our JPEG stream from the start of image marker, our colour marker, the shared
+  // tables without their start and end of image markers and the tile minus its start marker
+  unsigned int header_size = 2 + adobe_size + ( tables_size ? tables_size - 4 : 0 );
+  unsigned char *buffer = new unsigned char[header_size + size - 2];
+  unsigned char *tile_data = buffer + header_size - 2;
+
+  if( TIFFReadRawTile( tiff, (ttile_t) tile, tile_data, size ) != size ||
+      tile_data[0] != 0xFF || tile_data[1] != 0xD8 ){
+    delete[] buffer;
+    return rawtile;
+  }
+
+  buffer[0] = 0xFF;
+  buffer[1] = 0xD8;
+  if( adobe_size ) memcpy( buffer + 2, adobe, adobe_size );
+  if( tables_size ) memcpy( buffer + 2 + adobe_size, tables + 2, tables_size - 4 );
+  unsigned int length = header_size + size - 2;
+
+
+  // Tiles are encoded at the full tile size even where they extend beyond the image.
+  // Find our frame header and trim the height of any bottom edge tile, as decoders
+  // simply ignore the rows beyond it. Edge tiles which are too wide cannot be trimmed
+  // in this way, as the width determines how the scan itself is laid out
+  bool sized = false;
+  unsigned int n = 2;
+  while( n + 4 <= length && buffer[n] == 0xFF ){
+    unsigned char marker = buffer[n+1];
+    if( marker == 0xFF ){ n++; continue; }
+    if( marker == 0xDA ) break;
+    unsigned int segment = (buffer[n+2] << 8) | buffer[n+3];
+    if( marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC ){
+      if( n + 9 > length ) break;
+      unsigned int h = (buffer[n+5] << 8) | buffer[n+6];
+      unsigned int w = (buffer[n+7] << 8) | buffer[n+8];
+      if( w == tw && h >= th ){
+	buffer[n+5] = (unsigned char) (th >> 8);
+	buffer[n+6] = (unsigned char) (th & 0xFF);
+	sized = true;
+      }
+      break;
+    }
+    n += 2 + segment;
+  }
+
+  if( !sized ){
+    delete[] buffer;
+    return rawtile;
+  }
+
+
+  rawtile = RawTile( tile, res, seq, ang, tw, th, channels, bpc );
+  rawtile.data = buffer;
+  rawtile.dataLength = length;
+  rawtile.filename = getImagePath();
+  rawtile.timestamp = timestamp;
+  rawtile.memoryManaged = 1;
+  rawtile.padded = false;
+  rawtile.sampleType = sampleType;
+  rawtile.compressionType = JPEG;
+
+  return rawtile;
+
+}
@@ -42,6 +42,14 @@ class TPTImage : public IIPImage {
   /// Tile data buffer pointer
   tdata_t tile_buf;
 
+  /// Open our file if necessary and move to the directory holding a tile
+  /** @param x horizontal sequence angle
+      @param y vertical sequence angle
+      @param r resolution
+      @param t tile number
+   */
+  void selectTile( int x, int y, unsigned int r, unsigned int t ) throw (file_error);
+
 
  public:
 
@@ -81,6 +89,9 @@ class TPTImage : public IIPImage {
   /// Destructor
   ~TPTImage() { closeImage(); };
 
+  /// Overloaded function for copying our image
+  IIPImage* duplicate() const { return new TPTImage( *this ); };
+
   /// Overloaded function for opening a TIFF image
   void openImage() throw (file_error);
 
@@ -102,6 +113,31 @@ class TPTImage : public IIPImage {
    */
   RawTile getTile( int x, int y, unsigned int r, int l, unsigned int t ) throw (file_error);
 
+  /// Overloaded function for hinting that the tiles of a region will shortly be read
+  /** Our file system is asked to read ahead the tiles of each row when reading in
+      TIFFIO_READAHEAD mode
+      @param x horizontal sequence angle
+      @param y vertical sequence angle
+      @param r resolution
+      @param startx first tile column
+      @param starty first tile row
+      @param endx tile column following the last
+      @param endy tile row following the last
+   */
+  void prefetch( int x, int y, unsigned int r, unsigned int startx, unsigned int starty,
+		 unsigned int endx, unsigned int endy ) throw (file_error);
+
+  /// Overloaded function for getting a JPEG compressed tile without decoding it
+  /** The raw tile data is combined with any JPEG tables shared by the tiles of our image.
+      Tiles which are not JPEG compressed, or whose encoded size cannot be trimmed to that
+      of an edge tile, are not returned
+      @param x horizontal sequence angle
+      @param y vertical sequence angle
+      @param r resolution
+      @param t tile number
+   */
+  RawTile getJPEGTile( int x, int y, unsigned int r, unsigned int t ) throw (file_error);
+
 };
 
 
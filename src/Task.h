@@ -34,6 +34,12 @@
 #include "Timer.h"
 #include "Writer.h"
 #include "Cache.h"
+#include "ImageCache.h"
+#include "ImagePool.h"
+#include "ThreadPool.h"
+#include "AdmissionControl.h"
+#include "Scheduler.h"
+#include "Mutex.h"
 #include "Watermark.h"
 #ifdef HAVE_PNG
 #include "PNGCompressor.h"
@@ -43,22 +49,12 @@
 // Define our http header cache max age (24 hours)
 #define MAX_AGE 86400
 
-
-
-#ifdef HAVE_EXT_POOL_ALLOCATOR
-#include <ext/pool_allocator.h>
-typedef HASHMAP < std::string, IIPImage,
-			      __gnu_cxx::hash< const std::string >,
-			      std::equal_to< const std::string >,
-			      __gnu_cxx::__pool_alloc< std::pair<const std::string,IIPImage> >
-			      > imageCacheMapType;
-#else
-typedef HASHMAP <std::string,IIPImage> imageCacheMapType;
-#endif
-
+// Largest output size in pixels still scheduled as an interactive request
+#define INTERACTIVE_MAX_SIZE 1024
 
 
 
+class MemoryLimit;
 
 
 /// Structure to hold our session data
@@ -75,14 +71,15 @@ struct Session {
   std::ofstream* logfile;
   std::map <const std::string, std::string> headers;
 
-  imageCacheMapType *imageCache;
+  ImageCache* imageCache;
+  ImagePool* imagePool;
+  ThreadPool* threadPool;
   Cache* tileCache;
+  AdmissionControl* admission;
+  Scheduler* scheduler;
+  MemoryLimit* memory;
 
-#ifdef DEBUG
-  FileWriter* out;
-#else
-  FCGIWriter* out;
-#endif
+  Writer* out;
 
 };
 
@@ -112,6 +109,13 @@ class Task {
   /// Main public function
   virtual void run( Session* session, const std::string& argument ) {;};
 
+  /// Whether this command produces a whole region rather than a tile
+  /** Used to schedule interactive requests ahead of bulk exports
+      @param argument command argument
+      @return true if the command is likely to be expensive
+   */
+  virtual bool bulk( const std::string& argument ) { return false; };
+
   /// Factory function
   /** @param type command type */
   static Task* factory( const std::string& type );
@@ -142,6 +146,7 @@ class OBJ : public Task {
   void vertical_views();
   void min_max_values();
   void metadata( std::string field );
+  void server_status();
 
 };
 
@@ -255,6 +260,7 @@ class TIL : public Task {
 class CVT : public Task {
  public:
   void run( Session* session, const std::string& argument );
+  bool bulk( const std::string& argument ) { return true; };
 
   /// Send out our requested region
   /** @param session our current session */
@@ -326,6 +332,7 @@ class DeepZoom : public Task {
 class IIIF : public Task {
  public:
   void run( Session* session, const std::string& argument );
+  bool bulk( const std::string& argument );
 };
 
 
@@ -0,0 +1,143 @@
+// Pool of Threads for Parallel Loops Member Functions
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "ThreadPool.h"
+
+#include <string>
+
+
+using namespace std;
+
+
+
+ThreadPool::ThreadPool( unsigned int n ) : loopsRun( 0 ), stopping( false )
+{
+#ifdef HAVE_PTHREAD
+  for( unsigned int i = 0; i < n; i++ ){
+    pthread_t id;
+    if( pthread_create( &id, NULL, run, this ) != 0 ) break;
+    threads.push_back( id );
+  }
+  if( n > 0 && threads.empty() ) throw string( "ThreadPool :: Unable to start threads" );
+#else
+  if( n > 0 ) throw string( "ThreadPool :: Threads not supported on this platform" );
+#endif
+}
+
+
+
+ThreadPool::~ThreadPool()
+{
+  {
+    ScopedLock l( lock );
+    stopping = true;
+    available.broadcast();
+  }
+#ifdef HAVE_PTHREAD
+  for( unsigned int i = 0; i < threads.size(); i++ ) pthread_join( threads[i], NULL );
+#endif
+}
+
+
+
+unsigned int ThreadPool::_take( Loop* loop )
+{
+  unsigned int item = loop->next++;
+  if( loop->next == loop->items ){
+    for( deque<Loop*>::iterator i = loops.begin(); i != loops.end(); ++i ){
+      if( *i == loop ){
+	loops.erase( i );
+	break;
+      }
+    }
+  }
+  return item;
+}
+
+
+
+void ThreadPool::parallel( unsigned int items, Function function, void* context )
+{
+  if( items == 0 ) return;
+
+  Loop loop;
+  loop.function = function;
+  loop.context = context;
+  loop.items = items;
+  loop.next = 1;
+  loop.done = 0;
+
+  // Offer our remaining items to our threads
+  {
+    ScopedLock l( lock );
+    loopsRun++;
+    if( items > 1 && this->size() > 0 ){
+      loops.push_back( &loop );
+      available.broadcast();
+    }
+  }
+
+  // Run our first item ourselves, followed by any which our threads have not yet taken
+  function( context, 0 );
+
+  ScopedLock l( lock );
+  loop.done++;
+
+  while( loop.next < loop.items ){
+    unsigned int item = this->_take( &loop );
+    lock.unlock();
+    function( context, item );
+    lock.lock();
+    loop.done++;
+  }
+
+  // Wait for our threads to complete the items they have taken
+  while( loop.done < loop.items ) loop.finished.wait( lock );
+}
+
+
+
+#ifdef HAVE_PTHREAD
+
+void* ThreadPool::run( void* p )
+{
+  ThreadPool* pool = static_cast<ThreadPool*>( p );
+
+  ScopedLock l( pool->lock );
+  while( true ){
+    while( pool->loops.empty() && !pool->stopping ) pool->available.wait( pool->lock );
+    if( pool->stopping ) break;
+
+    Loop* loop = pool->loops.front();
+    unsigned int item = pool->_take( loop );
+
+    pool->lock.unlock();
+    loop->function( loop->context, item );
+    pool->lock.lock();
+
+    if( ++loop->done == loop->items ) loop->finished.broadcast();
+  }
+
+  return NULL;
+}
+
+#endif
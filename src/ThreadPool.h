@@ -0,0 +1,146 @@
+// Pool of Threads for Parallel Loops
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _THREADPOOL_H
+#define _THREADPOOL_H
+
+
+#include <deque>
+#include <vector>
+
+#include "Mutex.h"
+
+
+
+/// Fixed set of threads sharing out the items of parallel loops
+/** Used by our request workers to spread work such as decoding the tiles of a region
+    over several cores. The items of each loop are handed out one at a time, both to
+    our threads and to the thread running the loop, which keeps working through its
+    own items. A loop therefore always completes, even when our threads are all busy
+    with the loops of other requests. Without thread support, loops simply run in the
+    calling thread.
+
+    The image processing filters already use OpenMP, but tile decoding does not: each
+    worker thread that enters an OpenMP parallel region gets a team of its own, so the
+    number of threads would grow with the number of workers, whereas our threads are
+    shared by all workers and bounded by their number. Our items also need their own
+    image handles, check whether their client has gone away and may throw, none of which
+    fit an OpenMP loop. The two are used one after the other within a request, tiles
+    being decoded before the region is filtered, but concurrent requests can have both
+    running at once, so up to our threads plus the OpenMP threads of every worker may
+    compete for the CPU.
+ */
+class ThreadPool {
+
+ public:
+
+  /// Function run for each item of a loop
+  /** Must not throw
+      @param context context given to parallel()
+      @param item item number
+   */
+  typedef void (*Function)( void* context, unsigned int item );
+
+
+ private:
+
+  /// A loop in progress
+  struct Loop {
+    Function function;
+    void* context;
+    unsigned int items;      // Number of items
+    unsigned int next;       // Next item to hand out
+    unsigned int done;       // Number of items completed
+    Condition finished;
+  };
+
+  /// Loops with items still to be handed out, oldest first
+  std::deque<Loop*> loops;
+
+  /// Our threads
+#ifdef HAVE_PTHREAD
+  std::vector<pthread_t> threads;
+#endif
+
+  /// Number of loops run
+  unsigned long loopsRun;
+
+  /// Lock protecting our state
+  Mutex lock;
+
+  /// Signalled when a loop is added or we are shutting down
+  Condition available;
+
+  /// Whether we are shutting down
+  bool stopping;
+
+  /// Take the next item of a loop, removing the loop once all its items are handed out
+  /** Must be called with our lock held
+      @return item number
+   */
+  unsigned int _take( Loop* loop );
+
+#ifdef HAVE_PTHREAD
+  /// Thread main loop
+  static void* run( void* pool );
+#endif
+
+  /// Disallow copying
+  ThreadPool( const ThreadPool& );
+  ThreadPool& operator = ( const ThreadPool& );
+
+
+ public:
+
+  /// Constructor
+  /** Throws a string if no threads can be started
+      @param threads number of threads
+   */
+  ThreadPool( unsigned int threads );
+
+  /// Destructor - waits for our threads to finish
+  ~ThreadPool();
+
+  /// Run a function for each of a number of items, returning once all have completed
+  /** Item 0 is always run by the calling thread
+      @param items number of items
+      @param function function to run for each item
+      @param context context passed to our function
+   */
+  void parallel( unsigned int items, Function function, void* context );
+
+  /// Return the number of threads
+  unsigned int size() const {
+#ifdef HAVE_PTHREAD
+    return threads.size();
+#else
+    return 0;
+#endif
+  };
+
+  /// Return the number of loops run
+  unsigned long getLoops() { ScopedLock l( lock ); return loopsRun; };
+
+};
+
+
+#endif
@@ -24,6 +24,8 @@
 
 
 #include <cmath>
+#include <string>
+#include <vector>
 #include "TileManager.h"
 
 
@@ -31,7 +33,44 @@ using namespace std;
 
 
 
-RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c ){
+/// A region being assembled from its tiles, which may be shared between several threads
+struct TileManager::RegionJob {
+  TileManager* manager;
+  Writer* client;
+  RawTile* region;
+
+  // The image we are decoding, as named by our image pool
+  std::string path;
+  int currentX, currentY;
+
+  // The region requested
+  unsigned int res;
+  int seq, ang, layers;
+  unsigned int x, y, width, height;
+  bool whole;
+
+  // The tiles covering it and the offset of the region within the first
+  unsigned int startx, starty, endx, endy, xoffset, yoffset, ntlx;
+  unsigned int basic_tile_width, basic_tile_height;
+
+  // Image handle used by each of our threads
+  std::vector<IIPImage*> handles;
+
+  // Number of tiles and the next to be decoded, numbered from zero
+  unsigned int tiles, next;
+
+  // The first error raised by any of our threads
+  bool failed;
+  int status;
+  std::string error;
+  bool fileError;
+
+  Mutex lock;
+};
+
+
+
+RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c, bool padded ){
 
   if( loglevel >= 2 ) *logfile << "TileManager :: Cache Miss for resolution: " << resolution << ", tile: " << tile << endl
 			       << "TileManager :: Cache Size: " << tileCache->getNumElements()
@@ -40,6 +79,19 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 
   RawTile ttt;
 
+  // Send JPEG compressed tiles just as they are stored, unless they must be watermarked or a
+  // particular quality has been requested, rather than decoding and then re-encoding them
+  if( c == JPEG && !jpeg->qualityRequested() && !(watermark && watermark->isSet()) ){
+    ttt = image->getJPEGTile( xangle, yangle, resolution, tile );
+    if( ttt.dataLength > 0 ){
+      if( loglevel >= 3 ) *logfile << "TileManager :: Sending JPEG tile without re-encoding" << endl;
+      // Our tile is cached under our default quality
+      ttt.quality = jpeg->getQuality();
+      this->cache( ttt );
+      return ttt;
+    }
+  }
+
   // Get our raw tile from the IIPImage image object
   ttt = image->getTile( xangle, yangle, resolution, layers, tile );
 
@@ -58,6 +110,30 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
   }
 
 
+  // Our caller can take what it needs directly from a tile still held in our image's decoding
+  // buffer, padding and all. The copy made for our cache is then cropped as it is copied,
+  // rather than cropping the tile first and copying it again afterwards
+  if( c == UNCOMPRESSED && padded && ttt.data && !ttt.memoryManaged ){
+
+    RawTile copy( ttt.tileNum, ttt.resolution, ttt.hSequence, ttt.vSequence,
+		  ttt.width, ttt.height, ttt.channels, ttt.bpc );
+    copy.filename = ttt.filename;
+    copy.timestamp = ttt.timestamp;
+    copy.sampleType = ttt.sampleType;
+    copy.dataLength = ttt.width * ttt.height * ttt.channels * ttt.bpc/8;
+    copy.data = allocateTileData( copy.bpc, copy.sampleType, copy.dataLength );
+
+    unsigned int len = ttt.width * ttt.channels * ttt.bpc/8;
+    unsigned int stride = ttt.padded ? image->getTileWidth() * ttt.channels * ttt.bpc/8 : len;
+    for( unsigned int i=0; i<ttt.height; i++ ){
+      memcpy( (unsigned char*) copy.data + i*len, (unsigned char*) ttt.data + i*stride, len );
+    }
+
+    this->cache( copy );
+    return ttt;
+  }
+
+
   // We need to crop our edge tiles if they are padded
   if( ((ttt.width != image->getTileWidth()) || (ttt.height != image->getTileHeight())) && ttt.padded ){
     if( loglevel >= 5 ) * logfile << "TileManager :: Cropping tile" << endl;
@@ -67,11 +143,7 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 
   // Add our uncompressed tile directly into our cache
   if( c == UNCOMPRESSED ){
-    // Add to our tile cache
-    if( loglevel >= 2 ) insert_timer.start();
-    tileCache->insert( ttt );
-    if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
-				 << " microseconds" << endl;
+    this->cache( ttt );
     return ttt;
   }
 
@@ -105,14 +177,47 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 
 
   // Add to our tile cache
+  this->cache( ttt );
+
+  return ttt;
+
+}
+
+
+
+void TileManager::cache( RawTile& ttt ){
+
   if( loglevel >= 2 ) insert_timer.start();
+
+  // Our tile's data is handed over to an immutable shared buffer so that neither the cache
+  // nor our caller copies it. Tiles still pointing into our image's decoding buffer get a
+  // copy of their own
+  ttt.share();
+
+  // Hold uncompressed tiles in a compact lossless form if requested. Our caller keeps the
+  // uncompressed tile, so there is no need to decompress it again
+  int level = tileCache->getCompression();
+  if( level > 0 && ttt.compressionType == UNCOMPRESSED ){
+    try{
+      DeflateCompressor deflate( level );
+      RawTile packed;
+      unsigned int newlen = deflate.Compress( ttt, packed );
+      packed.share();
+      tileCache->insert( packed );
+      if( loglevel >= 2 ) *logfile << "TileManager :: DEFLATE compressed tile for cache insertion in "
+				   << insert_timer.getTime() << " microseconds" << endl
+				   << "TileManager :: Compression Ratio: " << newlen << "/" << ttt.dataLength << " = "
+				   << ( (float)newlen/(float)ttt.dataLength ) << endl;
+      return;
+    }
+    catch( const string& error ){
+      if( loglevel >= 1 ) *logfile << error << endl;
+    }
+  }
+
   tileCache->insert( ttt );
   if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
 			       << " microseconds" << endl;
-
-
-  return ttt;
-
 }
 
 
@@ -128,26 +233,21 @@ void TileManager::crop( RawTile *ttt ){
 	     << endl;
   }
 
-  // Create a new buffer, fill it with the old data, then copy
-  // back the cropped part into the RawTile buffer
-  int len = tw * th * ttt->channels * ttt->bpc/8;
-  unsigned char* buffer = (unsigned char*) malloc( len );
-  unsigned char* src_ptr = (unsigned char*) memcpy( buffer, ttt->data, len );
+  // Shift each scanline down into place within the tile's own buffer. Rows only ever
+  // move towards the start of the buffer, so no row is overwritten before it is moved
+  unsigned char* src_ptr = (unsigned char*) ttt->data;
   unsigned char* dst_ptr = (unsigned char*) ttt->data;
+  unsigned int len = ttt->width * ttt->channels * ttt->bpc/8;
+  unsigned int stride = tw * ttt->channels * ttt->bpc/8;
 
-  // Copy one scanline at a time
   for( unsigned int i=0; i<ttt->height; i++ ){
-    len =  ttt->width * ttt->channels * ttt->bpc/8;
-    memcpy( dst_ptr, src_ptr, len );
+    memmove( dst_ptr, src_ptr, len );
     dst_ptr += len;
-    src_ptr += tw * ttt->channels * ttt->bpc/8;
+    src_ptr += stride;
   }
 
-  free( buffer );
-
   // Reset the data length
-  len = ttt->width * ttt->height * ttt->channels * ttt->bpc/8;
-  ttt->dataLength = len;
+  ttt->dataLength = ttt->width * ttt->height * ttt->channels * ttt->bpc/8;
   ttt->padded = false;
 
 }
@@ -155,9 +255,10 @@ void TileManager::crop( RawTile *ttt ){
 
 
 
-RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c ){
+RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c, bool padded ){
 
-  RawTile* rawtile = NULL;
+  RawTile rawtile;
+  bool found = false;
   string tileCompression;
   string compName;
 
@@ -166,63 +267,56 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
   if( loglevel >= 2 ) tile_timer.start();
 
 
-  /* Try to get this tile from our cache first as a JPEG, then uncompressed
-     Otherwise decode one from the source image and add it to the cache
-   */
-  switch( c )
-    {
-
-    case JPEG:
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					  xangle, yangle, JPEG, jpeg->getQuality() )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, DEFLATE, 0 )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
-      break;
-
-
-    case DEFLATE:
-
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, DEFLATE, 0 )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
-      break;
-
-
-    case UNCOMPRESSED:
-
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
-      break;
-
-
-    default: 
-      break;
-
-    }
+  // Try to get this tile from our cache first. The cache hands us back our own copy
+  // of the tile, so it is safe to use even if another thread evicts the cached version
+  CacheKey key = tileCache->getIndex( image->getImagePath(), resolution, tile, xangle, yangle,
+				      c, (c == JPEG) ? jpeg->getQuality() : 0 );
+  found = tileCache->getTile( key, rawtile );
+  bool waited = false;
 
 
   // If we haven't been able to get a tile, get a raw one
-  if( !rawtile || (rawtile && (rawtile->timestamp < image->timestamp)) ){
+  while( !found || (rawtile.timestamp < image->timestamp) ){
 
-    if( rawtile && (rawtile->timestamp < image->timestamp) ){
+    if( found && (rawtile.timestamp < image->timestamp) ){
       if( loglevel >= 3 ) *logfile << "TileManager :: Tile has old timestamp "
-			           << rawtile->timestamp << " - " << image->timestamp
+			           << rawtile.timestamp << " - " << image->timestamp
                                    << " ... updating" << endl;
     }
 
-    RawTile newtile = this->getNewTile( resolution, tile, xangle, yangle, layers, c );
+    // Make sure that only one request at a time decodes any given tile. If another thread
+    // or process is already doing so, wait for it to finish and look in our cache again.
+    // Should the tile still be missing, as when it was not admitted to our cache, decode
+    // it ourselves rather than queueing again behind every other request waiting for it
+    bool claimed = false;
+    if( !waited ){
+      if( !tileCache->acquire( key ) ){
+	if( loglevel >= 3 ) *logfile << "TileManager :: Waited for concurrent decoding of this tile" << endl;
+	waited = true;
+	found = tileCache->getTile( key, rawtile );
+	continue;
+      }
+      claimed = true;
+    }
+    else if( loglevel >= 3 ) *logfile << "TileManager :: Tile not cached after concurrent decoding" << endl;
+
+    try{
+      RawTile newtile = this->getNewTile( resolution, tile, xangle, yangle, layers, c, padded );
+      if( claimed ) tileCache->release( key );
 
-    if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
-				 << tile_timer.getTime() << " microseconds" << endl;
-    return newtile;
+      if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
+				   << tile_timer.getTime() << " microseconds" << endl;
+      return newtile;
+    }
+    catch( ... ){
+      if( claimed ) tileCache->release( key );
+      throw;
+    }
   }
 
 
   // Define our compression names
-  switch( rawtile->compressionType ){
+  switch( rawtile.compressionType ){
     case JPEG: compName = "JPEG"; break;
     case DEFLATE: compName = "DEFLATE"; break;
     case UNCOMPRESSED: compName = "UNCOMPRESSED"; break;
@@ -237,26 +331,36 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
 			       << tileCache->getMemorySize() << " MB" << endl;
 
 
+  // Restore any tile held losslessly compressed in our cache
+  if( rawtile.compressionType == DEFLATE && c != DEFLATE ){
+    if( loglevel >= 2 ) compression_timer.start();
+    DeflateCompressor deflate;
+    deflate.Decompress( rawtile );
+    if( loglevel >= 2 ) *logfile << "TileManager :: DEFLATE Decompression Time: "
+				 << compression_timer.getTime() << " microseconds" << endl;
+  }
+
+
   // Check whether the compression used for out tile matches our requested compression type.
   // If not, we must convert
 
-  if( c == JPEG && rawtile->compressionType == UNCOMPRESSED ){
-
-    // Rawtile is a pointer to the cache data, so we need to create a copy of it in case we compress it
-    RawTile ttt( *rawtile );
+  if( c == JPEG && rawtile.compressionType == UNCOMPRESSED ){
 
     // Do our JPEG compression iff we have an 8 bit per channel image and either 1 or 3 bands
-    if( rawtile->bpc==8 && (rawtile->channels==1 || rawtile->channels==3) ){
+    if( rawtile.bpc==8 && (rawtile.channels==1 || rawtile.channels==3) ){
+
+      // Our cached data is shared, so take our own copy before converting it
+      rawtile.detach();
 
       // Crop if this is an edge tile
-      if( ( (ttt.width != image->getTileWidth()) || (ttt.height != image->getTileHeight()) ) && ttt.padded ){
+      if( ( (rawtile.width != image->getTileWidth()) || (rawtile.height != image->getTileHeight()) ) && rawtile.padded ){
 	if( loglevel >= 5 ) * logfile << "TileManager :: Cropping tile" << endl;
-	this->crop( &ttt );
+	this->crop( &rawtile );
       }
 
       if( loglevel >=2 ) compression_timer.start();
-      unsigned int oldlen = rawtile->dataLength;
-      unsigned int newlen = jpeg->Compress( ttt );
+      unsigned int oldlen = rawtile.dataLength;
+      unsigned int newlen = jpeg->Compress( rawtile );
       if( loglevel >= 2 ) *logfile << "TileManager :: JPEG requested, but UNCOMPRESSED compression found in cache." << endl
 				   << "TileManager :: JPEG Compression Time: "
 				   << compression_timer.getTime() << " microseconds" << endl
@@ -265,26 +369,25 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
 
       // Add our compressed tile to the cache
       if( loglevel >= 2 ) insert_timer.start();
-      tileCache->insert( ttt );
+      rawtile.share();
+      tileCache->insert( rawtile );
       if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
 				   << " microseconds" << endl;
-
-      if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
-				   << tile_timer.getTime() << " microseconds" << endl;
-      return RawTile( ttt );
     }
   }
 
   if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
 			       << tile_timer.getTime() << " microseconds" << endl;
 
-  return RawTile( *rawtile );
-
+  return rawtile;
 
 }
 
 
-RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers, unsigned int x, unsigned int y, unsigned int width, unsigned int height ){
+RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers, unsigned int x, unsigned int y, unsigned int width, unsigned int height, Writer* client ){
+
+  // Don't start if our client has already gone away
+  if( client && client->cancelled() ) throw 499;
 
   // If our image type can directly handle region compositing, simply return that
   if( image->regionDecoding() ){
@@ -300,10 +403,6 @@ RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers,
   unsigned int src_tile_width = image->getTileWidth();
   unsigned int src_tile_height = image->getTileHeight();
 
-  // The tile size of the destination tile
-  unsigned int dst_tile_width = src_tile_width;
-  unsigned int dst_tile_height = src_tile_height;
-
   // The basic tile size ie. not the current tile
   unsigned int basic_tile_width = src_tile_width;
   unsigned int basic_tile_height = src_tile_height;
@@ -365,125 +464,270 @@ RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers,
   else if( bpc == 32 && sampleType == FIXEDPOINT ) region.data = new int[width*height*channels];
   else if( bpc == 32 && sampleType == FLOATINGPOINT ) region.data = new float[width*height*channels];
 
-  unsigned int current_height = 0;
+  // Our region is assembled tile by tile, shared between several threads if we have them,
+  // each decoding with its own image handle
+  RegionJob job;
+  job.manager = this;
+  job.client = client;
+  job.region = &region;
+  job.path = image->getImagePath();
+  job.currentX = image->currentX;
+  job.currentY = image->currentY;
+  job.res = res;
+  job.seq = seq;
+  job.ang = ang;
+  job.layers = layers;
+  job.x = x;
+  job.y = y;
+  job.width = width;
+  job.height = height;
+  job.whole = ( x==0 && y==0 && width==im_width && height==im_height );
+  job.startx = startx;
+  job.starty = starty;
+  job.endx = endx;
+  job.endy = endy;
+  job.xoffset = xoffset;
+  job.yoffset = yoffset;
+  job.ntlx = ntlx;
+  job.basic_tile_width = basic_tile_width;
+  job.basic_tile_height = basic_tile_height;
+  job.tiles = (endx - startx) * (endy - starty);
+  job.next = 0;
+  job.failed = false;
+  job.status = 0;
+  job.fileError = false;
+
+  // Let our image read ahead any of our tiles it must fetch from disk
+  image->prefetch( seq, ang, res, startx, starty, endx, endy );
+
+  unsigned int slots = 1;
+  if( threadPool && threadPool->size() > 0 && job.tiles > 1 ){
+    slots = threadPool->size() + 1;
+    if( slots > job.tiles ) slots = job.tiles;
+  }
+  job.handles.assign( slots, (IIPImage*) NULL );
+  job.handles[0] = image;
 
-  // Decode the image strip by strip
-  for( unsigned int i=starty; i<endy; i++ ){
+  if( slots > 1 ){
+    if( loglevel >= 3 ){
+      *logfile << "TileManager getRegion :: Decoding " << job.tiles << " tiles with up to "
+	       << slots << " threads" << endl;
+    }
+    threadPool->parallel( slots, decodeTiles, &job );
+  }
+  else decodeTiles( &job, 0 );
+
+  // Keep the image handles of our other threads open for reuse
+  for( unsigned int n = 1; n < job.handles.size(); n++ ){
+    IIPImage* handle = job.handles[n];
+    if( !handle ) continue;
+    if( imagePool ){
+      if( job.failed ) imagePool->discard( handle );
+      else imagePool->checkin( handle );
+    }
+    else delete handle;
+  }
 
-    unsigned int buffer_index = 0;
+  if( job.failed ){
+    if( job.status != 0 ) throw job.status;
+    if( job.fileError ) throw file_error( job.error );
+    throw job.error;
+  }
 
-    // Keep track of the current pixel boundary horizontally. ie. only up
-    //  to the beginning of the current tile boundary.
-    unsigned int current_width = 0;
+  return region;
 
-    for( unsigned int j=startx; j<endx; j++ ){
+}
 
-      // Time the tile retrieval
-      if( loglevel >= 2 ) tile_timer.start();
 
-      // Get an uncompressed tile
-      RawTile rawtile = this->getTile( res, (i*ntlx) + j, seq, ang, layers, UNCOMPRESSED );
 
-      if( loglevel >= 2 ){
-	*logfile << "TileManager getRegion :: Tile access time " << tile_timer.getTime() << " microseconds for tile "
-		 << (i*ntlx) + j << " at resolution " << res << endl;
+void TileManager::decodeTiles( void* context, unsigned int slot ){
+
+  RegionJob* job = static_cast<RegionJob*>( context );
+  TileManager* manager = job->manager;
+
+  try{
+
+    // Our first slot is run by our calling thread with our own image. Others take another
+    // open handle to the same image if one is idle or else open a copy of our image
+    if( slot > 0 ){
+      {
+	ScopedLock l( job->lock );
+	if( job->failed || job->next == job->tiles ) return;
+      }
+      IIPImage* handle = NULL;
+      if( manager->imagePool ) handle = manager->imagePool->checkout( job->path, job->currentX, job->currentY );
+      if( !handle ){
+	handle = manager->image->duplicate();
+	if( !handle ) return;
+	job->handles[slot] = handle;
+	if( manager->imagePool ) manager->imagePool->track( handle );
+	handle->openImage();
       }
+      job->handles[slot] = handle;
+    }
 
+    // Only our calling thread logs, as our log is not shared between threads
+    TileManager helper( manager->tileCache, job->handles[slot], manager->watermark, manager->jpeg,
+			manager->logfile, 0 );
+    TileManager* decoder = ( slot == 0 ) ? manager : &helper;
+    int loglevel = decoder->loglevel;
 
-      // Only print this out once per image
-      if( (loglevel >= 4) && (i==starty) && (j==starty) ){
-	*logfile << "TileManager getRegion :: Tile data is " << rawtile.channels << " channels, "
-		 << rawtile.bpc << " bits per channel" << endl;
+    while( true ){
+
+      unsigned int n;
+      {
+	ScopedLock l( job->lock );
+	if( job->failed || job->next == job->tiles ) return;
+	n = job->next++;
       }
 
-      // Set the tile width and height to be that of the source tile - Use the rawtile data
-      // because if we take a tile from cache the image pointer will not necessarily be pointing
-      // to the the current tile
-      src_tile_width = rawtile.width;
-      src_tile_height = rawtile.height;
-      dst_tile_width = src_tile_width;
-      dst_tile_height = src_tile_height;
-
-      // Variables for the pixel offset within the current tile
-      unsigned int xf = 0;
-      unsigned int yf = 0;
-
-      // If our viewport has been set, we need to modify our start
-      // and end points on the source image
-      if( !( x==0 && y==0 && width==im_width && height==im_height ) ){
-
-	unsigned int remainder;  // Remaining pixels in the final row or column
-
-	if( j == startx ){
-	  // Calculate the width used in the current tile
-	  // If there is only 1 tile, the width is just the view width
-	  if( j < endx - 1 ) dst_tile_width = src_tile_width - xoffset;
-	  else dst_tile_width = width;
-	  xf = xoffset;
-	}
-	else if( j == endx-1 ){
-	  // If this is the final row, calculate the remaining number of pixels
-	  remainder = (width+x) % basic_tile_width;
-	  if( remainder != 0 ) dst_tile_width = remainder;
-	}
-
-	if( i == starty ){
-	  // Calculate the height used in the current row of tiles
-	  // If there is only 1 row the height is just the view height
-	  if( i < endy - 1 ) dst_tile_height = src_tile_height - yoffset;
-	  else dst_tile_height = height;
-	  yf = yoffset;
-	}
-	else if( i == endy-1 ){
-	  // If this is the final row, calculate the remaining number of pixels
-	  remainder = (height+y) % basic_tile_height;
-	  if( remainder != 0 ) dst_tile_height = remainder;
-	}
-
-	if( loglevel >= 4 ){
-	  *logfile << "TileManager getRegion :: destination tile width: " << dst_tile_width
-		   << ", tile height: " << dst_tile_height << endl;
-	}
+      unsigned int i = job->starty + n / (job->endx - job->startx);
+      unsigned int j = job->startx + n % (job->endx - job->startx);
+
+      // Time the tile retrieval
+      if( loglevel >= 2 ) decoder->tile_timer.start();
+
+      // Stop decoding if our client has gone away. Only our calling thread checks this
+      if( slot == 0 && job->client && job->client->cancelled() ){
+	if( loglevel >= 2 ) *(decoder->logfile) << "TileManager getRegion :: Client has gone away: abandoning region" << endl;
+	throw 499;
       }
 
+      // Get an uncompressed tile, which we composite as soon as we have it, so it can be left padded
+      RawTile rawtile = decoder->getTile( job->res, (i*job->ntlx) + j, job->seq, job->ang, job->layers, UNCOMPRESSED, true );
+
+      if( loglevel >= 2 ){
+	*(decoder->logfile) << "TileManager getRegion :: Tile access time " << decoder->tile_timer.getTime()
+			    << " microseconds for tile " << (i*job->ntlx) + j << " at resolution " << job->res << endl;
+      }
 
-      // Copy our tile data into the appropriate part of the strip memory
-      // one whole tile width at a time
-      for( unsigned int k=0; k<dst_tile_height; k++ ){
-
-	buffer_index = (current_width*channels) + (k*width*channels) + (current_height*width*channels);
-	unsigned int inx = ((k+yf)*rawtile.width*channels) + (xf*channels);
-
-	// Simply copy the line of data across
-	if( bpc == 8 ){
-	  unsigned char* ptr = (unsigned char*) rawtile.data;
-	  unsigned char* buf = (unsigned char*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels );
-	}
-	else if( bpc ==  16 ){
-	  unsigned short* ptr = (unsigned short*) rawtile.data;
-	  unsigned short* buf = (unsigned short*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*2 );
-	}
-	else if( bpc == 32 && sampleType == FIXEDPOINT ){
-	  unsigned int* ptr = (unsigned int*) rawtile.data;
-	  unsigned int* buf = (unsigned int*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
-	}
-	else if( bpc == 32 && sampleType == FLOATINGPOINT ){
-	  float* ptr = (float*) rawtile.data;
-	  float* buf = (float*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
-	}
+      // Only print this out once per image
+      if( (loglevel >= 4) && (n == 0) ){
+	*(decoder->logfile) << "TileManager getRegion :: Tile data is " << rawtile.channels << " channels, "
+			    << rawtile.bpc << " bits per channel" << endl;
       }
 
-      current_width += dst_tile_width;
+      decoder->composite( *job, rawtile, i, j );
+    }
+
+  }
+  catch( int status ){
+    ScopedLock l( job->lock );
+    if( !job->failed ){ job->failed = true; job->status = status; }
+  }
+  catch( const file_error& error ){
+    ScopedLock l( job->lock );
+    if( !job->failed ){ job->failed = true; job->error = error.what(); job->fileError = true; }
+  }
+  catch( const string& error ){
+    ScopedLock l( job->lock );
+    if( !job->failed ){ job->failed = true; job->error = error; }
+  }
+  catch( ... ){
+    ScopedLock l( job->lock );
+    if( !job->failed ){ job->failed = true; job->error = "TileManager getRegion :: Unable to decode tile"; }
+  }
+
+}
+
+
+
+void TileManager::composite( const RegionJob& job, const RawTile& rawtile, unsigned int i, unsigned int j ){
+
+  unsigned int width = job.width;
+  unsigned int height = job.height;
+  unsigned int x = job.x;
+  unsigned int y = job.y;
+  unsigned int channels = job.region->channels;
+  unsigned int bpc = job.region->bpc;
+  SampleType sampleType = job.region->sampleType;
+
+  // Set the tile width and height to be that of the source tile - Use the rawtile data
+  // because if we take a tile from cache the image pointer will not necessarily be pointing
+  // to the the current tile
+  unsigned int src_tile_width = rawtile.width;
+  unsigned int src_tile_height = rawtile.height;
+  unsigned int dst_tile_width = src_tile_width;
+  unsigned int dst_tile_height = src_tile_height;
+
+  // Tiles taken straight from our image's decoding buffer may still be padded
+  unsigned int src_stride = rawtile.padded ? image->getTileWidth() : src_tile_width;
+
+  // Variables for the pixel offset within the current tile
+  unsigned int xf = 0;
+  unsigned int yf = 0;
+
+  // The position of our tile within our region. Only the first row and column are cut short
+  unsigned int current_width = ( j == job.startx ) ? 0 : j*job.basic_tile_width - x;
+  unsigned int current_height = ( i == job.starty ) ? 0 : i*job.basic_tile_height - y;
+
+  // If our viewport has been set, we need to modify our start
+  // and end points on the source image
+  if( !job.whole ){
+
+    unsigned int remainder;  // Remaining pixels in the final row or column
+
+    if( j == job.startx ){
+      // Calculate the width used in the current tile
+      // If there is only 1 tile, the width is just the view width
+      if( j < job.endx - 1 ) dst_tile_width = src_tile_width - job.xoffset;
+      else dst_tile_width = width;
+      xf = job.xoffset;
+    }
+    else if( j == job.endx-1 ){
+      // If this is the final row, calculate the remaining number of pixels
+      remainder = (width+x) % job.basic_tile_width;
+      if( remainder != 0 ) dst_tile_width = remainder;
     }
 
-    current_height += dst_tile_height;
+    if( i == job.starty ){
+      // Calculate the height used in the current row of tiles
+      // If there is only 1 row the height is just the view height
+      if( i < job.endy - 1 ) dst_tile_height = src_tile_height - job.yoffset;
+      else dst_tile_height = height;
+      yf = job.yoffset;
+    }
+    else if( i == job.endy-1 ){
+      // If this is the final row, calculate the remaining number of pixels
+      remainder = (height+y) % job.basic_tile_height;
+      if( remainder != 0 ) dst_tile_height = remainder;
+    }
 
+    if( loglevel >= 4 ){
+      *logfile << "TileManager getRegion :: destination tile width: " << dst_tile_width
+	       << ", tile height: " << dst_tile_height << endl;
+    }
   }
 
-  return region;
+
+  // Copy our tile data into the appropriate part of the region
+  // one whole tile width at a time
+  for( unsigned int k=0; k<dst_tile_height; k++ ){
+
+    unsigned int buffer_index = (current_width*channels) + (k*width*channels) + (current_height*width*channels);
+    unsigned int inx = ((k+yf)*src_stride*channels) + (xf*channels);
+
+    // Simply copy the line of data across
+    if( bpc == 8 ){
+      unsigned char* ptr = (unsigned char*) rawtile.data;
+      unsigned char* buf = (unsigned char*) job.region->data;
+      memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels );
+    }
+    else if( bpc ==  16 ){
+      unsigned short* ptr = (unsigned short*) rawtile.data;
+      unsigned short* buf = (unsigned short*) job.region->data;
+      memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*2 );
+    }
+    else if( bpc == 32 && sampleType == FIXEDPOINT ){
+      unsigned int* ptr = (unsigned int*) rawtile.data;
+      unsigned int* buf = (unsigned int*) job.region->data;
+      memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
+    }
+    else if( bpc == 32 && sampleType == FLOATINGPOINT ){
+      float* ptr = (float*) rawtile.data;
+      float* buf = (float*) job.region->data;
+      memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
+    }
+  }
 
 }
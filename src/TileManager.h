@@ -29,9 +29,13 @@
 #include "RawTile.h"
 #include "IIPImage.h"
 #include "JPEGCompressor.h"
+#include "DeflateCompressor.h"
 #include "Cache.h"
+#include "ImagePool.h"
+#include "ThreadPool.h"
 #include "Timer.h"
 #include "Watermark.h"
+#include "Writer.h"
 
 
 
@@ -50,6 +54,30 @@ class TileManager{
   int loglevel;
   Timer compression_timer, tile_timer, insert_timer;
 
+  /// Optional threads with which to decode the tiles of a region in parallel
+  ThreadPool* threadPool;
+
+  /// Optional pool from which to take further open handles of our image for these threads
+  ImagePool* imagePool;
+
+  /// A region being assembled from its tiles
+  struct RegionJob;
+
+  /// Decode and composite tiles of a region until none are left
+  /** Run by each of the threads assembling a region
+      @param job RegionJob
+      @param slot our thread's number within the job: 0 is our calling thread
+   */
+  static void decodeTiles( void* job, unsigned int slot );
+
+  /// Copy the part of a tile lying within a region into place
+  /** @param job region being assembled
+      @param tile tile
+      @param i tile row
+      @param j tile column
+   */
+  void composite( const RegionJob& job, const RawTile& tile, unsigned int i, unsigned int j );
+
   /// Get a new tile from the image file
   /**
    *  If the JPEG tile already exists in the cache, use that, otherwise check for
@@ -61,9 +89,10 @@ class TileManager{
    *  @param yangle vertical sequence number
    *  @param number of quality layers within image to decode
    *  @param c CompressionType
+   *  @param padded whether an uncompressed tile may be returned uncropped
    *  @return RawTile
    */
-  RawTile getNewTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c );
+  RawTile getNewTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c, bool padded );
 
 
   /// Crop a tile to remove padding
@@ -72,6 +101,14 @@ class TileManager{
   void crop( RawTile* t );
 
 
+  /// Add a new tile to our cache
+  /** UNCOMPRESSED tiles are losslessly compressed first if our cache has a compression level.
+   *  The tile's data is handed over to an immutable shared buffer
+   *  @param t tile to insert
+   */
+  void cache( RawTile& t );
+
+
  public:
 
 
@@ -91,6 +128,19 @@ class TileManager{
     jpeg = j;
     logfile = s ;
     loglevel = l;
+    threadPool = NULL;
+    imagePool = NULL;
+  };
+
+
+  /// Decode the tiles of regions in parallel
+  /** @param t threads to share our work with
+      @param p pool of open image handles, from which further handles are taken and to
+      which they are returned
+   */
+  void setThreadPool( ThreadPool* t, ImagePool* p ){
+    threadPool = t;
+    imagePool = p;
   };
 
 
@@ -106,9 +156,12 @@ class TileManager{
    *  @param yangle vertical sequence number
    *  @param layers number of quality layers within image to decode
    *  @param c CompressionType
+   *  @param padded whether a newly decoded uncompressed tile may be returned uncropped and
+   *         still held in our image's decoding buffer, in which case it is only valid until
+   *         our image is next used
    *  @return RawTile
    */
-  RawTile getTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c );
+  RawTile getTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c, bool padded = false );
 
 
 
@@ -124,9 +177,11 @@ class TileManager{
    *  @param y top offset with respect to full image
    *  @param w width of region requested
    *  @param h height of region requested
+   *  @param client writer for our client, checked between tiles so that we can stop if the
+   *         client goes away, in which case an int 499 status is thrown
    *  @return RawTile
    */
-    RawTile getRegion( unsigned int res, int xangle, int yangle, int layers, unsigned int x, unsigned int y, unsigned int w, unsigned int h );
+    RawTile getRegion( unsigned int res, int xangle, int yangle, int layers, unsigned int x, unsigned int y, unsigned int w, unsigned int h, Writer* client = NULL );
 
 };
 
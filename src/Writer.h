@@ -25,6 +25,13 @@
 
 #include <fcgiapp.h>
 #include <cstdio>
+#include "RawTile.h"
+
+#ifndef WIN32
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
 
 
 /// Virtual base class for various writers
@@ -32,6 +39,12 @@ class Writer {
 
  public:
 
+  /// Whether tiles may be sent directly from their shared data rather than copied into our output
+  /** This must be disabled if the whole response is needed in our buffer, such as for Memcached */
+  bool direct;
+
+  Writer() : direct( true ) {};
+
   virtual ~Writer() = 0;
 
   /// Write out a binary string
@@ -48,15 +61,51 @@ class Writer {
   /** \param msg message string */
   virtual int printf( const char* msg ) = 0;
 
+  /// Write out the data of a tile
+  /** Writers that only send their output once the request is complete may keep a
+      reference to a tile with shared data rather than copying it
+      \param tile tile to write
+  */
+  virtual int putTile( const RawTile& tile ) {
+    return putStr( static_cast<const char*>( tile.data ), tile.dataLength );
+  };
+
   /// Flush the output buffer
   virtual int flush() = 0;
 
+  /// Whether the client has gone away, in which case there is no point continuing our work
+  /** This is cheap enough to be checked between tiles or strips */
+  virtual bool cancelled() { return false; };
+
+
+ protected:
+
+  /// Check without blocking whether the peer of a socket has closed its connection
+  /** @param fd socket
+      @param type if positive, also treat an incoming FCGI record of this type as a close
+      @return true if the connection has been closed or reset
+   */
+  static bool closed( int fd, int type = -1 ){
+#ifndef WIN32
+    if( fd < 0 ) return false;
+    unsigned char header[8];
+    ssize_t n = recv( fd, header, sizeof(header), MSG_PEEK | MSG_DONTWAIT );
+    if( n == 0 ) return true;
+    if( n < 0 ) return ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR );
+    if( type > 0 && n >= 2 && header[1] == type ) return true;
+#endif
+    return false;
+  };
+
 };
 
 
+inline Writer::~Writer() {}
+
+
 
 /// FCGI Writer Class
-class FCGIWriter {
+class FCGIWriter : public Writer {
 
  private:
 
@@ -64,6 +113,9 @@ class FCGIWriter {
   FCGX_Stream *out;
   static const unsigned int bufsize = 65536;
 
+  /// Our connection to the web server
+  int socket;
+
   /// Add the message to our buffer
   void cpy2buf( const char* msg, size_t len ){
     if( sz+len > bufsize ) buffer = (char*) realloc( buffer, sz+len );
@@ -80,8 +132,12 @@ class FCGIWriter {
   size_t sz;
 
   /// Constructor
-  FCGIWriter( FCGX_Stream* o ){
+  /** @param o FCGI output stream
+      @param s socket connected to the web server, used to detect aborted requests
+   */
+  FCGIWriter( FCGX_Stream* o, int s = -1 ){
     out = o;
+    socket = s;
     buffer = (char*) malloc(bufsize);
     sz = 0;
   };
@@ -105,12 +161,19 @@ class FCGIWriter {
     return FCGX_FFlush( out );
   };
 
+  /// The web server has gone away if a write has failed or if it has closed our connection
+  /// or sent an FCGI_ABORT_REQUEST record, which libfcgi itself ignores
+  bool cancelled(){
+    if( FCGX_GetError( out ) != 0 ) return true;
+    return Writer::closed( socket, 2 );
+  };
+
 };
 
 
 
 /// File Writer Class
-class FileWriter {
+class FileWriter : public Writer {
 
  private:
 